@@ -0,0 +1,20 @@
+#version 150 core
+
+// Passes the particle state on to compactParticles.geom, which keeps the live ones.
+
+in vec3 VertexPosition;
+in vec3 VertexVelocity;
+in float VertexStartTime;
+in float VertexEmitter;
+
+out vec3 vPosition;
+out vec3 vVelocity;
+out float vStartTime;
+out float vEmitter;
+
+void main() {
+	vPosition = VertexPosition;
+	vVelocity = VertexVelocity;
+	vStartTime = VertexStartTime;
+	vEmitter = VertexEmitter;
+}
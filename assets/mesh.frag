@@ -11,30 +11,34 @@ uniform vec3        uLineColor2;
 uniform float        uLineGapAlpha;
 uniform vec3        uVolumeColor;
 uniform vec3        uFalloffColor;
+uniform bool        uLengthLines;   // lines run along the plume (rows), or across it (columns)
+uniform vec2        uLineRes;       // rows and columns of the grid the lines follow
+uniform float       uLineSpacing;   // rows (or columns) from one line to the next
 
 uniform mat3 ciNormalMatrix;
 
-in vec2 vTexCoord0;
+in vec2 vTexCoord0;      // position on the mesh grid
+in vec2 vFieldCoord;    // position in the displacement, normal and audio maps
+in mat3 vPlumeRotation;
 
 // interpolated surface normal from vertex shader
 in vec3 vNormal;
-in vec3 vColor;
 
 out vec4 oColor;
 
 void main(){
     
-    vec3 uLineColor = mix(uLineColor1,uLineColor2,vColor.g);
+    vec3 uLineColor = mix(uLineColor1,uLineColor2,vTexCoord0.y);
     
-    float uVolume = texture( uTexAudio, vTexCoord0.xy ).r;
+    float uVolume = texture( uTexAudio, vFieldCoord ).r;
     uLineColor = mix(uLineColor, uVolumeColor, uVolume);
     
     // retrieve normal from texture
-    vec3 Nmap = texture( uTexNormal, vTexCoord0.xy ).rgb;
+    vec3 Nmap = texture( uTexNormal, vFieldCoord ).rgb;
 
     // modify it with the original surface normal
     const vec3 Ndirection = vec3(0.0, 1.0, 0.0);	// see: normal_map.frag (y-direction)
-    vec3 Nfinal = ciNormalMatrix * normalize( vNormal + Nmap - Ndirection );
+    vec3 Nfinal = ciNormalMatrix * vPlumeRotation * normalize( vNormal + Nmap - Ndirection );
 
     // perform some falloff magic
     float falloff = sin( max( dot( Nfinal, vec3(0.25, 1.0, 0.25) ), 0.0) * 2.25);
@@ -42,7 +46,9 @@ void main(){
     
     if (uEnableLines){
         // 2 point adaptation of https://codea.io/talk/discussion/3170/render-a-mesh-as-wireframe
-        float a = vColor.r;
+        // 1 on a line, falling off linearly to 0 half way to the next one
+        float t = uLengthLines ? vTexCoord0.y * uLineRes.y : vTexCoord0.x * uLineRes.x;
+        float a = abs( fract( t / uLineSpacing ) * 2.0 - 1.0 );
         float lineWidth = uLineWidth * pow( falloff, 25.0 );
         a = smoothstep( 1.0 - lineWidth, 1, a );
         oColor = vec4( uLineColor, mix(uLineGapAlpha,1,a) );
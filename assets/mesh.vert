@@ -1,22 +1,47 @@
 #version 150
 
+#define MAX_PLUMES 64
+
 uniform sampler2D uTexDisplacement;
+uniform sampler2D uTexSpectrum;     // band levels, one texel per band
+uniform float     uSpectrumFloor;   // band level treated as silence
 
 uniform mat4 ciModelViewProjection;
 
+// one entry per instance, see PlumeInstance in PlumeMesh.h
+struct Plume {
+	mat4 transform;
+	vec4 window;    // xy: offset, zw: scale of the part of the field this plume shows
+	vec4 audio;     // x: band driving the displacement, or -1, y: gain of that band
+};
+
+layout(std140) uniform Plumes {
+	Plume uPlumes[MAX_PLUMES];
+};
+
 in vec4 ciPosition;
 in vec3 ciNormal;
-in vec3 ciColor;
 in vec2 ciTexCoord0;
 
 out vec3 vNormal;
-out vec3 vColor;
 out vec2 vTexCoord0;
+out vec2 vFieldCoord;
+out mat3 vPlumeRotation;
 
 void main()
 {
+	Plume plume = uPlumes[gl_InstanceID];
+	vec2 fieldCoord = plume.window.xy + ciTexCoord0.xy * plume.window.zw;
+
 	// lookup displacement in map
-	float displacement = texture( uTexDisplacement, ciTexCoord0.xy ).r;
+	float displacement = texture( uTexDisplacement, fieldCoord ).r;
+
+	// plumes bound to a band swell with it
+	if( plume.audio.x >= 0.0 ) {
+		float band = texelFetch( uTexSpectrum, ivec2( int( plume.audio.x ), 0 ), 0 ).r;
+		band = clamp( ( band - uSpectrumFloor ) / ( 1.0 - uSpectrumFloor ), 0.0, 1.0 );
+		displacement *= 1.0 + plume.audio.y * band;
+	}
 
 	// now take the vertex and displace it along its normal
 	vec4 displacedPosition = ciPosition;
@@ -24,9 +49,10 @@ void main()
 
 	// pass the surface normal and texture coordinate on to the fragment shader
 	vNormal = ciNormal;
-    vColor = ciColor;
 	vTexCoord0 = ciTexCoord0;
+	vFieldCoord = fieldCoord;
+	vPlumeRotation = mat3( plume.transform );
 
 	// pass vertex on to the fragment shader
-	gl_Position = ciModelViewProjection * displacedPosition;
-}
\ No newline at end of file
+	gl_Position = ciModelViewProjection * plume.transform * displacedPosition;
+}
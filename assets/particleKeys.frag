@@ -0,0 +1,53 @@
+#version 150
+
+// Writes a (depth, particle index) pair per texel: the input of the bitonic
+// sort in particleSort.frag. Texel i holds particle i.
+
+#define MAX_EMITTERS 256
+
+uniform samplerBuffer uParticles; // 32 byte Particle records, two RGBA32F texels each
+uniform int uNumParticles;
+uniform int uWidth;
+uniform mat4 uView;
+
+uniform float Time;
+uniform float Extrapolation; // Time since the last simulation step
+
+// see updateParticles.vert
+struct EmitterData {
+	vec4 positionLifetime;
+	vec4 directionSpread;
+	vec4 spawn;
+};
+
+layout(std140) uniform Emitters {
+	EmitterData uEmitters[MAX_EMITTERS];
+};
+
+out vec4 oKey;
+
+// sorts after every visible particle
+const float Hidden = -1e30;
+
+void main()
+{
+	int i = int( gl_FragCoord.y ) * uWidth + int( gl_FragCoord.x );
+	// padding up to the power of two the sort works on
+	oKey = vec4( Hidden, -1.0, 0.0, 0.0 );
+	if( i >= uNumParticles )
+		return;
+
+	vec4 positionStartTime = texelFetch( uParticles, 2 * i );
+	vec4 velocityEmitter = texelFetch( uParticles, 2 * i + 1 );
+	float startTime = positionStartTime.w;
+	float age = Time - startTime;
+	oKey.g = float( i );
+	if( age < 0.0 || age > uEmitters[int( velocityEmitter.w )].positionLifetime.w )
+		return;
+
+	// same position as in renderBillboards.vert
+	vec3 position = positionStartTime.xyz + velocityEmitter.xyz * Extrapolation;
+	position.x += sin( Time - startTime );
+	position.y += 0.2 * sin( Time + startTime );
+	oKey.r = -( uView * vec4( position, 1.0 ) ).z;
+}
@@ -0,0 +1,37 @@
+#version 150
+
+// One compare-exchange pass of a bitonic sort over (depth, particle index)
+// pairs. Each texel works out which of itself and its partner it keeps, so a
+// pass needs no scatter. The result is ordered far to near, for back to front
+// blending.
+
+uniform sampler2D uKeys;
+uniform int uWidth;
+uniform int uBlock; // size of the bitonic sequences being merged
+uniform int uDistance; // distance to the partner in this pass
+
+out vec4 oKey;
+
+vec2 fetch( int i )
+{
+	return texelFetch( uKeys, ivec2( i % uWidth, i / uWidth ), 0 ).rg;
+}
+
+// Farther first; equal depths by index, so that both texels of a pair agree
+bool before( vec2 a, vec2 b )
+{
+	return a.x > b.x || ( a.x == b.x && a.y < b.y );
+}
+
+void main()
+{
+	int i = int( gl_FragCoord.y ) * uWidth + int( gl_FragCoord.x );
+	int partner = i ^ uDistance;
+	vec2 self = fetch( i );
+	vec2 other = fetch( partner );
+
+	// every other block is merged in reverse, which makes the next block bitonic
+	bool forwards = ( i & uBlock ) == 0;
+	bool keepFirst = forwards == ( i < partner );
+	oKey = vec4( keepFirst == before( self, other ) ? self : other, 0.0, 0.0 );
+}
@@ -0,0 +1,12 @@
+#version 150
+
+// Full screen pass of particleKeys.frag and particleSort.frag, one texel per particle.
+
+uniform mat4 ciModelViewProjection;
+
+in vec4 ciPosition;
+
+void main()
+{
+	gl_Position = ciModelViewProjection * ciPosition;
+}
@@ -0,0 +1,37 @@
+#version 150
+
+// renderParticles.frag for the billboards, with premultiplied alpha, so that
+// the particles can be blended into a transparent half resolution buffer and
+// composited afterwards.
+
+uniform sampler2D ParticleTex;
+
+uniform float Volume;
+uniform float r1;
+uniform float r2;
+uniform float g1;
+uniform float g2;
+uniform float b1;
+uniform float b2;
+
+in float Transp;
+in vec2 vTexCoord;
+
+out vec4 FragColor;
+
+void main() {
+    
+	FragColor = texture( ParticleTex, vTexCoord );
+    
+    vec3 color;
+    float d = 2 * distance( vec2(0.5,0.5), vTexCoord );
+    
+    color.r = 1 - smoothstep(r1,r2,d);
+    color.g = 1 - smoothstep(g1,g2,d);
+    color.b = 1 - smoothstep(b1,b2,d);
+    
+    color = mix( color, vec3(1,1,1), Volume );
+    
+	float alpha = clamp( FragColor.a * Transp - .1, 0.0, 1.0 );
+	FragColor = vec4( color * alpha, alpha );
+}
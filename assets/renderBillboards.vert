@@ -0,0 +1,71 @@
+#version 150 core
+
+// Camera facing quads, one instance per particle in the depth order written by
+// particleSort.frag. The quad covers as many pixels as the point sprite of
+// renderParticles.vert, without the driver's point size limit.
+
+#define MAX_EMITTERS 256
+
+uniform samplerBuffer uParticles; // 32 byte Particle records, two RGBA32F texels each
+uniform sampler2D uOrder; // particle index of each instance in .g
+uniform int uOrderWidth;
+uniform vec2 uViewportSize; // in pixels, of the frame the particles end up in
+
+uniform float MinParticleSize;
+uniform float MaxParticleSize;
+
+uniform float Time;
+uniform float Volume;
+uniform float Bands[32]; // band levels, for emitters bound to a band
+uniform float Extrapolation; // Time since the last simulation step
+
+// see updateParticles.vert
+struct EmitterData {
+	vec4 positionLifetime;
+	vec4 directionSpread;
+	vec4 spawn;
+};
+
+layout(std140) uniform Emitters {
+	EmitterData uEmitters[MAX_EMITTERS];
+};
+
+uniform mat4 ciModelViewProjection;
+
+out float Transp; // To Fragment Shader
+out vec2 vTexCoord;
+
+// triangle strip
+const vec2 Corners[4] = vec2[4]( vec2( 0.0, 0.0 ), vec2( 1.0, 0.0 ), vec2( 0.0, 1.0 ), vec2( 1.0, 1.0 ) );
+
+void main() {
+	vec2 corner = Corners[gl_VertexID];
+	// gl_PointCoord runs top to bottom
+	vTexCoord = vec2( corner.x, 1.0 - corner.y );
+	Transp = 0.0;
+	// outside the clip volume, so hidden particles are dropped before they are rasterized
+	gl_Position = vec4( 2.0, 2.0, 2.0, 1.0 );
+
+	int i = int( texelFetch( uOrder, ivec2( gl_InstanceID % uOrderWidth, gl_InstanceID / uOrderWidth ), 0 ).g );
+	if( i < 0 )
+		return;
+
+	vec4 positionStartTime = texelFetch( uParticles, 2 * i );
+	vec4 velocityEmitter = texelFetch( uParticles, 2 * i + 1 );
+	float startTime = positionStartTime.w;
+	EmitterData emitter = uEmitters[int( velocityEmitter.w )];
+	float age = Time - startTime;
+	if( age < 0.0 || age > emitter.positionLifetime.w )
+		return;
+
+	float agePct = age / emitter.positionLifetime.w;
+	float level = emitter.spawn.y >= 0.0 ? Bands[int( emitter.spawn.y )] * emitter.spawn.z : Volume;
+	Transp = 1.0 - agePct;
+	float size = mix( MinParticleSize, MaxParticleSize, agePct ) + 10.0 * sin( Time + startTime ) + 50. * level;
+
+	vec3 position = positionStartTime.xyz + velocityEmitter.xyz * Extrapolation;
+	position.x += sin( Time - startTime );
+	position.y += 0.2 * sin( Time + startTime );
+	vec4 center = ciModelViewProjection * vec4( position, 1.0 );
+	gl_Position = center + vec4( ( corner - 0.5 ) * max( size, 1.0 ) / uViewportSize * 2.0 * center.w, 0.0, 0.0 );
+}
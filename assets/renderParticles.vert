@@ -1,8 +1,12 @@
 #version 150 core
 
+#define MAX_EMITTERS 256
+
 in vec3 VertexPosition;
+in vec3 VertexVelocity;
 in float VertexStartTime;
 in vec4 VertexColor;
+in float VertexEmitter;
 
 out float Transp; // To Fragment Shader
 out vec2 vPosition;
@@ -12,21 +16,42 @@ uniform float MinParticleSize;
 uniform float MaxParticleSize;
 
 uniform float Time; 
-uniform float ParticleLifetime;
 uniform float Volume;
+uniform float Bands[32]; // band levels, for emitters bound to a band
+uniform float Extrapolation; // Time since the last simulation step
+
+// see updateParticles.vert
+struct EmitterData {
+	vec4 positionLifetime;
+	vec4 directionSpread;
+	vec4 spawn;
+};
+
+layout(std140) uniform Emitters {
+	EmitterData uEmitters[MAX_EMITTERS];
+};
 
 uniform mat4 ciModelViewProjection;
 uniform vec4 ciPosition;
 
 void main() {
+	EmitterData emitter = uEmitters[int( VertexEmitter )];
 	float age = Time - VertexStartTime;
 	Transp = 0.0;
     vPosition = ciPosition.xy;
-	gl_Position = ciModelViewProjection * vec4( VertexPosition.x + sin( Time - VertexStartTime ), VertexPosition.y + 0.2 * sin( Time + VertexStartTime ), VertexPosition.z , 1.0);
-	if( Time >= VertexStartTime ) {
-		float agePct = age / ParticleLifetime;
+	vec3 position = VertexPosition + VertexVelocity * Extrapolation;
+	gl_Position = ciModelViewProjection * vec4( position.x + sin( Time - VertexStartTime ), position.y + 0.2 * sin( Time + VertexStartTime ), position.z , 1.0);
+	// unborn particles, and dead ones waiting to respawn, stay hidden
+	if( Time >= VertexStartTime && age <= emitter.positionLifetime.w ) {
+		float agePct = age / emitter.positionLifetime.w;
+		float level = emitter.spawn.y >= 0.0 ? Bands[int( emitter.spawn.y )] * emitter.spawn.z : Volume;
 		Transp = 1.0 - agePct;
         vSize = mix( MinParticleSize, MaxParticleSize, agePct );
-        gl_PointSize = vSize + 10.0 * sin( Time + VertexStartTime ) + 50.*Volume;
+        gl_PointSize = vSize + 10.0 * sin( Time + VertexStartTime ) + 50.*level;
+	}
+	else {
+		// outside the clip volume, so the point is dropped before it is rasterized
+		gl_Position = vec4( 2.0, 2.0, 2.0, 1.0 );
+		gl_PointSize = 1.0;
 	}
-}
\ No newline at end of file
+}
@@ -5,23 +5,44 @@ in vec2				TexCoord0;
 out vec4			outputColor;
 
 uniform sampler2D	uTex0;
+uniform sampler2D	uTexSpectrum;   // band levels, low to high frequency along x
 uniform float       dx;
+uniform vec2        uSize;          // size of the ping-pong buffer in pixels
+
+uniform float       uVolume;
+uniform float       uSpectrumMix;   // 0 = broadband volume, 1 = one band per row
+uniform float       uSpectrumGain;
+uniform float       uSpectrumFloor; // band level treated as silence
+uniform float       uInjectWidth;   // width of the injection strip in pixels
+uniform bool        uInjectCircle;
+uniform float       uBeat;          // extra injection on the beat, decaying until the next
 
 float fadeSpeed = 0.0001f;
 
 void main(){
-    
+
     vec2 v = TexCoord0.xy;
-    
+
     v.x += dx;
-    
+
     outputColor = texture( uTex0, v);
-    
+
     if (outputColor.r >= 0.01) outputColor.r -= fadeSpeed;
     else outputColor.r = 0.0;
     if (outputColor.b >= 0.01) outputColor.b -= fadeSpeed;
     else outputColor.b = 0.0;
     if (outputColor.g >= 0.01) outputColor.g -= fadeSpeed;
     else outputColor.g = 0.0;
-    
-}
\ No newline at end of file
+
+    // inject the current audio at the right hand edge, each row driven by its own band
+    vec2 p = TexCoord0 * uSize;
+    bool inject = uInjectCircle ? distance( p, vec2( uSize.x, 0.5 * uSize.y ) ) < 0.5 * uSize.y
+                                : p.x > uSize.x - uInjectWidth;
+    if (inject) {
+        float band = texture( uTexSpectrum, vec2( TexCoord0.y, 0.5 ) ).r;
+        band = clamp( ( band - uSpectrumFloor ) / ( 1.0 - uSpectrumFloor ), 0.0, 1.0 ) * uSpectrumGain;
+        float level = mix( uVolume, band, uSpectrumMix ) * ( 1.0 + uBeat );
+        outputColor = vec4( level, level, level, 1.0 );
+    }
+
+}
@@ -1,21 +1,64 @@
 #version 150 core
 
+#define MAX_EMITTERS 256
+
 in vec3 VertexPosition;
 in vec3 VertexVelocity;
 in float VertexStartTime;
-in vec3 VertexInitialVelocity;
+in vec4 VertexInitialVelocity; // random unit direction (xyz) and speed fraction (w)
 in vec4 VertexColor;
+in float VertexEmitter;
 
 out vec3 Position; // To Transform Feedback
 out vec3 Velocity; // To Transform Feedback
 out vec4 Color; // To Transform Feedback
 out float StartTime; // To Transform Feedback
+out float Emitter; // To Transform Feedback (interleaved layout only)
 
 uniform float Time; // Time
 uniform float H;	// Elapsed time between frames
-uniform vec3 Accel; // Particle Acceleration
-uniform float ParticleLifetime; // Particle lifespan
-uniform vec3 Position0;
+uniform bool AudioSpawning; // dead particles wait for SpawnProbability instead of respawning at once
+uniform float SpawnProbability[MAX_EMITTERS]; // chance that a dead particle respawns in this step
+uniform int Step; // simulation step, seeds the respawn lottery
+
+// see Emitter in ParticleSystem.h
+struct EmitterData {
+	vec4 positionLifetime;  // xyz: position, w: lifetime
+	vec4 directionSpread;   // xyz: direction, w: spread
+	vec4 spawn;             // x: spawn interval, y: band, z: band gain, w: speed
+};
+
+layout(std140) uniform Emitters {
+	EmitterData uEmitters[MAX_EMITTERS];
+};
+
+// PCG hash, a well mixed random number per particle and step
+float random( uint seed )
+{
+	uint state = seed * 747796405u + 2891336453u;
+	uint word = ( ( state >> ( ( state >> 28u ) + 4u ) ) ^ state ) * 277803737u;
+	return float( ( word >> 22u ) ^ word ) / 4294967295.0;
+}
+
+// Smooth value noise in [-1, 1]. Replaces noise1(), which many drivers implement
+// as a constant 0. Matches particles::noise() of the CPU backend.
+float lattice( float i )
+{
+	uint x = uint( int( i ) );
+	x ^= x >> 16u;
+	x *= 0x7feb352du;
+	x ^= x >> 15u;
+	x *= 0x846ca68bu;
+	x ^= x >> 16u;
+	return float( x >> 8u ) * ( 2.0 / 16777215.0 ) - 1.0;
+}
+
+float valueNoise( float t )
+{
+	float cell = floor( t );
+	float f = t - cell;
+	return mix( lattice( cell ), lattice( cell + 1.0 ), f * f * ( 3.0 - 2.0 * f ) );
+}
 
 void main() {
 	
@@ -23,22 +66,31 @@ void main() {
 	Position = VertexPosition;
 	Velocity = VertexVelocity;
 	StartTime = VertexStartTime;
+	Emitter = VertexEmitter;
+	
+	EmitterData emitter = uEmitters[int( VertexEmitter )];
 	
 	if( Time >= StartTime ) {
 		
 		float age = Time - StartTime;
 		
-		if( age > ParticleLifetime ) {
+		bool respawn = true;
+		if( AudioSpawning )
+			respawn = random( uint( gl_VertexID ) ^ ( uint( Step ) * 2654435769u ) ) < SpawnProbability[int( VertexEmitter )];
+		
+		if( age > emitter.positionLifetime.w && respawn ) {
 			// The particle is past it's lifetime, recycle.
-			Position = Position0;
-			Velocity = VertexInitialVelocity;
+			Position = emitter.positionLifetime.xyz;
+			Velocity = ( emitter.directionSpread.xyz + emitter.directionSpread.w * VertexInitialVelocity.xyz )
+					 * VertexInitialVelocity.w * emitter.spawn.w;
 			StartTime = Time;
 		}
-		else {
+		else if( age <= emitter.positionLifetime.w ) {
 			// The particle is alive, update.
             Position += Velocity * H;
-            Velocity.x += 2.0*noise1(Time+VertexStartTime) * H;//Accel * H;
-            Velocity.y += 1.0*noise1(Time+VertexStartTime) * H;//Accel * H;
+            float drift = valueNoise( Time + VertexStartTime );
+            Velocity.x += 2.0*drift * H;//Accel * H;
+            Velocity.y += 1.0*drift * H;//Accel * H;
 		}
 	}
-}
\ No newline at end of file
+}
@@ -0,0 +1,55 @@
+//
+//  AudioFeatureNode.cpp
+//  MusicalSmoke
+//
+
+#include "cinder/audio/Context.h"
+
+#include "AudioFeatureNode.h"
+
+using namespace ci;
+using namespace std;
+
+AudioFeatureNode::AudioFeatureNode( const AudioFeatureExtractor::Format &analysisFormat, const Format &format )
+: NodeAutoPullable( format ), mAnalysisFormat( analysisFormat )
+{
+}
+
+void AudioFeatureNode::initialize()
+{
+    // runs off the audio thread, so this is the place to allocate
+    mExtractor.setup( getSampleRate(), mAnalysisFormat );
+}
+
+void AudioFeatureNode::process( audio::Buffer *buffer )
+{
+    if( ! mExtractor.process( buffer->getChannel( 0 ), buffer->getNumFrames() ) )
+        return;
+
+    // a full queue means the render thread has stalled; its history is stale by then anyway
+    if( Snapshot *snapshot = mSnapshots.getWriteSlot() ) {
+        snapshot->features = mExtractor.getFeatures();
+        snapshot->time = double( getContext()->getNumProcessedFrames() + buffer->getNumFrames() ) / getSampleRate();
+        mSnapshots.push();
+    }
+}
+
+const AudioFeatures& AudioFeatureNode::getFeatures( double seconds )
+{
+    Snapshot snapshot;
+    while( mSnapshots.pop( &snapshot ) )
+        mHistory.push_back( snapshot );
+
+    // keep a second, far more than any output latency
+    while( mHistory.size() > 1 && mHistory.front().time < mHistory.back().time - 1.0 )
+        mHistory.pop_front();
+
+    // the newest frame that is not ahead of the audio asked for
+    if( ! mHistory.empty() ) {
+        auto it = mHistory.rbegin();
+        while( it + 1 != mHistory.rend() && it->time > seconds )
+            ++it;
+        mSelected = *it;
+    }
+    return mSelected.features;
+}
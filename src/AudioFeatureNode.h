@@ -0,0 +1,54 @@
+//
+//  AudioFeatureNode.h
+//  MusicalSmoke
+//
+//  Runs AudioFeatureExtractor on the audio thread and hands every new frame,
+//  stamped with the context time of the audio it analysed, to the render
+//  thread through a lock-free queue. The render thread keeps a short history
+//  and picks the frame that matches the audio heard when its picture shows.
+//
+
+#ifndef AudioFeatureNode_h
+#define AudioFeatureNode_h
+
+#include "cinder/audio/Node.h"
+
+#include "AudioFeatures.h"
+#include "SnapshotQueue.h"
+
+#include <deque>
+
+typedef std::shared_ptr<class AudioFeatureNode> AudioFeatureNodeRef;
+
+class AudioFeatureNode : public cinder::audio::NodeAutoPullable {
+
+public:
+    AudioFeatureNode( const AudioFeatureExtractor::Format &analysisFormat = AudioFeatureExtractor::Format(), const Format &format = Format() );
+
+    //! Returns the last features analysed from audio rendered by context time \a seconds, or the
+    //! oldest ones kept when that is too far back. Never blocks; call from one (render) thread only.
+    const AudioFeatures& getFeatures( double seconds );
+    //! Context time of the end of the audio analysed for the features last returned by getFeatures().
+    double getFeaturesTime() const { return mSelected.time; }
+
+protected:
+    void initialize() override;
+    void process( cinder::audio::Buffer *buffer ) override;
+
+private:
+    struct Snapshot {
+        AudioFeatures   features;
+        double          time = 0;
+    };
+
+    AudioFeatureExtractor::Format   mAnalysisFormat;
+    AudioFeatureExtractor           mExtractor;
+    //! Three quarters of a second of analysis frames at the default hop.
+    SnapshotQueue<Snapshot, 64>     mSnapshots;
+
+    // render thread
+    std::deque<Snapshot>            mHistory;
+    Snapshot                        mSelected;
+};
+
+#endif /* AudioFeatureNode_h */
@@ -0,0 +1,109 @@
+//
+//  AudioFeatures.cpp
+//  MusicalSmoke
+//
+
+#include <algorithm>
+#include <cmath>
+
+#include "cinder/audio/dsp/Dsp.h"
+#include "cinder/audio/Utilities.h"
+
+#include "AudioFeatures.h"
+#include "SpectralKernels.h"
+
+using namespace ci;
+using namespace std;
+
+void AudioFeatureExtractor::setup( size_t sampleRate, const Format &format )
+{
+    mFormat = format;
+    mFormat.windowSize = std::min( mFormat.windowSize, mFormat.fftSize );
+    mFormat.hopSize = std::max<size_t>( std::min( mFormat.hopSize, mFormat.windowSize ), 1 );
+    mSampleRate = sampleRate;
+
+    mHistory.assign( mFormat.windowSize, 0.0f );
+    mHistoryPos = 0;
+    mSamplesSinceHop = 0;
+
+    mWindow.resize( mFormat.windowSize );
+    audio::dsp::generateWindow( audio::dsp::WindowType::BLACKMAN, mWindow.data(), mWindow.size() );
+
+    mFft.reset( new audio::dsp::Fft( mFormat.fftSize ) );
+    mFftBuffer = audio::Buffer( mFormat.fftSize );
+    mSpectral = audio::BufferSpectral( mFormat.fftSize );
+    mMagSpectrum.assign( mFormat.fftSize / 2, 0.0f );
+
+    // log-spaced band edges, in bins, at least one bin wide
+    const float binWidth = float( mSampleRate ) / mFormat.fftSize;
+    const float maxFrequency = std::min( mFormat.maxFrequency, mSampleRate / 2.0f );
+    const float ratio = maxFrequency / mFormat.minFrequency;
+    mBandEdges.resize( AudioFeatures::NumBands + 1 );
+    for( int i = 0; i <= AudioFeatures::NumBands; i++ ) {
+        float frequency = mFormat.minFrequency * pow( ratio, float( i ) / AudioFeatures::NumBands );
+        size_t bin = size_t( frequency / binWidth + 0.5f );
+        if( i > 0 )
+            bin = std::max( bin, mBandEdges[i - 1] + 1 );
+        mBandEdges[i] = std::min( bin, mMagSpectrum.size() );
+    }
+
+    mBeatTracker.setup( double( mSampleRate ) / mFormat.hopSize );
+
+    mFeatures = AudioFeatures();
+}
+
+bool AudioFeatureExtractor::process( const float *samples, size_t numSamples )
+{
+    if( mHistory.empty() )
+        return false;
+
+    bool analyzed = false;
+    for( size_t i = 0; i < numSamples; i++ ) {
+        mHistory[mHistoryPos] = samples[i];
+        mHistoryPos = ( mHistoryPos + 1 ) % mHistory.size();
+
+        if( ++mSamplesSinceHop >= mFormat.hopSize ) {
+            mSamplesSinceHop = 0;
+            analyze();
+            analyzed = true;
+        }
+    }
+
+    return analyzed;
+}
+
+void AudioFeatureExtractor::analyze()
+{
+    // unroll the history so the oldest sample comes first, zero padded to the fft size
+    const size_t windowSize = mHistory.size();
+    float *fftIn = mFftBuffer.getData();
+    std::copy( mHistory.begin() + mHistoryPos, mHistory.end(), fftIn );
+    std::copy( mHistory.begin(), mHistory.begin() + mHistoryPos, fftIn + ( windowSize - mHistoryPos ) );
+    std::fill( fftIn + windowSize, fftIn + mFormat.fftSize, 0.0f );
+
+    mFeatures.volume = spectral::rms( fftIn, windowSize );
+
+    spectral::applyWindow( fftIn, mWindow.data(), windowSize );
+    mFft->forward( &mFftBuffer, &mSpectral );
+
+    // the nyquist component is packed into imag[0]
+    float *real = mSpectral.getReal();
+    float *imag = mSpectral.getImag();
+    imag[0] = 0.0f;
+
+    spectral::magnitudes( real, imag, mMagSpectrum.data(), mMagSpectrum.size(), 1.0f / mFormat.fftSize );
+
+    float levels[AudioFeatures::NumBands];
+    spectral::bandMeans( mMagSpectrum.data(), mBandEdges.data(), levels, AudioFeatures::NumBands );
+    for( int b = 0; b < AudioFeatures::NumBands; b++ )
+        levels[b] = audio::linearToDecibel( levels[b] ) / 100.0f;
+
+    // smoothing and spectral flux in one pass: the flux is the total rise of the smoothed levels
+    mFeatures.onset = spectral::smooth( mFeatures.bands, levels, mFormat.smoothing, AudioFeatures::NumBands );
+
+    mBeatTracker.process( mFeatures.onset );
+    mFeatures.beatPhase = mBeatTracker.getPhase();
+    mFeatures.tempo = mBeatTracker.getTempo();
+    mFeatures.beatConfidence = mBeatTracker.getConfidence();
+    mFeatures.frame++;
+}
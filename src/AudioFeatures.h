@@ -0,0 +1,84 @@
+//
+//  AudioFeatures.h
+//  MusicalSmoke
+//
+//  Per-hop audio analysis shared by the live audio graph and offline renders.
+//
+
+#ifndef AudioFeatures_h
+#define AudioFeatures_h
+
+#include "cinder/audio/Buffer.h"
+#include "cinder/audio/dsp/Fft.h"
+
+#include "BeatTracker.h"
+
+#include <memory>
+#include <vector>
+
+//! One analysis frame. Plain data, so it can be copied on the audio thread.
+struct AudioFeatures {
+    static const int NumBands = 32;
+
+    //! RMS of the analysis window.
+    float       volume = 0;
+    //! Log-spaced band levels, normalized to [0, 1] on a decibel scale.
+    float       bands[NumBands] = {};
+    //! Positive spectral flux across the bands; peaks on note and drum onsets.
+    float       onset = 0;
+    //! Position within the beat, in [0, 1) with 0 on the beat, and the tempo in beats per minute. See BeatTracker.
+    float       beatPhase = 0;
+    float       tempo = 0;
+    //! How far beatPhase and tempo can be trusted, in [0, 1].
+    float       beatConfidence = 0;
+    //! Number of analysis frames computed so far.
+    uint64_t    frame = 0;
+};
+
+//! Turns a stream of mono samples into AudioFeatures, one frame per hop.
+//! Allocates only in setup(), so process() is safe to call on the audio thread.
+class AudioFeatureExtractor{
+
+public:
+    struct Format {
+        size_t  fftSize = 2048;
+        size_t  windowSize = 1024;
+        size_t  hopSize = 512;
+        float   minFrequency = 40.0f;
+        float   maxFrequency = 16000.0f;
+        //! Weight of the previous frame when smoothing band levels, in [0, 1).
+        float   smoothing = 0.5f;
+    };
+
+    void setup( size_t sampleRate, const Format &format );
+    void setup( size_t sampleRate ) { setup( sampleRate, Format() ); }
+
+    //! Feeds \a numSamples samples. Returns true if at least one new frame was completed.
+    bool process( const float *samples, size_t numSamples );
+
+    const AudioFeatures& getFeatures() const { return mFeatures; }
+    //! The format in use, after setup() has fitted the window and hop into the fft size.
+    const Format& getFormat() const { return mFormat; }
+
+private:
+    void analyze();
+
+    Format                                  mFormat;
+    size_t                                  mSampleRate = 0;
+
+    std::vector<float>                      mHistory;
+    size_t                                  mHistoryPos = 0;
+    size_t                                  mSamplesSinceHop = 0;
+
+    std::vector<float>                      mWindow;
+    std::unique_ptr<cinder::audio::dsp::Fft> mFft;
+    cinder::audio::Buffer                   mFftBuffer;
+    cinder::audio::BufferSpectral           mSpectral;
+    std::vector<float>                      mMagSpectrum;
+    std::vector<size_t>                     mBandEdges;
+    BeatTracker                             mBeatTracker;
+
+    AudioFeatures                           mFeatures;
+};
+
+#endif /* AudioFeatures_h */
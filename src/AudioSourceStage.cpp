@@ -0,0 +1,282 @@
+//
+//  AudioSourceStage.cpp
+//  MusicalSmoke
+//
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+
+#include "cinder/app/App.h"
+#include "cinder/audio/Device.h"
+#include "cinder/audio/Source.h"
+
+#include "AudioSourceStage.h"
+
+using namespace ci;
+using namespace ci::app;
+using namespace std;
+
+AudioSourceStage::AudioSourceStage( WorkerPool &workers )
+    : mWorkers( workers ), mPrefetch( make_shared<Prefetch>() )
+{
+}
+
+void AudioSourceStage::setup( const audio::ContextRef &context )
+{
+    mContext = context;
+    mOutput = mContext->makeNode( new audio::GainNode( 1.0f ) );
+}
+
+void AudioSourceStage::playTracks( const vector<fs::path> &tracks, bool loop, double startSeconds )
+{
+    stopAll();
+    mTracks = tracks;
+    mLoop = loop;
+    queue( 0, startSeconds );
+}
+
+void AudioSourceStage::resumeTracks()
+{
+    if( ! isLive() )
+        return;
+    stopAll();
+    queue( mResumeTrack, mResumeSeconds );
+}
+
+void AudioSourceStage::queue( size_t track, double startSeconds )
+{
+    mQueued = track < mTracks.size() ? track : NoTrack;
+    mStartSeconds = startSeconds;
+    mFailures = 0;
+    update();
+}
+
+bool AudioSourceStage::playInput( const string &name )
+{
+    // looked up first, so a missing device leaves the tracks playing
+    audio::DeviceRef device = name.empty() ? audio::Device::getDefaultInput() : audio::Device::findDeviceByName( name );
+    if( ! device ) {
+        console() << "No audio input named \"" << name << "\"" << endl;
+        return false;
+    }
+
+    if( ! isLive() ) {
+        // a track still being opened resumes where it was to start
+        mResumeTrack = mCurrent.player ? mCurrent.track : mQueued;
+        mResumeSeconds = mCurrent.player ? getPosition() : mStartSeconds;
+    }
+    stopAll();
+    mInput = mContext->createInputDeviceNode( device );
+    mInput >> mOutput;
+    mInput->enable();
+    console() << "Audio input: " << device->getName() << endl;
+    return true;
+}
+
+vector<fs::path> AudioSourceStage::loadPlaylist( const fs::path &path )
+{
+    vector<fs::path> tracks;
+    if( fs::is_directory( path ) ) {
+        const char *extensions[] = { ".mp3", ".m4a", ".aac", ".wav", ".aif", ".aiff", ".caf", ".flac", ".ogg" };
+        for( fs::directory_iterator it( path ), last; it != last; ++it ) {
+            string extension = it->path().extension().string();
+            transform( extension.begin(), extension.end(), extension.begin(), ::tolower );
+            if( find( begin( extensions ), end( extensions ), extension ) != end( extensions ) )
+                tracks.push_back( it->path() );
+        }
+        sort( tracks.begin(), tracks.end() );
+    }
+    else {
+        ifstream list( path.string().c_str() );
+        string line;
+        while( getline( list, line ) ) {
+            line.erase( line.find_last_not_of( " \t\r" ) + 1 );
+            line.erase( 0, line.find_first_not_of( " \t" ) );
+            if( line.empty() || line[0] == '#' )
+                continue;
+            fs::path track( line );
+            tracks.push_back( track.is_absolute() ? track : path.parent_path() / track );
+        }
+    }
+
+    if( tracks.empty() )
+        console() << "No tracks in " << path << endl;
+    return tracks;
+}
+
+void AudioSourceStage::update()
+{
+    if( ! mContext || isLive() )
+        return;
+
+    // the next track has taken over
+    double now = mContext->getNumProcessedSeconds();
+    if( mNext.player && now >= mNext.startTime ) {
+        retire( mCurrent );
+        swap( mCurrent, mNext );
+    }
+
+    if( mNext.player || mQueued == NoTrack )
+        return;
+
+    audio::SourceFileRef source;
+    bool failed = false;
+    {
+        lock_guard<mutex> lock( mPrefetch->mutex );
+        if( mPrefetch->loading )
+            return;
+        if( mPrefetch->track == mQueued ) {
+            source.swap( mPrefetch->source );
+            failed = mPrefetch->failed;
+            mPrefetch->failed = false;
+        }
+    }
+
+    size_t following = mQueued + 1 < mTracks.size() ? mQueued + 1 : ( mLoop ? 0 : NoTrack );
+    if( failed ) {
+        // skip it, unless none of the tracks can be opened
+        mQueued = ++mFailures < mTracks.size() ? following : NoTrack;
+        return;
+    }
+    if( ! source ) {
+        prefetch( mQueued );
+        return;
+    }
+
+    // Put the track on the free deck, connected and scheduled to start on the frame the current
+    // one ends. The switch itself then happens on the audio thread, with nothing left to open.
+    mNext.player = mContext->makeNode( new audio::FilePlayerNode( source, true ) );
+    mNext.track = mQueued;
+    mNext.player >> mOutput;
+    double when = mCurrent.player ? max( mCurrent.getEndTime(), now ) : now;
+    if( mStartSeconds > 0 )
+        mNext.player->seekToTime( mStartSeconds );
+    mNext.startTime = when - mStartSeconds;
+    mNext.player->start( when );
+    mStartSeconds = 0;
+    mFailures = 0;
+
+    // and open the one after it, long before it is needed
+    mQueued = following;
+    if( mQueued != NoTrack )
+        prefetch( mQueued );
+}
+
+void AudioSourceStage::prefetch( size_t track )
+{
+    shared_ptr<Prefetch> state = mPrefetch;
+    {
+        lock_guard<mutex> lock( state->mutex );
+        if( state->loading )
+            return;
+        state->loading = true;
+        state->track = track;
+        state->source.reset();
+        state->failed = false;
+    }
+
+    fs::path path = mTracks[track];
+    size_t sampleRate = mContext->getSampleRate();
+    mWorkers.submit( [state, path, sampleRate] {
+        audio::SourceFileRef source;
+        try {
+            // opening parses the file, and compressed ones are scanned for their length
+            source = audio::load( loadFile( path ), sampleRate );
+            source->getNumFrames();
+        }
+        catch( const std::exception &e ) {
+            console() << "Could not open " << path << ": " << e.what() << endl;
+            source.reset();
+        }
+        lock_guard<mutex> lock( state->mutex );
+        state->source = source;
+        state->failed = ! source;
+        state->loading = false;
+    });
+}
+
+void AudioSourceStage::retire( Deck &deck )
+{
+    if( ! deck.player )
+        return;
+    deck.player->stop();
+    deck.player->disconnectAll();
+    deck = Deck();
+}
+
+void AudioSourceStage::stopAll()
+{
+    retire( mCurrent );
+    retire( mNext );
+    if( mInput ) {
+        mInput->disable();
+        mInput->disconnectAll();
+        mInput.reset();
+    }
+    mQueued = NoTrack;
+}
+
+void AudioSourceStage::skip()
+{
+    if( ! mContext || isLive() )
+        return;
+
+    retire( mCurrent );
+    if( mNext.player ) {
+        mNext.player->stop();
+        mNext.player->start();
+        mNext.startTime = mContext->getNumProcessedSeconds();
+    }
+    update();
+}
+
+void AudioSourceStage::seek( double seconds )
+{
+    if( ! mCurrent.player )
+        return;
+
+    double now = mContext->getNumProcessedSeconds();
+    seconds = glm::clamp( seconds, 0.0, mCurrent.player->getNumSeconds() );
+    mCurrent.player->seekToTime( seconds );
+    mCurrent.startTime = now - seconds;
+
+    // the next track follows the new end
+    if( mNext.player ) {
+        mNext.player->stop();
+        mNext.player->seek( 0 );
+        mNext.startTime = max( mCurrent.getEndTime(), now );
+        mNext.player->start( mNext.startTime );
+    }
+}
+
+double AudioSourceStage::getPosition() const
+{
+    return mCurrent.player ? mCurrent.player->getReadPositionTime() : 0.0;
+}
+
+double AudioSourceStage::getLength() const
+{
+    return mCurrent.player ? mCurrent.player->getNumSeconds() : 0.0;
+}
+
+string AudioSourceStage::getTrackName() const
+{
+    if( isLive() )
+        return "Live input";
+    return mCurrent.player ? mTracks[mCurrent.track].filename().string() : "";
+}
+
+fs::path AudioSourceStage::getTrackPath() const
+{
+    return mCurrent.player && ! isLive() ? mTracks[mCurrent.track] : fs::path();
+}
+
+fs::path AudioSourceStage::getNextTrackPath() const
+{
+    if( isLive() )
+        return fs::path();
+    if( mNext.player )
+        return mTracks[mNext.track];
+    return mQueued != NoTrack ? mTracks[mQueued] : fs::path();
+}
@@ -0,0 +1,111 @@
+//
+//  AudioSourceStage.h
+//  MusicalSmoke
+//
+//  The front of the audio graph: a playlist of files, played back to back
+//  without gaps, or a live capture device. Everything comes out of one node,
+//  so the rest of the graph is built once and never touched on a switch.
+//
+
+#ifndef AudioSourceStage_h
+#define AudioSourceStage_h
+
+#include "cinder/audio/Context.h"
+#include "cinder/audio/GainNode.h"
+#include "cinder/audio/InputNode.h"
+#include "cinder/audio/SamplePlayerNode.h"
+#include "cinder/Filesystem.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "WorkerPool.h"
+
+class AudioSourceStage{
+
+public:
+    explicit AudioSourceStage( WorkerPool &workers );
+
+    //! Creates the output node, which lives as long as the stage.
+    void setup( const cinder::audio::ContextRef &context );
+    //! Connect this to the rest of the graph, once.
+    const cinder::audio::GainNodeRef& getOutput() const { return mOutput; }
+
+    //! Plays \a tracks in order, each one starting on the sample the previous one ends, and
+    //! from the first again after the last when \a loop is set. The first track starts
+    //! \a startSeconds in. Tracks are opened on a worker, so playback starts a little later.
+    void playTracks( const std::vector<cinder::fs::path> &tracks, bool loop = true, double startSeconds = 0 );
+    //! Switches to capture device \a name, or to the default input when empty. Returns false, and
+    //! leaves the tracks playing, when there is no such device.
+    bool playInput( const std::string &name = "" );
+    //! Goes back to the tracks after playInput(), at the track and position they were left at.
+    void resumeTracks();
+    bool isLive() const { return mInput != nullptr; }
+
+    //! The audio files in directory \a path, by name, or the lines of an .m3u style list
+    //! (one path per line, relative to the list, '#' starts a comment).
+    static std::vector<cinder::fs::path> loadPlaylist( const cinder::fs::path &path );
+
+    //! Puts the next track on a deck ahead of time and hands over between decks. Call once per frame.
+    void update();
+    //! Cuts to the next track now.
+    void skip();
+
+    //! Seeking, and the position in and length of the current track in seconds. Live input has none.
+    void        seek( double seconds );
+    double      getPosition() const;
+    double      getLength() const;
+    std::string getTrackName() const;
+    //! The files of the current and the next track, empty when there is none or the input is live.
+    cinder::fs::path getTrackPath() const;
+    cinder::fs::path getNextTrackPath() const;
+
+private:
+    //! A track on a player, and the context time at which its first frame plays.
+    struct Deck {
+        cinder::audio::FilePlayerNodeRef    player;
+        size_t                              track = 0;
+        double                              startTime = 0;
+
+        double getEndTime() const { return startTime + player->getNumSeconds(); }
+    };
+
+    //! Shared with the worker that opens the next track, which may still run after the stage is gone.
+    struct Prefetch {
+        std::mutex                      mutex;
+        cinder::audio::SourceFileRef    source;
+        size_t                          track = 0;
+        bool                            loading = false;
+        bool                            failed = false;
+    };
+
+    //! Puts \a track, \a startSeconds in, on the next free deck, and plays on from there.
+    void queue( size_t track, double startSeconds );
+    void prefetch( size_t track );
+    void retire( Deck &deck );
+    void stopAll();
+
+    static const size_t NoTrack = size_t( -1 );
+
+    WorkerPool                              &mWorkers;
+    cinder::audio::ContextRef               mContext;
+    cinder::audio::GainNodeRef              mOutput;
+    cinder::audio::InputDeviceNodeRef       mInput;
+
+    std::vector<cinder::fs::path>           mTracks;
+    bool                                    mLoop = true;
+    //! The track that goes on the next free deck.
+    size_t                                  mQueued = NoTrack;
+    double                                  mStartSeconds = 0;
+    //! Tracks in a row that could not be opened.
+    size_t                                  mFailures = 0;
+    //! Where the tracks were when the input took over.
+    size_t                                  mResumeTrack = NoTrack;
+    double                                  mResumeSeconds = 0;
+    Deck                                    mCurrent, mNext;
+    std::shared_ptr<Prefetch>               mPrefetch;
+};
+
+#endif /* AudioSourceStage_h */
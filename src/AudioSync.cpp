@@ -0,0 +1,96 @@
+//
+//  AudioSync.cpp
+//  MusicalSmoke
+//
+
+#include <cmath>
+#include <vector>
+
+#include "cinder/app/App.h"
+#include "cinder/audio/Device.h"
+#include "cinder/audio/OutputNode.h"
+
+#if defined( CINDER_MAC )
+	#include <CoreAudio/CoreAudio.h>
+#endif
+
+#include "AudioSync.h"
+
+using namespace ci;
+using namespace ci::app;
+using namespace std;
+
+void AudioSync::setup( const audio::ContextRef &context )
+{
+    mContext = context;
+    mOutputLatency = queryOutputLatency( context );
+    mBlockSeconds = double( context->getFramesPerBlock() ) / context->getSampleRate();
+    mLocked = false;
+    console() << "Audio output latency: " << 1000.0 * mOutputLatency << " ms" << endl;
+}
+
+void AudioSync::update( double wallSeconds )
+{
+    if( ! mContext )
+        return;
+
+    // The processed count steps by a block on every audio callback and stands still in between,
+    // so the offset to the wall clock is a sawtooth. Its mean lies half a block below the offset
+    // right after a callback, which is the one that counts.
+    double offset = mContext->getNumProcessedSeconds() - wallSeconds + 0.5 * mBlockSeconds;
+
+    // start over when the clock jumps, as it does when the context is paused or the device changes
+    if( ! mLocked || fabs( offset - mOffset ) > 0.1 ) {
+        mOffset = offset;
+        mLocked = true;
+    }
+    else {
+        mOffset += 0.01 * ( offset - mOffset );
+    }
+}
+
+double AudioSync::queryOutputLatency( const audio::ContextRef &context )
+{
+    auto output = dynamic_pointer_cast<audio::OutputDeviceNode>( context->getOutput() );
+    if( ! output )
+        return 0.0;
+    const audio::DeviceRef &device = output->getDevice();
+
+#if defined( CINDER_MAC )
+    // Cinder keys its devices by their Core Audio UID
+    CFStringRef uid = CFStringCreateWithCString( kCFAllocatorDefault, device->getKey().c_str(), kCFStringEncodingUTF8 );
+    AudioDeviceID deviceId = kAudioObjectUnknown;
+    AudioValueTranslation translation = { &uid, sizeof( uid ), &deviceId, sizeof( deviceId ) };
+    AudioObjectPropertyAddress address = { kAudioHardwarePropertyDeviceForUID, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMaster };
+    UInt32 size = sizeof( translation );
+    OSStatus status = AudioObjectGetPropertyData( kAudioObjectSystemObject, &address, 0, nullptr, &size, &translation );
+    CFRelease( uid );
+
+    if( status == noErr && deviceId != kAudioObjectUnknown ) {
+        UInt32 frames = 0, total = 0;
+        const AudioObjectPropertySelector selectors[] = { kAudioDevicePropertyLatency, kAudioDevicePropertySafetyOffset, kAudioDevicePropertyBufferFrameSize };
+        for( AudioObjectPropertySelector selector : selectors ) {
+            AudioObjectPropertyAddress property = { selector, kAudioObjectPropertyScopeOutput, kAudioObjectPropertyElementMaster };
+            size = sizeof( frames );
+            if( AudioObjectGetPropertyData( deviceId, &property, 0, nullptr, &size, &frames ) == noErr )
+                total += frames;
+        }
+
+        // and the latency of the first output stream, which includes converters on the way out
+        AudioObjectPropertyAddress streamsAddress = { kAudioDevicePropertyStreams, kAudioObjectPropertyScopeOutput, kAudioObjectPropertyElementMaster };
+        if( AudioObjectGetPropertyDataSize( deviceId, &streamsAddress, 0, nullptr, &size ) == noErr && size >= sizeof( AudioStreamID ) ) {
+            vector<AudioStreamID> streams( size / sizeof( AudioStreamID ) );
+            AudioObjectPropertyAddress latencyAddress = { kAudioStreamPropertyLatency, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMaster };
+            if( AudioObjectGetPropertyData( deviceId, &streamsAddress, 0, nullptr, &size, streams.data() ) == noErr ) {
+                size = sizeof( frames );
+                if( AudioObjectGetPropertyData( streams[0], &latencyAddress, 0, nullptr, &size, &frames ) == noErr )
+                    total += frames;
+            }
+        }
+        return double( total ) / device->getSampleRate();
+    }
+#endif
+
+    // elsewhere, assume the device plays one block while the next is rendered
+    return 2.0 * device->getFramesPerBlock() / device->getSampleRate();
+}
@@ -0,0 +1,46 @@
+//
+//  AudioSync.h
+//  MusicalSmoke
+//
+//  Relates the audio context's clock to the wall clock and to what comes
+//  out of the speakers, so the render loop can ask which audio is heard
+//  at the moment a frame is shown.
+//
+
+#ifndef AudioSync_h
+#define AudioSync_h
+
+#include "cinder/audio/Context.h"
+
+class AudioSync{
+
+public:
+    //! Queries the latency of the context's output device. Call again after the device changes.
+    void setup( const cinder::audio::ContextRef &context );
+
+    //! Follows the audio clock against \a wallSeconds. Call once per frame.
+    void update( double wallSeconds );
+
+    //! Context time of the audio rendered by wall time \a wallSeconds.
+    double getAudioTime( double wallSeconds ) const { return wallSeconds + mOffset; }
+    //! Context time of the audio heard from the speakers at wall time \a wallSeconds.
+    double getHeardTime( double wallSeconds ) const { return getAudioTime( wallSeconds ) - mOutputLatency - mTrim; }
+
+    //! Time from rendering audio to hearing it, in seconds.
+    double getOutputLatency() const { return mOutputLatency; }
+    //! Extra delay of the pictures against the sound, in seconds, for what no device reports (a projector, say).
+    void   setTrim( double seconds ) { mTrim = seconds; }
+
+private:
+    //! Device, stream and io buffer latency and the safety offset, from Core Audio on the Mac.
+    static double queryOutputLatency( const cinder::audio::ContextRef &context );
+
+    cinder::audio::ContextRef   mContext;
+    double                      mOutputLatency = 0;
+    double                      mBlockSeconds = 0;
+    double                      mOffset = 0;
+    bool                        mLocked = false;
+    double                      mTrim = 0;
+};
+
+#endif /* AudioSync_h */
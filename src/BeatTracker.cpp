@@ -0,0 +1,170 @@
+//
+//  BeatTracker.cpp
+//  MusicalSmoke
+//
+
+#include <algorithm>
+#include <cmath>
+
+#include "BeatTracker.h"
+
+using namespace std;
+
+namespace {
+const float TwoPi = 6.2831853f;
+// Correlation at half the beat over that at the beat, below which the onsets in between count as
+// off-beats: off-beats under about two thirds of the beat's onset strength.
+const float OffBeatRatio = 0.9f;
+// Energy landing between the tracked beats over that landing on them, above which the tracker has
+// locked to the off-beats and turns to them. Swung notes come late in the beat, so between this and
+// its inverse, when the onsets are much alike, as they are in decibels, the tracker turns too if the
+// off-beats land early: it has locked to the swung notes.
+const float OffBeatFlip = 1.5f;
+// How early, in beats, off-beats have to land to be beats.
+const float SwingEarly = 0.05f;
+}
+
+void BeatTracker::setup( double frameRate, const Format &format )
+{
+    mFormat = format;
+    mFrameRate = frameRate;
+    mMinLag = std::max<size_t>( size_t( frameRate * 60.0 / mFormat.maxTempo ), 2 );
+    mMaxLag = std::max( size_t( frameRate * 60.0 / mFormat.minTempo + 0.5 ), mMinLag + 1 );
+    mDecay = float( exp( -1.0 / ( mFormat.memory * frameRate ) ) );
+    mPhaseDecay = float( exp( -1.0 / ( mFormat.phaseMemory * frameRate ) ) );
+
+    mHistory.assign( mMaxLag + 2, 0.0f );
+    mHistoryPos = 0;
+    mCorrelation.assign( mMaxLag + 2, 0.0f );
+
+    // log-gaussian an octave wide around the preferred tempo, so half and double tempo lose
+    const double preferredLag = frameRate * 60.0 / mFormat.preferredTempo;
+    mPrior.assign( mMaxLag + 2, 0.0f );
+    for( size_t lag = 1; lag < mPrior.size(); lag++ ) {
+        double octaves = log2( lag / preferredLag );
+        mPrior[lag] = float( exp( -0.5 * octaves * octaves ) );
+    }
+
+    mMean = 0;
+    mPeriod = 0;
+    mPhase = 0;
+    mOnBeat = {{ 0.0f, 0.0f }};
+    mOffBeat = {{ 0.0f, 0.0f }};
+    mOnBeatStrength = 0;
+    mOffBeatStrength = 0;
+    mConfidence = 0;
+}
+
+void BeatTracker::process( float onset )
+{
+    if( mHistory.empty() )
+        return;
+
+    // onset with its running mean removed
+    mMean = mDecay * mMean + ( 1.0f - mDecay ) * onset;
+    const float x = onset - mMean;
+    const size_t size = mHistory.size();
+    mHistory[mHistoryPos] = x;
+
+    // leaky autocorrelation, one multiply-add per lag
+    size_t past = mHistoryPos;
+    for( size_t lag = 0; lag < size; lag++ ) {
+        mCorrelation[lag] = mDecay * mCorrelation[lag] + ( 1.0f - mDecay ) * x * mHistory[past];
+        past = past ? past - 1 : size - 1;
+    }
+    mHistoryPos = ( mHistoryPos + 1 ) % size;
+
+    // tempo: the strongest weighted peak, refined between lags by a parabola
+    size_t best = 0;
+    float bestScore = 0;
+    for( size_t lag = mMinLag; lag <= mMaxLag; lag++ ) {
+        float score = mCorrelation[lag] * mPrior[lag];
+        if( score > bestScore ) {
+            bestScore = score;
+            best = lag;
+        }
+    }
+    // The prior favours the faster of two tempos an octave apart. With onsets of strength a on the
+    // beat and b half way between, the correlation at the short lag over that at the long one is
+    // 2ab / (a^2 + b^2): about 1 when the two are alike, as kick and snare are, and smaller when the
+    // onsets in between are weaker off-beats, such as hats between kicks. Then the long lag is the beat.
+    // Both lags are summed with their neighbours, as beats fall on whole frames.
+    if( best && 2 * best + 1 <= mMaxLag ) {
+        size_t twice = 2 * best;
+        float shortLag = mCorrelation[best - 1] + mCorrelation[best] + mCorrelation[best + 1];
+        float longLag = mCorrelation[twice - 1] + mCorrelation[twice] + mCorrelation[twice + 1];
+        if( shortLag < OffBeatRatio * longLag ) {
+            for( size_t lag = 2 * best - 1; lag <= 2 * best + 1; lag++ ) {
+                if( mCorrelation[lag] > mCorrelation[twice] )
+                    twice = lag;
+            }
+            best = twice;
+        }
+    }
+    if( best ) {
+        float left = mCorrelation[best - 1], center = mCorrelation[best], right = mCorrelation[best + 1];
+        float curvature = left - 2.0f * center + right;
+        float offset = curvature < 0.0f ? std::min( std::max( 0.5f * ( left - right ) / curvature, -0.5f ), 0.5f ) : 0.0f;
+        float period = best + offset;
+        // glide towards small changes, jump to new tempos
+        if( mPeriod > 0 && fabs( period - mPeriod ) < 0.1f * mPeriod )
+            mPeriod += 0.05f * ( period - mPeriod );
+        else
+            mPeriod = period;
+    }
+    if( mPeriod <= 0 ) {
+        mConfidence = 0;
+        return;
+    }
+
+    // phase: advance by one frame, then pull the beat towards where the onsets land. Where they land is
+    // the leaky mean of unit phasors at the phase of each onset, weighted by its energy and by a window
+    // that is 1 on the beat, under a tenth at 0.4 beats away and 0 half way between, so off-beats,
+    // straight or swung, neither cancel it nor pull it away; it is turned along with every correction
+    // to stay in step. What the window leaves out is kept in a second mean, and when that outweighs
+    // the first the tracker has locked to the off-beats: it turns to them and the two trade places.
+    // The level is capped well above the beats' own, so off-beats weaker than the beats stay weaker.
+    const float deviation = sqrt( std::max( mCorrelation[0], 1e-12f ) );
+    const float level = std::min( std::max( x, 0.0f ) / deviation, 16.0f );
+    const float strength = level * level;
+    mPhase += 1.0f / mPeriod;
+    mPhase -= floor( mPhase );
+    float window = 0.5f + 0.5f * cos( TwoPi * mPhase );
+    window *= window;
+    const float onBeat = ( 1.0f - mPhaseDecay ) * strength * window, offBeat = ( 1.0f - mPhaseDecay ) * strength * ( 1.0f - window );
+    mOnBeat[0] = mPhaseDecay * mOnBeat[0] + onBeat * cos( TwoPi * mPhase );
+    mOnBeat[1] = mPhaseDecay * mOnBeat[1] + onBeat * sin( TwoPi * mPhase );
+    mOffBeat[0] = mPhaseDecay * mOffBeat[0] + offBeat * cos( TwoPi * mPhase );
+    mOffBeat[1] = mPhaseDecay * mOffBeat[1] + offBeat * sin( TwoPi * mPhase );
+    mOnBeatStrength = mPhaseDecay * mOnBeatStrength + onBeat;
+    mOffBeatStrength = mPhaseDecay * mOffBeatStrength + offBeat;
+
+    const float correction = mFormat.coupling * atan2( mOnBeat[1], mOnBeat[0] );
+    const float c = cos( correction ), s = sin( correction );
+    mOnBeat = {{ c * mOnBeat[0] + s * mOnBeat[1], c * mOnBeat[1] - s * mOnBeat[0] }};
+    mOffBeat = {{ c * mOffBeat[0] + s * mOffBeat[1], c * mOffBeat[1] - s * mOffBeat[0] }};
+    mPhase -= correction / TwoPi;
+    const float offBeatLanding = atan2( mOffBeat[1], mOffBeat[0] );
+    if( mOffBeatStrength > OffBeatFlip * mOnBeatStrength
+        || ( OffBeatFlip * mOffBeatStrength > mOnBeatStrength && offBeatLanding > 0.0f && offBeatLanding < TwoPi * ( 0.5f - SwingEarly ) ) ) {
+        const float c = cos( offBeatLanding ), s = sin( offBeatLanding );
+        mPhase -= offBeatLanding / TwoPi;
+        std::swap( mOnBeat, mOffBeat );
+        std::swap( mOnBeatStrength, mOffBeatStrength );
+        mOnBeat = {{ c * mOnBeat[0] + s * mOnBeat[1], c * mOnBeat[1] - s * mOnBeat[0] }};
+        mOffBeat = {{ c * mOffBeat[0] + s * mOffBeat[1], c * mOffBeat[1] - s * mOffBeat[0] }};
+    }
+    mPhase -= floor( mPhase );
+
+    // confidence: how periodic the onsets are, times how closely those on the beat agree on it. Beats
+    // fall on whole frames, so the correlation of a fractional period is spread over the neighbouring
+    // lags. Through the window, onsets spread evenly over the beat agree by two thirds, which counts as none.
+    float periodicity = best ? ( mCorrelation[best - 1] + mCorrelation[best] + mCorrelation[best + 1] ) / std::max( mCorrelation[0], 1e-12f ) : 0.0f;
+    float agreement = mOnBeatStrength > 0 ? 3.0f * hypot( mOnBeat[0], mOnBeat[1] ) / mOnBeatStrength - 2.0f : 0.0f;
+    mConfidence = std::min( std::max( periodicity * agreement, 0.0f ), 1.0f );
+}
+
+float BeatTracker::getTempo() const
+{
+    return mPeriod > 0 ? float( 60.0 * mFrameRate / mPeriod ) : 0.0f;
+}
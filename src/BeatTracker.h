@@ -0,0 +1,71 @@
+//
+//  BeatTracker.h
+//  MusicalSmoke
+//
+//  Follows the tempo and the beat of the onset envelope, one analysis frame
+//  at a time. Cheap enough to run on the audio thread next to the analysis:
+//  a few hundred flops per frame and no allocation after setup().
+//
+
+#ifndef BeatTracker_h
+#define BeatTracker_h
+
+#include <array>
+#include <cstddef>
+#include <vector>
+
+class BeatTracker{
+
+public:
+    struct Format {
+        float   minTempo = 60.0f;
+        float   maxTempo = 180.0f;
+        //! Octave errors are settled in favour of the tempo nearest to this one.
+        float   preferredTempo = 120.0f;
+        //! Time constant of the tempo estimate, in seconds.
+        float   memory = 8.0f;
+        //! Time constant of the phase estimate, in seconds.
+        float   phaseMemory = 2.0f;
+        //! Share of the phase error corrected per frame, in [0, 1].
+        float   coupling = 0.02f;
+    };
+
+    //! \a frameRate is the number of onset values per second.
+    void setup( double frameRate, const Format &format );
+    void setup( double frameRate ) { setup( frameRate, Format() ); }
+
+    //! Feeds the onset strength of the next analysis frame.
+    void process( float onset );
+
+    //! Position within the current beat, in [0, 1), where 0 is on the beat.
+    float getPhase() const { return mPhase; }
+    //! Beats per minute, 0 until a tempo has been found.
+    float getTempo() const;
+    //! How sure the tracker is of tempo and phase, in [0, 1].
+    float getConfidence() const { return mConfidence; }
+
+private:
+    Format              mFormat;
+    double              mFrameRate = 0;
+    size_t              mMinLag = 0, mMaxLag = 0;
+    float               mDecay = 0, mPhaseDecay = 0;
+
+    //! The last mMaxLag + 2 onsets, mean removed.
+    std::vector<float>  mHistory;
+    size_t              mHistoryPos = 0;
+    //! Leaky autocorrelation of the onsets for lags up to mMaxLag + 1, and its tempo prior.
+    std::vector<float>  mCorrelation;
+    std::vector<float>  mPrior;
+    float               mMean = 0;
+
+    //! Beat period in frames, 0 while unknown.
+    float               mPeriod = 0;
+    float               mPhase = 0;
+    //! Where on the beat the onsets land, as leaky sums of phasors weighted by onset energy and a window on the beat,
+    //! or the rest of it half way between, and the leaky sums of the weights.
+    std::array<float, 2> mOnBeat = {{ 0.0f, 0.0f }}, mOffBeat = {{ 0.0f, 0.0f }};
+    float               mOnBeatStrength = 0, mOffBeatStrength = 0;
+    float               mConfidence = 0;
+};
+
+#endif /* BeatTracker_h */
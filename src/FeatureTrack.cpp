@@ -0,0 +1,431 @@
+//
+//  FeatureTrack.cpp
+//  MusicalSmoke
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cinder/app/App.h"
+#include "cinder/audio/Source.h"
+#include "cinder/Utilities.h"
+
+#include "FeatureTrack.h"
+
+using namespace ci;
+using namespace ci::app;
+using namespace std;
+
+#pragma mark FeatureTrack
+
+FeatureTrackRef FeatureTrack::load( const fs::path &audioPath, size_t sampleRate, const AudioFeatureExtractor::Format &format,
+                                    const atomic<bool> *cancel )
+{
+    uint64_t hash = hashFile( audioPath );
+    if( ! hash )
+        return FeatureTrackRef();
+
+    // one cache per file contents and sample rate, whatever the file is called
+    char name[64];
+    snprintf( name, sizeof( name ), "%016llx-%u.features", (unsigned long long)hash, unsigned( sampleRate ) );
+    fs::path cachePath = getCacheDirectory() / name;
+
+    if( FeatureTrackRef track = map( cachePath, hash, sampleRate, format ) )
+        return track;
+
+    fs::create_directories( cachePath.parent_path() );
+    if( ! analyze( audioPath, hash, sampleRate, format, cachePath, cancel ) )
+        return FeatureTrackRef();
+    return map( cachePath, hash, sampleRate, format );
+}
+
+bool FeatureTrack::analyze( const fs::path &audioPath, uint64_t hash, size_t sampleRate, const AudioFeatureExtractor::Format &format,
+                            const fs::path &cachePath, const atomic<bool> *cancel )
+{
+    double startTime = getElapsedSeconds();
+
+    audio::SourceFileRef source;
+    try {
+        // decoded at the rate of the output, as the player does, so the features match the live ones
+        source = audio::load( loadFile( audioPath ), sampleRate );
+    }
+    catch( const std::exception &e ) {
+        console() << "Could not analyse " << audioPath << ": " << e.what() << endl;
+        return false;
+    }
+
+    AudioFeatureExtractor extractor;
+    extractor.setup( sampleRate, format );
+    const size_t hopSize = extractor.getFormat().hopSize;
+
+    // fed a hop at a time, so every analysis frame is kept
+    vector<Frame> frames;
+    frames.reserve( source->getNumFrames() / hopSize + 1 );
+    audio::Buffer chunk( source->getMaxFramesPerRead(), source->getNumChannels() );
+    size_t untilHop = hopSize;
+    while( size_t numFrames = source->read( &chunk ) ) {
+        if( cancel && *cancel )
+            return false;
+
+        const float *samples = chunk.getChannel( 0 );
+        for( size_t i = 0; i < numFrames; ) {
+            size_t count = std::min( numFrames - i, untilHop );
+            extractor.process( samples + i, count );
+            i += count;
+            untilHop -= count;
+            if( untilHop == 0 ) {
+                const AudioFeatures &features = extractor.getFeatures();
+                Frame frame;
+                frame.volume = features.volume;
+                copy( features.bands, features.bands + AudioFeatures::NumBands, frame.bands );
+                frame.onset = features.onset;
+                frames.push_back( frame );
+                untilHop = hopSize;
+            }
+        }
+    }
+
+    double period = 0;
+    double frameRate = double( sampleRate ) / hopSize;
+    vector<double> beats = trackBeats( frames, frameRate, &period );
+
+    Header header = {};
+    copy( "MSFT", "MSFT" + 4, header.magic );
+    header.version = Version;
+    header.hash = hash;
+    header.sampleRate = uint32_t( sampleRate );
+    header.fftSize = uint32_t( extractor.getFormat().fftSize );
+    header.windowSize = uint32_t( extractor.getFormat().windowSize );
+    header.hopSize = uint32_t( hopSize );
+    header.minFrequency = format.minFrequency;
+    header.maxFrequency = format.maxFrequency;
+    header.smoothing = format.smoothing;
+    header.numBands = AudioFeatures::NumBands;
+    header.numFrames = uint32_t( frames.size() );
+    header.numBeats = uint32_t( beats.size() );
+    header.beatPeriod = float( period );
+
+    // written beside the cache and renamed into place, so a cache is never seen half written
+    fs::path partialPath = cachePath;
+    partialPath += ".partial";
+    {
+        ofstream out( partialPath.string().c_str(), ios::binary | ios::trunc );
+        out.write( (const char*)&header, sizeof( header ) );
+        out.write( (const char*)frames.data(), frames.size() * sizeof( Frame ) );
+        out.write( (const char*)beats.data(), beats.size() * sizeof( double ) );
+        if( ! out ) {
+            console() << "Could not write " << partialPath << endl;
+            return false;
+        }
+    }
+    fs::rename( partialPath, cachePath );
+
+    console() << "Analysed " << audioPath.filename() << ": " << frames.size() << " frames, "
+              << ( period > 0 ? 60.0 / period : 0.0 ) << " bpm, in " << getElapsedSeconds() - startTime << " s" << endl;
+    return true;
+}
+
+vector<double> FeatureTrack::trackBeats( const vector<Frame> &frames, double frameRate, double *period )
+{
+    *period = 0;
+    const size_t count = frames.size();
+    const size_t minLag = size_t( frameRate * 60.0 / 180.0 );
+    const size_t maxLag = size_t( frameRate * 60.0 / 60.0 );
+    if( count < maxLag * 4 )
+        return vector<double>();
+
+    // onset envelope with zero mean and unit deviation
+    vector<float> envelope( count );
+    double mean = 0, deviation = 0;
+    for( size_t i = 0; i < count; i++ )
+        mean += frames[i].onset;
+    mean /= count;
+    for( size_t i = 0; i < count; i++ ) {
+        envelope[i] = float( frames[i].onset - mean );
+        deviation += envelope[i] * envelope[i];
+    }
+    deviation = sqrt( deviation / count );
+    if( deviation <= 0 )
+        return vector<double>();
+    for( float &value : envelope )
+        value = float( value / deviation );
+
+    // tempo: the lag between 60 and 180 bpm with the strongest autocorrelation, weighted
+    // towards 120 bpm by an octave wide log-gaussian so that half and double tempo lose
+    const double preferredLag = frameRate * 0.5;
+    double bestScore = -1e30;
+    size_t bestLag = 0;
+    for( size_t lag = minLag; lag <= maxLag; lag++ ) {
+        double sum = 0;
+        for( size_t i = lag; i < count; i++ )
+            sum += envelope[i] * envelope[i - lag];
+        double octaves = log2( lag / preferredLag );
+        double score = sum / ( count - lag ) * exp( -0.5 * octaves * octaves );
+        if( score > bestScore ) {
+            bestScore = score;
+            bestLag = lag;
+        }
+    }
+    *period = bestLag / frameRate;
+
+    // beats: the path through the envelope that collects the most onset energy while
+    // keeping each step close to the tempo (Ellis, "Beat Tracking by Dynamic Programming")
+    const double tightness = 100.0;
+    const size_t minStep = bestLag / 2, maxStep = bestLag * 2;
+    vector<float> penalty( maxStep + 1 );
+    for( size_t step = minStep; step <= maxStep; step++ ) {
+        double stretch = log( double( step ) / bestLag );
+        penalty[step] = float( tightness * stretch * stretch );
+    }
+    vector<float> score( count );
+    vector<int64_t> previous( count, -1 );
+    for( size_t i = 0; i < count; i++ ) {
+        // a beat only follows an earlier one when that adds to the score
+        float best = 0;
+        for( size_t step = minStep; step <= std::min( maxStep, i ); step++ ) {
+            float candidate = score[i - step] - penalty[step];
+            if( candidate > best ) {
+                best = candidate;
+                previous[i] = int64_t( i - step );
+            }
+        }
+        score[i] = envelope[i] + best;
+    }
+
+    // backtrack from the best beat within the last period
+    size_t end = count - 1;
+    for( size_t i = count - bestLag; i < count; i++ ) {
+        if( score[i] > score[end] )
+            end = i;
+    }
+    vector<double> beats;
+    for( int64_t i = int64_t( end ); i >= 0; i = previous[i] )
+        beats.push_back( ( i + 1 ) / frameRate );
+    reverse( beats.begin(), beats.end() );
+    return beats;
+}
+
+uint64_t FeatureTrack::hashFile( const fs::path &path )
+{
+    ifstream in( path.string().c_str(), ios::binary );
+    if( ! in ) {
+        console() << "Could not read " << path << endl;
+        return 0;
+    }
+
+    uint64_t hash = 14695981039346656037ull;
+    vector<char> block( 1 << 20 );
+    while( in ) {
+        in.read( block.data(), block.size() );
+        for( streamsize i = 0; i < in.gcount(); i++ ) {
+            hash ^= uint8_t( block[i] );
+            hash *= 1099511628211ull;
+        }
+    }
+    return hash;
+}
+
+fs::path FeatureTrack::getCacheDirectory()
+{
+    return getHomeDirectory() / "Library" / "Caches" / "MusicalSmoke";
+}
+
+FeatureTrackRef FeatureTrack::map( const fs::path &path, uint64_t hash, size_t sampleRate, const AudioFeatureExtractor::Format &format )
+{
+    int fd = ::open( path.string().c_str(), O_RDONLY );
+    if( fd < 0 )
+        return FeatureTrackRef();
+
+    struct stat info;
+    void *data = MAP_FAILED;
+    if( fstat( fd, &info ) == 0 && size_t( info.st_size ) >= sizeof( Header ) )
+        data = mmap( nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    ::close( fd );
+    if( data == MAP_FAILED )
+        return FeatureTrackRef();
+
+    FeatureTrackRef track( new FeatureTrack );
+    track->mData = data;
+    track->mSize = info.st_size;
+    track->mHeader = (const Header*)data;
+
+    // anything written by another version, for another output rate or with other settings is analysed again
+    AudioFeatureExtractor extractor;
+    extractor.setup( sampleRate, format );
+    const AudioFeatureExtractor::Format &effective = extractor.getFormat();
+    const Header &header = *track->mHeader;
+    bool valid = equal( header.magic, header.magic + 4, "MSFT" ) && header.version == Version && header.hash == hash
+        && header.sampleRate == sampleRate && header.fftSize == effective.fftSize && header.windowSize == effective.windowSize
+        && header.hopSize == effective.hopSize && header.minFrequency == format.minFrequency
+        && header.maxFrequency == format.maxFrequency && header.smoothing == format.smoothing
+        && header.numBands == AudioFeatures::NumBands
+        && track->mSize == sizeof( Header ) + header.numFrames * sizeof( Frame ) + header.numBeats * sizeof( double );
+    if( ! valid )
+        return FeatureTrackRef();
+
+    track->mFrames = (const Frame*)( track->mHeader + 1 );
+    track->mBeats = (const double*)( track->mFrames + header.numFrames );
+    return track;
+}
+
+FeatureTrack::~FeatureTrack()
+{
+    if( mData )
+        munmap( mData, mSize );
+}
+
+size_t FeatureTrack::getFrameIndex( double seconds ) const
+{
+    // frame i is complete once ( i + 1 ) hops have been played
+    double hops = std::max( seconds, 0.0 ) * mHeader->sampleRate / mHeader->hopSize;
+    return std::min<size_t>( size_t( hops ), mHeader->numFrames );
+}
+
+AudioFeatures FeatureTrack::getFeatures( double seconds ) const
+{
+    AudioFeatures features;
+    size_t frame = getFrameIndex( seconds );
+    if( frame == 0 )
+        return features;
+
+    const Frame &cached = mFrames[frame - 1];
+    features.volume = cached.volume;
+    copy( cached.bands, cached.bands + AudioFeatures::NumBands, features.bands );
+    features.onset = cached.onset;
+    features.frame = frame;
+
+    // the beat comes from the grid, which was placed knowing the whole track
+    const double *end = mBeats + mHeader->numBeats;
+    const double *next = upper_bound( mBeats, end, seconds );
+    if( next != mBeats && next != end ) {
+        double period = next[0] - next[-1];
+        features.beatPhase = float( ( seconds - next[-1] ) / period );
+        features.tempo = float( 60.0 / period );
+        features.beatConfidence = 1.0f;
+    }
+    return features;
+}
+
+float FeatureTrack::getMeanVolume( double begin, double end ) const
+{
+    size_t first = getFrameIndex( begin ), last = getFrameIndex( end );
+    if( first >= last )
+        return 0.0f;
+
+    double sum = 0;
+    for( size_t i = first; i < last; i++ )
+        sum += mFrames[i].volume;
+    return float( sum / ( last - first ) );
+}
+
+float FeatureTrack::getBuildUp( double seconds, double horizon ) const
+{
+    float behind = getMeanVolume( seconds - horizon, seconds );
+    float ahead = getMeanVolume( seconds, seconds + horizon );
+    return glm::clamp( ( ahead - behind ) / std::max( behind, 1e-4f ), 0.0f, 1.0f );
+}
+
+double FeatureTrack::getNextBeat( double seconds ) const
+{
+    const double *end = mBeats + mHeader->numBeats;
+    const double *beat = lower_bound( mBeats, end, seconds );
+    return beat != end ? *beat : -1.0;
+}
+
+double FeatureTrack::getBeatPeriod() const
+{
+    return mHeader->beatPeriod;
+}
+
+double FeatureTrack::getNumSeconds() const
+{
+    return double( mHeader->numFrames ) * mHeader->hopSize / mHeader->sampleRate;
+}
+
+#pragma mark FeatureTrackLoader
+
+FeatureTrackLoader::FeatureTrackLoader( WorkerPool &workers )
+    : mWorkers( workers ), mState( make_shared<State>() )
+{
+}
+
+FeatureTrackLoader::~FeatureTrackLoader()
+{
+    mState->cancel = true;
+}
+
+void FeatureTrackLoader::setup( size_t sampleRate, const AudioFeatureExtractor::Format &format )
+{
+    mSampleRate = sampleRate;
+    mFormat = format;
+}
+
+void FeatureTrackLoader::request( const vector<fs::path> &paths )
+{
+    if( ! mSampleRate )
+        return;
+
+    fs::path next;
+    {
+        lock_guard<mutex> lock( mState->mutex );
+        for( auto it = mState->tracks.begin(); it != mState->tracks.end(); ) {
+            if( find( paths.begin(), paths.end(), it->first ) == paths.end() )
+                it = mState->tracks.erase( it );
+            else
+                ++it;
+        }
+
+        if( mState->loading )
+            return;
+        for( const fs::path &path : paths ) {
+            if( ! path.empty() && ! mState->tracks.count( path )
+                && find( mState->failed.begin(), mState->failed.end(), path ) == mState->failed.end() ) {
+                next = path;
+                break;
+            }
+        }
+        if( next.empty() )
+            return;
+        mState->loading = true;
+    }
+
+    shared_ptr<State> state = mState;
+    size_t sampleRate = mSampleRate;
+    AudioFeatureExtractor::Format format = mFormat;
+    mWorkers.submit( [state, next, sampleRate, format] {
+        FeatureTrackRef track;
+        try {
+            track = FeatureTrack::load( next, sampleRate, format, &state->cancel );
+        }
+        catch( const std::exception &e ) {
+            console() << "Could not load the features of " << next << ": " << e.what() << endl;
+        }
+        // dropped on the next request if the track has been moved past meanwhile
+        lock_guard<mutex> lock( state->mutex );
+        if( track )
+            state->tracks[next] = track;
+        else if( ! state->cancel )
+            state->failed.push_back( next );
+        state->loading = false;
+    });
+}
+
+FeatureTrackRef FeatureTrackLoader::get( const fs::path &path ) const
+{
+    lock_guard<mutex> lock( mState->mutex );
+    auto it = mState->tracks.find( path );
+    return it != mState->tracks.end() ? it->second : FeatureTrackRef();
+}
+
+bool FeatureTrackLoader::isBusy() const
+{
+    lock_guard<mutex> lock( mState->mutex );
+    return mState->loading;
+}
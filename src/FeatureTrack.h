@@ -0,0 +1,135 @@
+//
+//  FeatureTrack.h
+//  MusicalSmoke
+//
+//  The analysis of a whole audio file, computed once, written to a cache
+//  file keyed by a hash of the audio, and memory mapped on later plays.
+//  Playback then looks features up by position instead of analysing on the
+//  audio thread, and can look ahead of the playhead.
+//
+
+#ifndef FeatureTrack_h
+#define FeatureTrack_h
+
+#include "cinder/Filesystem.h"
+
+#include "AudioFeatures.h"
+#include "WorkerPool.h"
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+typedef std::shared_ptr<class FeatureTrack> FeatureTrackRef;
+
+class FeatureTrack{
+
+public:
+    //! Maps the cached analysis of \a audioPath, decoded at \a sampleRate, analysing the file and writing
+    //! the cache first when there is none yet. Returns null on failure or when \a cancel is set. Slow, call it on a worker.
+    static FeatureTrackRef load( const cinder::fs::path &audioPath, size_t sampleRate,
+                                 const AudioFeatureExtractor::Format &format = AudioFeatureExtractor::Format(),
+                                 const std::atomic<bool> *cancel = nullptr );
+
+    //! Decodes \a audioPath once and writes its features and beat grid to \a cachePath.
+    static bool analyze( const cinder::fs::path &audioPath, uint64_t hash, size_t sampleRate,
+                         const AudioFeatureExtractor::Format &format, const cinder::fs::path &cachePath,
+                         const std::atomic<bool> *cancel = nullptr );
+
+    //! 64 bit FNV-1a of the contents of \a path.
+    static uint64_t hashFile( const cinder::fs::path &path );
+    //! ~/Library/Caches/MusicalSmoke
+    static cinder::fs::path getCacheDirectory();
+
+    ~FeatureTrack();
+
+    //! The features the live graph publishes with the playhead at \a seconds, with the beat taken from the beat grid.
+    AudioFeatures   getFeatures( double seconds ) const;
+    //! Mean volume between \a begin and \a end seconds, which may lie ahead of the playhead.
+    float           getMeanVolume( double begin, double end ) const;
+    //! How much louder the next \a horizon seconds are than the last, from 0 (not at all) to 1 (twice as loud or more).
+    float           getBuildUp( double seconds, double horizon ) const;
+    //! The first beat at or after \a seconds, or a negative value past the last beat.
+    double          getNextBeat( double seconds ) const;
+
+    double          getBeatPeriod() const;
+    double          getNumSeconds() const;
+
+private:
+    //! The cache file: a Header, numFrames Frames and numBeats beat times in seconds, as doubles.
+    struct Header {
+        char        magic[4];
+        uint32_t    version;
+        uint64_t    hash;
+        uint32_t    sampleRate;
+        uint32_t    fftSize, windowSize, hopSize;
+        float       minFrequency, maxFrequency, smoothing;
+        uint32_t    numBands;
+        uint32_t    numFrames;
+        uint32_t    numBeats;
+        float       beatPeriod;
+        uint32_t    reserved;
+    };
+
+    struct Frame {
+        float       volume;
+        float       bands[AudioFeatures::NumBands];
+        float       onset;
+    };
+
+    static const uint32_t Version = 1;
+
+    //! Beat times through the onset envelope, by autocorrelation for the tempo and dynamic programming for the beats.
+    static std::vector<double> trackBeats( const std::vector<Frame> &frames, double frameRate, double *period );
+
+    FeatureTrack() {}
+    //! Null if \a path is not a cache of \a hash at \a sampleRate and \a format.
+    static FeatureTrackRef map( const cinder::fs::path &path, uint64_t hash, size_t sampleRate,
+                                const AudioFeatureExtractor::Format &format );
+
+    size_t getFrameIndex( double seconds ) const;
+
+    void            *mData = nullptr;
+    size_t          mSize = 0;
+    const Header    *mHeader = nullptr;
+    const Frame     *mFrames = nullptr;
+    const double    *mBeats = nullptr;
+};
+
+//! Keeps the feature tracks of the tracks around the playhead mapped, and
+//! builds the missing ones on a worker, one at a time.
+class FeatureTrackLoader{
+
+public:
+    explicit FeatureTrackLoader( WorkerPool &workers );
+    //! Stops a running analysis early, so quitting does not wait for it.
+    ~FeatureTrackLoader();
+
+    void setup( size_t sampleRate, const AudioFeatureExtractor::Format &format = AudioFeatureExtractor::Format() );
+
+    //! Keeps \a paths mapped, starting on the next one that is missing, and unmaps everything else.
+    void request( const std::vector<cinder::fs::path> &paths );
+    //! The feature track of \a path, or null while it is being built or when it could not be.
+    FeatureTrackRef get( const cinder::fs::path &path ) const;
+    bool isBusy() const;
+
+private:
+    //! Shared with the worker, which may still run after the loader is gone.
+    struct State {
+        std::mutex                                      mutex;
+        std::map<cinder::fs::path, FeatureTrackRef>     tracks;
+        //! Paths that failed, so they are not analysed again every frame.
+        std::vector<cinder::fs::path>                   failed;
+        bool                                            loading = false;
+        std::atomic<bool>                               cancel{ false };
+    };
+
+    WorkerPool                      &mWorkers;
+    std::shared_ptr<State>          mState;
+    size_t                          mSampleRate = 0;
+    AudioFeatureExtractor::Format   mFormat;
+};
+
+#endif /* FeatureTrack_h */
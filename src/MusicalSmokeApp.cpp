@@ -23,7 +23,6 @@
 #include "cinder/app/App.h"
 #include "cinder/app/RendererGl.h"
 #include "cinder/audio/Context.h"
-#include "cinder/audio/MonitorNode.h"
 #include "cinder/audio/Utilities.h"
 #include "cinder/audio/audio.h"
 #include "cinder/Camera.h"
@@ -31,19 +30,62 @@
 #include "cinder/gl/Batch.h"
 #include "cinder/gl/Fbo.h"
 #include "cinder/gl/GlslProg.h"
+#include "cinder/gl/Pbo.h"
 #include "cinder/gl/Texture.h"
+#include "cinder/gl/Ubo.h"
 #include "cinder/gl/VboMesh.h"
 #include "cinder/gl/gl.h"
 #include "cinder/ImageIo.h"
 #include "cinder/params/Params.h"
 #include "cinder/Surface.h"
 
+#include "AudioFeatureNode.h"
+#include "AudioSourceStage.h"
+#include "AudioSync.h"
+#include "FeatureTrack.h"
+#include "OfflineRenderer.h"
+#include "ParticleKernels.h"
 #include "ParticleSystem.h"
+#include "PlumeMesh.h"
+#include "QualityGovernor.h"
+#include "SimulationClock.h"
+#include "SpectralKernels.h"
+#include "StageProfiler.h"
+#include "WorkerPool.h"
+
+#include <random>
 
 using namespace ci;
 using namespace ci::app;
 using namespace std;
 
+// uniform buffer binding of the per-plume data, see mesh.vert
+const GLuint PlumesBinding = 0;
+
+// seconds skipped by the arrow keys
+const double SeekStep = 10.0;
+
+// Largest mesh requestMesh() builds: 4096 x 1024, the top of --benchmark-mesh. At 32 bytes a
+// vertex plus six 32 bit indices a quad that is about 230 MB of staging and GPU memory.
+const int MaxMeshVertices = 4096 * 1024;
+
+// ping-pong buffers, displacement map, normal map and the fused pass drawing into both maps, see createFbo()
+const int NumFbos = 5;
+
+// render stages timed by the profiler, in the order they run
+enum Stage {
+    STAGE_SPECTRUM_UPLOAD,
+    STAGE_PING_PONG,
+    STAGE_PARTICLE_UPDATE,
+    STAGE_SURFACE_MAPS,
+    STAGE_DISPLACEMENT_MAP,
+    STAGE_NORMAL_MAP,
+    STAGE_BACKGROUND,
+    STAGE_PARTICLE_DRAW,
+    STAGE_MESH_DRAW,
+    STAGE_FRAME_WRITE
+};
+
 #pragma mark Class
 
 class MusicalSmokeApp : public App {
@@ -53,6 +95,7 @@ class MusicalSmokeApp : public App {
 	void setup() override;
 	void update() override;
 	void draw() override;
+	void drawScene( const Area &bounds );
 
 	void resize() override;
 
@@ -66,14 +109,40 @@ class MusicalSmokeApp : public App {
 
   private:
 	void createMesh();
+	void requestMesh();
+	PlumeMesh::Format getMeshFormat() const;
+	void updateMeshLabel();
+	void updatePlumes();
+	void benchmarkMesh();
+	//! Prints the step time of both particle backends and, on the GPU, of both buffer layouts, see --benchmark-particles.
+	void benchmarkParticles();
+	//! Runs the analysis over synthetic click tracks and prints its cost and the tempo and phase it finds, see --benchmark-beats.
+	void benchmarkBeats();
+	//! Times each spectral kernel on every instruction set the CPU has and checks them against scalar, see --benchmark-spectral.
+	void benchmarkSpectral();
 	void createTextures();
+	void createFbos();
+	//! Builds frame buffer \a index of createFbos() at \a size: the two ping-pong buffers, then the displacement and normal maps,
+	//! then the fused pass, which draws into the textures of those two in \a built, the frame buffers made before it.
+	gl::FboRef createFbo( int index, const ivec2 &size, const std::vector<gl::FboRef> &built );
+	//! Makes \a fbos, built by createFbo(), the current frame buffers, carrying the ping-pong contents over.
+	void installFbos( const std::vector<gl::FboRef> &fbos );
 	bool compileShaders();
 
+    void uploadSpectrum();
     void renderPingPong();
 	void renderDisplacementMap();
 	void renderNormalMap();
+	void renderSurfaceMaps();
+    
+    gl::Texture2dRef getDisplacementTexture() const;
+    gl::Texture2dRef getNormalTexture() const;
 
 	void resetCamera();
+	
+	void applyQualityLevel( int level );
+	//! The user's "Particles" count, scaled by the current quality level against the one the app started at.
+	int  getQualityParticles() const;
 
   private:
 	float mAmplitude;
@@ -93,34 +162,116 @@ class MusicalSmokeApp : public App {
 
 	gl::FboRef      mNormalMapFbo;
 	gl::GlslProgRef mNormalMapShader;
-
-	gl::VboMeshRef  mVboMesh;
+    
+    // displacement and normal map written together in one pass, to two render targets
+    gl::FboRef      mSurfaceMapsFbo;
+    gl::GlslProgRef mSurfaceMapsShader;
+
+	PlumeMeshRef    mPlumeMesh;
+	// every plume is an instance of the one mesh, with its own entry in this uniform buffer
+	gl::UboRef      mPlumesUbo;
+	int             mNumPlumes = 1;
+	float           mPlumeSpacing = 60.0f;
+	float           mPlumeBandGain = 1.0f;
+	float           mEmitterSpacing = 3.0f; // distance between the ember sources of neighbouring plumes
+	WorkerPool      mWorkers;
+	// rebuilds the mesh off the render thread when a param that shapes it changes
+	PlumeMeshRebuilder mMeshRebuilder{ mWorkers };
 	gl::GlslProgRef mMeshShader;
-	gl::BatchRef    mBatch;
 
 	gl::Texture2dRef mBackgroundTexture;
     gl::GlslProgRef  mBackgroundShader;
     
-    Color color = Color(1,1,1);
+    // band levels, one texel per band, streamed through alternating pixel buffers
+    gl::Texture2dRef mSpectrumTexture;
+    gl::PboRef       mSpectrumPbo[2];
+    int              mSpectrumPboIndex = 0;
     
     ci::params::InterfaceGlRef params;
     void setupParams();
     
-    audio::DelayNodeRef             mDelayNode;
-    audio::MonitorNodeRef           mMonitorNode;
-    audio::MonitorSpectralNodeRef	mMonitorSpectralNode;
+    AudioFeatureNodeRef             mFeatureNode;
+    AudioFeatures                   mFeatures;
     audio::FilterBandPassNodeRef    mFilterBandPassNode;
-    vector<float>					mMagSpectrum;
     ci::audio::GainNodeRef			mGain;
-    ci::audio::BufferPlayerNodeRef	mBufferPlayerNode;
+    // the playlist or live input, in front of the rest of the graph
+    AudioSourceStage                mSources{ mWorkers };
+    // analysis of whole files, cached on disk, used instead of the feature node when it is there
+    FeatureTrackLoader              mFeatureTracks{ mWorkers };
+    AudioFeatureExtractor::Format   mAnalysisFormat;
+    bool                            mUseFeatureTracks = true;
+    std::string                     mFeatureLabel;
+    // picks the analysis that matches the audio heard when a frame shows, in place of delaying the audio
+    AudioSync                       mSync;
+    float                           mSyncTrimMs = 0;
+    std::string                     mLatencyLabel;
+    //! How far the plume swells ahead of a build up, which only a feature track can see coming.
+    float                           mBuildUpGain = 0.5f;
+    float                           mBuildUpHorizon = 4.0f;
+    //! Mutes the speakers for live input, which would otherwise feed back.
+    ci::audio::GainNodeRef			mMonitorGain;
+    std::string                     mInputName;
     gl::TextureFontRef				mTextureFont;
     void setupAudio();
+    //! Switches between the live input and the playlist.
+    void selectSource( bool live );
+    std::string     mTrackLabel;
     float mVolume = 0;
     float mVolumeSmoothed = 0;
+    // the beat, run on between analysis frames; mBeatPulse peaks on each beat and decays until the next
+    float    mBeatPhase = 0;
+    float    mBeatPulse = 0;
+    uint64_t mBeatFrame = 0;
+    float    mBeatDepth = 0.5f;      // how much the beat adds to the wave amplitude
+    float    mBeatInjection = 0.5f;  // and to the audio injected into the ping-pong buffer
+    float    mBeatDecay = 6.0f;
+    std::string mBeatLabel;
 
     ParticleSystem particleSystem;
     
-    const vec2 fboBounds = vec2(256,256);
+    // offline rendering, see OfflineRenderer
+    bool            mOffline = false;
+    OfflineRenderer mOfflineRenderer;
+    
+    // fixed-step clock shared by the particles, the ping-pong slide and the
+    // displacement waves; fed by the wall clock, or by the offline clock when
+    // rendering to disk
+    SimulationClock mClock;
+    double          mLastFrameSeconds = 0;
+    // measured time from one frame to the next, smoothed. The frame rate is not capped (see prepare()),
+    // so with vertical sync this is the refresh period, and without it the time a frame takes.
+    double          mFrameInterval = 1.0 / 60.0;
+    int mNumParticles = 100;
+    bool mInterleavedParticles = true;
+    bool mAudioSpawning = false;
+    bool mCompactParticles = true;
+    bool mBillboards = false;
+    bool mHalfResParticles = false;
+    int  mLiveParticles = 0;
+    
+    // per stage CPU and GPU timings, shown in the params and optionally written to a CSV file
+    StageProfiler   mProfiler;
+    bool            mProfileCsv = false;
+    fs::path        mProfileCsvPath;
+    
+    // quality knobs, set by the governor when adaptive quality is on
+    QualityGovernor mGovernor;
+    bool            mAdaptiveQuality = false;
+    int             mQualityLevel;
+    float           mTargetFps = 60.0f;
+    std::string     mQualityLabel;
+    double          mFrameWorkMs = 0;   // CPU or GPU time of the last frame, whichever is longer
+    double          mFrameWorkStart = 0;
+    ivec2           mFboSize = ivec2( 256, 256 );
+    // frame buffers for a new size, built one per frame until all are there, see update()
+    ivec2           mPendingFboSize = ivec2( 256, 256 );
+    std::vector<gl::FboRef> mPendingFbos;
+    int             mStartQualityLevel = 0;
+    int             mMeshResX = 398;
+    int             mMeshResZ = 98;
+    bool            mMeshStrips = false;
+    bool            mMeshTiles = false;
+    std::string     mMeshLabel;
     
 #pragma mark Settings
     
@@ -131,9 +282,14 @@ class MusicalSmokeApp : public App {
     bool mDrawWireframe = false;
     bool mDrawOriginalMesh = false;
     bool mEnableShader = true;
+    // off until --profile-csv runs on the player boxes show the fused pass ahead of the two it replaces
+    bool mFuseSurfaceMaps = false;
     
     // movement
     float dx = 0.005f; // speed of audio propegation across mesh
+    float mSpectrumMix = 0.5f; // 0 injects broadband volume only, 1 injects one band per mesh row
+    float mSpectrumGain = 0.5f;
+    float mSpectrumFloor = 0.5f; // band level treated as silence
     float mAudioAmplitude = 10.0; // amplitude of audio displacement of mesh
     bool audioMovementStraight = true;
     float mSmoothness = 0.5;
@@ -148,6 +304,7 @@ class MusicalSmokeApp : public App {
     // lines
     bool mEnableLines = false;
     bool mLengthLines = true;
+    float mLineSpacing = 2.0f; // rows (or columns) from one line to the next
     float mLineWidth = 1.0;
     
     // background
@@ -162,7 +319,6 @@ class MusicalSmokeApp : public App {
     float gainLevel = 1.0f;
     float filterFreq = 10000.0f;
     float filterQ = 100.0f;
-    float delay = 0.015;
     
 };
 
@@ -174,17 +330,86 @@ class MusicalSmokeApp : public App {
 void MusicalSmokeApp::prepare( Settings *settings )
 {
 	settings->setTitle( "Vertex Displacement Mapping with Smooth Normals" );
-    settings->setFullScreen();
 	settings->disableFrameRate();
+    
+    OfflineRenderer::Options options;
+    if( OfflineRenderer::parseArgs( settings->getCommandLineArgs(), &options ) )
+        settings->setWindowSize( options.size );
+    else
+        settings->setFullScreen();
 }
 
 void MusicalSmokeApp::setup()
 {
+    OfflineRenderer::Options offlineOptions;
+    mOffline = OfflineRenderer::parseArgs( getCommandLineArgs(), &offlineOptions );
+    
     hideCursor();
+    
+    mQualityLevel = mGovernor.getLevelIndex();
+    mStartQualityLevel = mQualityLevel;
+    mGovernor.setTargetFrameTime( 1000.0 / mTargetFps );
+    mQualityLabel = mGovernor.getLevel().name;
+    
+    mProfiler.setup( { "Spectrum Upload", "Ping-Pong", "Particle Update", "Surface Maps", "Displacement Map",
+                       "Normal Map", "Background", "Particle Draw", "Mesh Draw", "Frame Write" } );
+    
+    // --profile-csv <path> writes the timings of every frame from the start
+    mProfileCsvPath = getDocumentsDirectory() / "MusicalSmokeProfile.csv";
+    const auto &args = getCommandLineArgs();
+    for( size_t i = 0; i + 1 < args.size(); i++ ) {
+        if( args[i] == "--profile-csv" ) {
+            mProfileCsvPath = args[i + 1];
+            mProfileCsv = true;
+            mProfiler.startCsv( mProfileCsvPath );
+        }
+    }
+    
     setupParams();
-    setupAudio();
     
-    particleSystem.setup();
+    // the analysis format of the live graph, the feature tracks and offline renders alike
+    mAnalysisFormat.fftSize = 2048;
+    mAnalysisFormat.windowSize = 1024;
+    
+    if( mOffline ) {
+        // render to disk as fast as possible, without touching the audio device
+        try {
+            mOfflineRenderer.setup( offlineOptions, mAnalysisFormat );
+        }
+        catch( const std::exception &e ) {
+            console() << "Could not start offline render: " << e.what() << std::endl;
+            quit();
+        }
+        gl::enableVerticalSync( false );
+    }
+    else {
+        setupAudio();
+    }
+    
+    // --analyze <file, list or directory> writes the feature tracks of all its files to the cache and quits
+    for( size_t i = 0; i + 1 < args.size(); i++ ) {
+        if( args[i] != "--analyze" )
+            continue;
+        fs::path path = args[i + 1];
+        std::vector<fs::path> tracks = fs::is_regular_file( path ) && path.extension() != ".m3u" && path.extension() != ".txt"
+            ? std::vector<fs::path>{ path } : AudioSourceStage::loadPlaylist( path );
+        // silence, the tracks are only decoded
+        auto ctx = audio::Context::master();
+        ctx->disable();
+        for( const fs::path &track : tracks ) {
+            if( ! FeatureTrack::load( track, ctx->getSampleRate(), mAnalysisFormat ) )
+                console() << "No feature track for " << track << std::endl;
+        }
+        quit();
+        break;
+    }
+    
+    // --cpu-particles simulates the particles on the worker threads, for machines with software GL
+    bool cpuParticles = std::find( args.begin(), args.end(), "--cpu-particles" ) != args.end();
+    particleSystem.setup( mNumParticles, cpuParticles ? ParticleSystem::BACKEND_CPU : ParticleSystem::BACKEND_GPU, &mWorkers );
+    
+    mClock.reset();
+    mLastFrameSeconds = getElapsedSeconds();
 
 	mAmplitude = 0.0f;
 	mAmplitudeTarget = 10.0f;
@@ -197,37 +422,99 @@ void MusicalSmokeApp::setup()
 	if( !compileShaders() )
 		quit();
 
-	// create the basic mesh (a flat plane)
+	// create the basic mesh (a flat plane), and the instances it is drawn with
 	createMesh();
+	mPlumesUbo = gl::Ubo::create( sizeof( PlumeInstance ) * PlumeInstance::MaxInstances, nullptr, GL_DYNAMIC_DRAW );
+	updatePlumes();
+	
+	// --benchmark-mesh prints the mesh build times and quits
+	const auto &commandLine = getCommandLineArgs();
+	if( std::find( commandLine.begin(), commandLine.end(), "--benchmark-mesh" ) != commandLine.end() ) {
+		benchmarkMesh();
+		quit();
+	}
+	// --benchmark-beats prints the cost and accuracy of the analysis on synthetic click tracks and quits
+	if( std::find( commandLine.begin(), commandLine.end(), "--benchmark-beats" ) != commandLine.end() ) {
+		benchmarkBeats();
+		quit();
+	}
+	// --benchmark-spectral prints the spectral kernel times per instruction set and quits. It switches
+	// the kernels the analysis runs on, so the audio thread is stopped first, as for --analyze.
+	if( std::find( commandLine.begin(), commandLine.end(), "--benchmark-spectral" ) != commandLine.end() ) {
+		audio::Context::master()->disable();
+		benchmarkSpectral();
+		quit();
+	}
+	// --benchmark-particles prints the particle step times of both backends and quits
+	if( std::find( commandLine.begin(), commandLine.end(), "--benchmark-particles" ) != commandLine.end() ) {
+		benchmarkParticles();
+		quit();
+	}
 
 	// create the textures
 	createTextures();
 
-	// create the frame buffer objects for the displacement map and the normal map
+	// create the frame buffer objects for the ping-pong buffer, the displacement map and the normal map
+	createFbos();
+}
+
+void MusicalSmokeApp::createFbos()
+{
+    std::vector<gl::FboRef> fbos;
+    for( int i = 0; i < NumFbos; i++ )
+        fbos.push_back( createFbo( i, mFboSize, fbos ) );
+    installFbos( fbos );
+    mPendingFboSize = mFboSize;
+    mPendingFbos.clear();
+}
+
+gl::FboRef MusicalSmokeApp::createFbo( int index, const ivec2 &size, const std::vector<gl::FboRef> &built )
+{
 	gl::Fbo::Format fmt;
 	fmt.enableDepthBuffer( false );
 
-	// use a single channel (red) for the displacement map
-	fmt.setColorTextureFormat( gl::Texture2d::Format().wrap( GL_CLAMP_TO_EDGE ).internalFormat( GL_R32F ) );
-    mPingPong = {
-        gl::Fbo::create( fboBounds.x, fboBounds.y, fmt ),
-        gl::Fbo::create( fboBounds.x, fboBounds.y, fmt )
-    };
-    {
-        ci::gl::ScopedFramebuffer fbo( mPingPong[0] );
-        gl::clear(  ColorA( 0, 0, 0, 1 ) );
+	// use a single channel (red) for the ping-pong buffers and the displacement map
+	auto dispFormat = gl::Texture2d::Format().wrap( GL_CLAMP_TO_EDGE ).internalFormat( GL_R32F );
+	// use 3 channels (rgb) for the normal map
+	auto normalFormat = gl::Texture2d::Format().wrap( GL_CLAMP_TO_EDGE ).internalFormat( GL_RGB32F );
+    
+    if( index < 3 ) {
+        fmt.setColorTextureFormat( dispFormat );
+        return gl::Fbo::create( size.x, size.y, fmt );
     }
-    {
-        ci::gl::ScopedFramebuffer fbo( mPingPong[1] );
-        gl::clear(  ColorA( 0, 0, 0, 1 ) );
+    if( index == 3 ) {
+        fmt.setColorTextureFormat( normalFormat );
+        return gl::Fbo::create( size.x, size.y, fmt );
     }
     
-    mDispMapFbo = gl::Fbo::create( fboBounds.x, fboBounds.y, fmt );
+    // the textures of both maps as color attachments of one frame buffer, for the fused pass, so
+    // either path leaves its result in the same place and no extra float targets are allocated
+    gl::Fbo::Format mrtFormat;
+    mrtFormat.disableDepth()
+        .attachment( GL_COLOR_ATTACHMENT0, built[2]->getColorTexture() )
+        .attachment( GL_COLOR_ATTACHMENT1, built[3]->getColorTexture() );
+    return gl::Fbo::create( size.x, size.y, mrtFormat );
+}
 
-	// use 3 channels (rgb) for the normal map
-	fmt.setColorTextureFormat( gl::Texture2d::Format().wrap( GL_CLAMP_TO_EDGE ).internalFormat( GL_RGB32F ) );
-	mNormalMapFbo = gl::Fbo::create( fboBounds.x, fboBounds.y, fmt );
+void MusicalSmokeApp::installFbos( const std::vector<gl::FboRef> &fbos )
+{
+    // when resizing, carry the audio that is still travelling across the ping-pong buffer over
+    gl::Texture2dRef previous = mPingPong.empty() ? gl::Texture2dRef() : mPingPong[drawFbo]->getColorTexture();
+    mPingPong = { fbos[0], fbos[1] };
+    for( auto &f : mPingPong ) {
+        ci::gl::ScopedFramebuffer fbo( f );
+        gl::ScopedViewport viewport( 0, 0, f->getWidth(), f->getHeight() );
+        gl::clear(  ColorA( 0, 0, 0, 1 ) );
+        if( previous ) {
+            gl::ScopedMatrices matrices;
+            gl::setMatricesWindow( f->getSize() );
+            gl::draw( previous, f->getBounds() );
+        }
+    }
     
+    mDispMapFbo = fbos[2];
+	mNormalMapFbo = fbos[3];
+    mSurfaceMapsFbo = fbos[4];
 }
 
 void MusicalSmokeApp::setupParams(){
@@ -237,12 +524,20 @@ void MusicalSmokeApp::setupParams(){
     params->addParam( "Draw Wireframes",    &mDrawWireframe );
     params->addParam( "Draw Original Mesh",    &mDrawOriginalMesh );
     params->addParam( "Enable Shader",    &mEnableShader );
+    params->addParam( "Fuse Surface Maps",    &mFuseSurfaceMaps );
     params->addSeparator();
     
     params->addParam( "DX",    &dx );
     params->addParam( "Audio Amplitude",    &mAudioAmplitude );
     params->addParam( "Audio Movement Straight",    &audioMovementStraight );
     params->addParam( "Volume Smoothness",    &mSmoothness );
+    params->addParam( "Beat",    &mBeatLabel, true );
+    params->addParam( "Beat Depth",    &mBeatDepth ).min( 0.0f ).step( 0.05f );
+    params->addParam( "Beat Injection",    &mBeatInjection ).min( 0.0f ).step( 0.05f );
+    params->addParam( "Beat Decay",    &mBeatDecay ).min( 0.5f ).step( 0.5f );
+    params->addParam( "Spectrum Mix",    &mSpectrumMix ).min( 0.0f ).max( 1.0f ).step( 0.05f );
+    params->addParam( "Spectrum Gain",    &mSpectrumGain ).step( 0.05f );
+    params->addParam( "Spectrum Floor",    &mSpectrumFloor ).min( 0.0f ).max( 0.99f ).step( 0.01f );
     params->addSeparator();
     
     params->addParam( "Line Color 1",    &mLineColor1 );
@@ -254,6 +549,16 @@ void MusicalSmokeApp::setupParams(){
     
     params->addParam( "Enable Lines",    &mEnableLines );
     params->addParam( "Length Lines",    &mLengthLines );
+    params->addParam( "Line Spacing",    &mLineSpacing ).min( 1.0f ).max( 64.0f ).step( 1.0f );
+    params->addParam( "Mesh Res X",    &mMeshResX ).min( 2 ).max( 4096 ).step( 64 ).updateFn( [&](){ requestMesh(); } );
+    params->addParam( "Mesh Res Z",    &mMeshResZ ).min( 2 ).max( 4096 ).step( 16 ).updateFn( [&](){ requestMesh(); } );
+    params->addParam( "Mesh Strips",    &mMeshStrips ).updateFn( [&](){ requestMesh(); } );
+    params->addParam( "Mesh Tiles",    &mMeshTiles ).updateFn( [&](){ requestMesh(); } );
+    params->addParam( "Mesh",    &mMeshLabel, true );
+    params->addParam( "Plumes",    &mNumPlumes ).min( 1 ).max( PlumeInstance::MaxInstances ).updateFn( [&](){ updatePlumes(); } );
+    params->addParam( "Plume Spacing",    &mPlumeSpacing ).step( 5.0f ).updateFn( [&](){ updatePlumes(); } );
+    params->addParam( "Plume Band Gain",    &mPlumeBandGain ).step( 0.1f ).updateFn( [&](){ updatePlumes(); } );
+    params->addParam( "Emitter Spacing",    &mEmitterSpacing ).step( 0.5f ).updateFn( [&](){ updatePlumes(); } );
     params->addParam( "Line Width",    &mLineWidth );
     params->addSeparator();
     
@@ -271,11 +576,54 @@ void MusicalSmokeApp::setupParams(){
     params->addParam( "b2", &particleSystem.b2);
     params->addParam( "a1", &particleSystem.a1);
     params->addParam( "a2", &particleSystem.a2);
+    params->addParam( "Particles", &mNumParticles ).min( 1 ).max( 1000000 ).step( 100 ).updateFn( [&](){
+        particleSystem.setNumParticles( getQualityParticles() );
+    });
+    params->addParam( "Interleaved Particles", &mInterleavedParticles ).updateFn( [&](){
+        particleSystem.setLayout( mInterleavedParticles ? ParticleSystem::LAYOUT_INTERLEAVED : ParticleSystem::LAYOUT_SEPARATE );
+    });
+    params->addParam( "Audio Spawning", &mAudioSpawning ).updateFn( [&](){
+        particleSystem.setSpawning( mAudioSpawning ? ParticleSystem::SPAWN_AUDIO : ParticleSystem::SPAWN_STAGGERED );
+    });
+    params->addParam( "Compact Particles", &mCompactParticles ).updateFn( [&](){
+        particleSystem.setCompaction( mCompactParticles );
+    });
+    params->addParam( "Live Particles", &mLiveParticles, true );
+    params->addParam( "Billboards", &mBillboards ).updateFn( [&](){
+        particleSystem.setRendering( mBillboards ? ParticleSystem::RENDER_BILLBOARDS : ParticleSystem::RENDER_POINTS );
+    });
+    params->addParam( "Half Res Particles", &mHalfResParticles ).updateFn( [&](){
+        particleSystem.setHalfResolution( mHalfResParticles );
+    });
+    params->addParam( "Spawn Idle", &particleSystem.spawnIdle ).min( 0.0f ).step( 0.05f );
+    params->addParam( "Spawn Gain", &particleSystem.spawnGain ).min( 0.0f ).step( 0.5f );
     
+    params->addParam( "Track", &mTrackLabel, true );
+    params->addParam( "Feature Tracks", &mUseFeatureTracks );
+    params->addParam( "Features", &mFeatureLabel, true );
+    params->addParam( "Build Up Gain", &mBuildUpGain ).min( 0.0f ).step( 0.1f );
+    params->addParam( "Build Up Horizon", &mBuildUpHorizon ).min( 0.5f ).max( 30.0f ).step( 0.5f );
     params->addParam( "Gain Level", &gainLevel );
-    params->addParam( "Delay", &delay).updateFn( [&](){
-        mDelayNode->setDelaySeconds(delay);
+    params->addParam( "Sync Trim (ms)", &mSyncTrimMs ).step( 1.0f ).updateFn( [&](){
+        mSync.setTrim( mSyncTrimMs / 1000.0 );
+    });
+    params->addParam( "A/V Latency", &mLatencyLabel, true );
+    
+    params->addParam( "Adaptive Quality", &mAdaptiveQuality );
+    params->addParam( "Target FPS", &mTargetFps ).min( 24.0f ).max( 240.0f ).step( 1.0f ).updateFn( [&](){
+        mGovernor.setTargetFrameTime( 1000.0 / mTargetFps );
+    });
+    params->addParam( "Quality Level", &mQualityLevel ).min( 0 ).max( int( mGovernor.getLevels().size() ) - 1 ).updateFn( [&](){
+        mGovernor.setLevel( mQualityLevel );
+        applyQualityLevel( mGovernor.getLevelIndex() );
     });
+    params->addParam( "Quality", &mQualityLabel, true );
+    params->addParam( "Profile CSV", &mProfileCsv ).updateFn( [&](){
+        if( mProfileCsv ) mProfiler.startCsv( mProfileCsvPath );
+        else mProfiler.stopCsv();
+    });
+    mProfiler.addParams( params );
+    params->addSeparator();
     
     params->addParam( "Dir Mag", &dirMag );
     params->addParam( "Pos Mag", &posMag );
@@ -292,75 +640,258 @@ void MusicalSmokeApp::setupAudio(){
     // audio
     auto ctx = audio::Context::master();
     
-    // MP3
-    ci::audio::SourceFileRef sourceFile = ci::audio::load(ci::app::loadAsset("sample.mp3") , ctx->getSampleRate() );
-    audio::BufferRef buffer = sourceFile->loadBuffer();
-    mBufferPlayerNode = ctx->makeNode( new ci::audio::BufferPlayerNode( buffer ) );
+    // Files are decoded on a read thread into a small ring buffer as they play, so neither
+    // the startup time nor the memory use grow with the length of a track
+    mSources.setup( ctx );
     mGain = ctx->makeNode( new audio::GainNode( gainLevel ) );
-    mDelayNode = ctx->makeNode( new audio::DelayNode() );
-    mDelayNode->setDelaySeconds(delay);
+    mMonitorGain = ctx->makeNode( new audio::GainNode( 1.0f ) );
     
     // Filter
     mFilterBandPassNode = ctx->makeNode( new audio::FilterBandPassNode() );
     mFilterBandPassNode->setCenterFreq(filterFreq);
     mFilterBandPassNode->setQ(filterQ);
     
-    // Time Domain
-    auto monitorFormat = audio::MonitorNode::Format().windowSize( 1024 );
-    mMonitorNode = ctx->makeNode( new audio::MonitorNode( monitorFormat ) );
+    // Analysis (volume, bands, onsets), computed on the audio thread, unless the track has been analysed before
+    mFeatureNode = ctx->makeNode( new AudioFeatureNode( mAnalysisFormat ) );
+    mFeatureTracks.setup( ctx->getSampleRate(), mAnalysisFormat );
     
-    // Frequency Domain (FFT)
-    auto monitorSpectralFormat = audio::MonitorSpectralNode::Format().fftSize( 2048 ).windowSize( 1024 );
-    mMonitorSpectralNode = ctx->makeNode( new audio::MonitorSpectralNode( monitorSpectralFormat ) );
-    
-    mBufferPlayerNode
+    mSources.getOutput()
     >> mGain
-    >> mDelayNode
+    >> mMonitorGain
     >> ctx->getOutput()
     ;
     
-    mBufferPlayerNode
+    mSources.getOutput()
     >> mGain
 //    >> mFilterBandPassNode
-    >> mMonitorNode
-    >> mMonitorSpectralNode
+    >> mFeatureNode
     ;
     
     ctx->enable();
+    mSync.setup( ctx );
     
-    mBufferPlayerNode->start();
+    // --playlist <list or directory> plays files back to back, looping; the bundled sample plays once otherwise.
+    // --input [device] starts on a capture device instead. --start <seconds> begins part way into the first track.
+    // --sync-trim <ms> delays the pictures further, for displays that add latency of their own.
+    std::vector<fs::path> tracks = { getAssetPath( "sample.mp3" ) };
+    bool loop = false, live = false;
+    double start = 0;
+    const auto &args = getCommandLineArgs();
+    for( size_t i = 0; i < args.size(); i++ ) {
+        bool hasValue = i + 1 < args.size() && args[i + 1].compare( 0, 2, "--" ) != 0;
+        if( args[i] == "--playlist" && hasValue ) {
+            tracks = AudioSourceStage::loadPlaylist( args[i + 1] );
+            loop = true;
+        }
+        else if( args[i] == "--input" ) {
+            live = true;
+            if( hasValue )
+                mInputName = args[i + 1];
+        }
+        else if( args[i] == "--start" && hasValue ) {
+            start = atof( args[i + 1].c_str() );
+        }
+        else if( args[i] == "--sync-trim" && hasValue ) {
+            mSyncTrimMs = float( atof( args[i + 1].c_str() ) );
+        }
+    }
+    mSync.setTrim( mSyncTrimMs / 1000.0 );
+    
+    mSources.playTracks( tracks, loop, start );
+    if( live )
+        selectSource( true );
+    
+}
+
+void MusicalSmokeApp::selectSource( bool live )
+{
+    if( live )
+        mSources.playInput( mInputName );
+    else
+        mSources.resumeTracks();
     
+    // the input is only analysed
+    mMonitorGain->setValue( mSources.isLive() ? 0.0f : 1.0f );
 }
 
 void MusicalSmokeApp::update()
 {
-    //    mGain->setValue(gainLevel);
-    mFilterBandPassNode->setCenterFreq(filterFreq);
-    mFilterBandPassNode->setQ(filterQ);
-    mFilterBandPassNode->setGain(gainLevel);
+    mProfiler.beginFrame();
+    mFrameWorkStart = getElapsedSeconds();
+    
+    // offline renders keep the quality they were started with, so runs stay reproducible
+    if( mAdaptiveQuality && ! mOffline && mGovernor.update( mFrameWorkMs ) )
+        applyQualityLevel( mGovernor.getLevelIndex() );
+    if( mPendingFboSize != mFboSize ) {
+        mPendingFbos.push_back( createFbo( int( mPendingFbos.size() ), mPendingFboSize, mPendingFbos ) );
+        if( mPendingFbos.size() == size_t( NumFbos ) ) {
+            mFboSize = mPendingFboSize;
+            installFbos( mPendingFbos );
+            mPendingFbos.clear();
+        }
+    }
+    
+    if( mOffline ) {
+        // the analysis of the audio up to the frame being made
+        mOfflineRenderer.advance();
+        mClock.advance( mOfflineRenderer.getFrameDuration() );
+        mFeatures = mOfflineRenderer.getFeatures();
+    }
+    else {
+        double seconds = getElapsedSeconds();
+        double interval = seconds - mLastFrameSeconds;
+        mClock.advance( interval );
+        mLastFrameSeconds = seconds;
+        // stalls, such as a window being dragged, say nothing about when frames show
+        if( interval > 0 && interval < 0.25 )
+            mFrameInterval += 0.1 * ( interval - mFrameInterval );
+        
+        //    mGain->setValue(gainLevel);
+        mFilterBandPassNode->setCenterFreq(filterFreq);
+        mFilterBandPassNode->setQ(filterQ);
+        mFilterBandPassNode->setGain(gainLevel);
+        
+        // puts the next track on a deck, or hands over to it
+        mSources.update();
+        
+        // The frame being made shows about one frame interval from now. The analysis to show with it is that
+        // of the audio heard then, which was rendered an output latency earlier.
+        mSync.update( seconds );
+        double frameLatency = mFrameInterval;
+        double heard = mSync.getHeardTime( seconds + frameLatency );
+        
+        // The tracks on the decks are analysed once, on a worker, and looked up by position from then on.
+        // The feature node is switched off meanwhile, which leaves the audio thread with nothing to analyse.
+        mFeatureTracks.request( { mSources.getTrackPath(), mSources.getNextTrackPath() } );
+        FeatureTrackRef featureTrack = mUseFeatureTracks ? mFeatureTracks.get( mSources.getTrackPath() ) : FeatureTrackRef();
+        mFeatureNode->setEnabled( ! featureTrack );
+        if( featureTrack ) {
+            double position = mSources.getPosition() + heard - mSync.getAudioTime( seconds );
+            mFeatures = featureTrack->getFeatures( position );
+            mFeatures.volume *= 1.0f + mBuildUpGain * featureTrack->getBuildUp( position, mBuildUpHorizon );
+            mFeatureLabel = "cached, " + toString( int( 60.0 / std::max( featureTrack->getBeatPeriod(), 0.1 ) + 0.5 ) ) + " bpm";
+        }
+        else {
+            // the snapshot published by the audio thread for that audio, never blocks
+            mFeatures = mFeatureNode->getFeatures( heard );
+            mFeatureLabel = mFeatureTracks.isBusy() ? "live, analysing" : "live";
+        }
+        
+        // output and display latency, and how far the snapshot shown is from the audio heard
+        double snapshotError = featureTrack ? 0.0 : mFeatureNode->getFeaturesTime() - heard;
+        mLatencyLabel = toString( int( 1000.0 * mSync.getOutputLatency() + 0.5 ) ) + " ms out + "
+            + toString( int( 1000.0 * frameLatency + 0.5 ) ) + " ms measured frame, snapshot "
+            + toString( int( 1000.0 * snapshotError ) ) + " ms";
+        
+        int position = int( mSources.getPosition() );
+        int length = int( mSources.getLength() );
+        mTrackLabel = mSources.getTrackName();
+        if( ! mSources.isLive() )
+            mTrackLabel += " " + toString( position / 60 ) + ":" + ( position % 60 < 10 ? "0" : "" ) + toString( position % 60 )
+                + " / " + toString( length / 60 ) + ":" + ( length % 60 < 10 ? "0" : "" ) + toString( length % 60 );
+    }
+    mVolume = mFeatures.volume;
+    particleSystem.setBands( mFeatures.bands, AudioFeatures::NumBands );
+    particleSystem.setOnset( mFeatures.onset );
+    mLiveParticles = particleSystem.getLiveCount();
+    mBeatLabel = toString( int( mFeatures.tempo + 0.5f ) ) + " bpm, " + toString( int( 100.0f * mFeatures.beatConfidence ) ) + "%";
     
-    mVolume = mMonitorNode->getVolume();
-    mVolumeSmoothed = (1-mSmoothness) * mVolumeSmoothed + mSmoothness * mVolume;
-    color = Color( mVolume, mVolume, mVolume );
+    // swap in a rebuilt mesh once a worker has built it and it has been uploaded, a slice per frame
+    if( PlumeMeshRef mesh = mMeshRebuilder.update( mMeshShader ) ) {
+        mPlumeMesh = mesh;
+        updateMeshLabel();
+    }
     
-	mAmplitude += 0.02f * ( mAmplitudeTarget - mAmplitude );
+    {
+        ScopedStage stage( mProfiler, STAGE_SPECTRUM_UPLOAD );
+        uploadSpectrum();
+    }
     
-    // render pingpong fbo
-    renderPingPong();
+    // everything that integrates over time advances in fixed steps, so the
+    // result does not depend on how often we get to render
+    while( mClock.step() ) {
+        mVolumeSmoothed = (1-mSmoothness) * mVolumeSmoothed + mSmoothness * mVolume;
+        mAmplitude += 0.02f * ( mAmplitudeTarget - mAmplitude );
+        
+        // Advance the beat by the tempo, and pull it halfway onto the phase of each new analysis frame.
+        // The analysis publishes about 86 times a second, so the pulse stays smooth at any frame rate.
+        mBeatPhase += float( mClock.getStep() ) * mFeatures.tempo / 60.0f;
+        if( mFeatures.frame != mBeatFrame ) {
+            mBeatFrame = mFeatures.frame;
+            float error = mFeatures.beatPhase - mBeatPhase;
+            mBeatPhase += 0.5f * ( error - floor( error + 0.5f ) );
+        }
+        mBeatPhase -= floor( mBeatPhase );
+        mBeatPulse = mFeatures.beatConfidence * exp( -mBeatDecay * mBeatPhase );
+        
+        // render pingpong fbo
+        {
+            ScopedStage stage( mProfiler, STAGE_PING_PONG );
+            renderPingPong();
+        }
+        
+        ScopedStage stage( mProfiler, STAGE_PARTICLE_UPDATE );
+        particleSystem.update( float( mClock.getTime() ), float( mClock.getStep() ) );
+    }
 	
-    // render displacement map
-	renderDisplacementMap();
+    if( mFuseSurfaceMaps ) {
+        // render displacement and normal map in one pass
+        ScopedStage stage( mProfiler, STAGE_SURFACE_MAPS );
+        renderSurfaceMaps();
+    }
+    else {
+        // render displacement map
+        {
+            ScopedStage stage( mProfiler, STAGE_DISPLACEMENT_MAP );
+            renderDisplacementMap();
+        }
 
-	// render normal map
-    renderNormalMap();
-    
-    particleSystem.update();
+        // render normal map
+        ScopedStage stage( mProfiler, STAGE_NORMAL_MAP );
+        renderNormalMap();
+    }
 }
 
 void MusicalSmokeApp::draw()
 {
+    if( mOffline ) {
+        if( ! mOfflineRenderer.getFbo() )
+            return;
+        
+        // render the frame off screen, write it out, and show it as a preview where there is a window
+        {
+            gl::ScopedFramebuffer fbo( mOfflineRenderer.getFbo() );
+            gl::ScopedViewport viewport( 0, 0, mOfflineRenderer.getFbo()->getWidth(), mOfflineRenderer.getFbo()->getHeight() );
+            drawScene( mOfflineRenderer.getFbo()->getBounds() );
+        }
+        {
+            ScopedStage stage( mProfiler, STAGE_FRAME_WRITE );
+            mOfflineRenderer.writeFrame();
+        }
+        
+#if ! defined( CINDER_HEADLESS )
+        gl::clear();
+        gl::draw( mOfflineRenderer.getFbo()->getColorTexture(), getWindowBounds() );
+#endif
+        
+        if( mOfflineRenderer.isFinished() )
+            quit();
+    }
+    else {
+        drawScene( getWindowBounds() );
+    }
+    
+    // GPU times arrive a few frames late, but are what limits us when vertical sync hides the real frame time
+    double cpuMs = 1000.0 * ( getElapsedSeconds() - mFrameWorkStart );
+    mFrameWorkMs = std::max( cpuMs, mProfiler.getLastGpuFrameTime() );
+    
+    if (showParams) params->draw();
+}
 
+void MusicalSmokeApp::drawScene( const Area &bounds )
+{
 	// render background
+	mProfiler.begin( STAGE_BACKGROUND );
 	if( !bgSolid && mBackgroundTexture && mBackgroundShader ) {
         gl::clear();
 		gl::ScopedTextureBind tex0( mBackgroundTexture );
@@ -368,21 +899,25 @@ void MusicalSmokeApp::draw()
         mBackgroundShader->uniform( "uTex0", 0 );
         mBackgroundShader->uniform( "uHue", mHue ); //float( 0.025 * getElapsedSeconds() ) );
         mBackgroundShader->uniform( "uBrightness", mBrightness );
-		gl::drawSolidRect( getWindowBounds() );
+		gl::drawSolidRect( bounds );
     }else{
         gl::clear( bgColor );
     }
+    mProfiler.end( STAGE_BACKGROUND );
     
-    particleSystem.draw(mVolumeSmoothed);
+    {
+        ScopedStage stage( mProfiler, STAGE_PARTICLE_DRAW );
+        particleSystem.draw( mVolumeSmoothed, float( mClock.getInterpolatedTime() ) );
+    }
 
 	// if enabled, show the displacement and normal maps
     if( mDrawTextures ) {
         gl::color( Color( 1, 1, 1 ) );
         gl::draw( mPingPong[drawFbo]->getColorTexture(), vec2( 0 ) );
         gl::color( Color( 1, 1, 1 ) );
-        gl::draw( mDispMapFbo->getColorTexture(), vec2( 256, 0 ) );
+        gl::draw( getDisplacementTexture(), vec2( 256, 0 ) );
 		gl::color( Color( 1, 1, 1 ) );
-		gl::draw( mNormalMapFbo->getColorTexture(), vec2( 512, 0 ) );
+		gl::draw( getNormalTexture(), vec2( 512, 0 ) );
 	}
 
 	// setup the 3D camera
@@ -397,20 +932,24 @@ void MusicalSmokeApp::draw()
 	// draw undisplaced mesh if enabled
 	if( mDrawOriginalMesh ) {
 		gl::color( ColorA( 1, 1, 1, 0.2f ) );
-		gl::draw( mVboMesh );
+		mPlumeMesh->drawOriginal();
 	}
 
-	if( mDispMapFbo && mNormalMapFbo && mMeshShader ) {
+	if( getDisplacementTexture() && getNormalTexture() && mMeshShader ) {
 		// bind the displacement and normal maps, each to their own texture unit
-        gl::ScopedTextureBind tex0( mDispMapFbo->getColorTexture(), (uint8_t)0 );
-        gl::ScopedTextureBind tex1( mNormalMapFbo->getColorTexture(), (uint8_t)1 );
+        gl::ScopedTextureBind tex0( getDisplacementTexture(), (uint8_t)0 );
+        gl::ScopedTextureBind tex1( getNormalTexture(), (uint8_t)1 );
         gl::ScopedTextureBind tex2( mPingPong[drawFbo]->getColorTexture(), (uint8_t)2 );
+        gl::ScopedTextureBind tex3( mSpectrumTexture, (uint8_t)3 );
+        mPlumesUbo->bindBufferBase( PlumesBinding );
 
 		// render our mesh using vertex displacement
 		gl::ScopedGlslProg shader( mMeshShader );
         mMeshShader->uniform( "uTexDisplacement", 0 );
         mMeshShader->uniform( "uTexNormal", 1 );
         mMeshShader->uniform( "uTexAudio", 2 );
+        mMeshShader->uniform( "uTexSpectrum", 3 );
+        mMeshShader->uniform( "uSpectrumFloor", mSpectrumFloor );
         mMeshShader->uniform( "uEnableFallOff", mEnableShader );
         mMeshShader->uniform( "uEnableLines", mEnableLines );
         mMeshShader->uniform( "uLineWidth", mLineWidth );
@@ -419,9 +958,14 @@ void MusicalSmokeApp::draw()
         mMeshShader->uniform( "uLineGapAlpha", mLineGapAlpha );
         mMeshShader->uniform( "uVolumeColor", mVolumeColor );
         mMeshShader->uniform( "uFalloffColor", mFalloffColor );
+        // lines are derived from the texture coordinates, so they follow the grid of the mesh on screen
+        mMeshShader->uniform( "uLengthLines", mLengthLines );
+        mMeshShader->uniform( "uLineRes", vec2( mPlumeMesh->getFormat().resX, mPlumeMesh->getFormat().resZ ) );
+        mMeshShader->uniform( "uLineSpacing", mLineSpacing );
 
 		gl::color( Color::white() );
-		mBatch->draw();
+		ScopedStage stage( mProfiler, STAGE_MESH_DRAW );
+		mPlumeMesh->draw( mNumPlumes );
 	}
 
 	// clean up after ourselves
@@ -429,8 +973,6 @@ void MusicalSmokeApp::draw()
 	gl::disableAlphaBlending();
 
     gl::popMatrices();
-    
-    if (showParams) params->draw();
 }
 
 void MusicalSmokeApp::resetCamera()
@@ -438,6 +980,36 @@ void MusicalSmokeApp::resetCamera()
  	mCamera.lookAt( vec3( 78.185,    4.692,   87.365 ), vec3( -0.666,   -0.040,   -0.745 ) );
 }
 
+void MusicalSmokeApp::applyQualityLevel( int level )
+{
+    const QualityGovernor::Level &q = mGovernor.getLevels()[level];
+    mQualityLevel = level;
+    mQualityLabel = q.name;
+    console() << "Quality: " << q.name << std::endl;
+    
+    // only reallocate what actually changes; the new frame buffers are built over the
+    // next frames while the old ones are still drawn, see update()
+    if( mPendingFboSize != ivec2( q.fboSize ) ) {
+        mPendingFboSize = ivec2( q.fboSize );
+        mPendingFbos.clear();
+    }
+    if( mMeshResX != q.meshResX || mMeshResZ != q.meshResZ ) {
+        mMeshResX = q.meshResX;
+        mMeshResZ = q.meshResZ;
+        requestMesh();
+    }
+    int numParticles = getQualityParticles();
+    if( numParticles != particleSystem.getNumParticles() )
+        particleSystem.setNumParticles( numParticles );
+}
+
+int MusicalSmokeApp::getQualityParticles() const
+{
+    const std::vector<QualityGovernor::Level> &levels = mGovernor.getLevels();
+    double scale = double( levels[mGovernor.getLevelIndex()].numParticles ) / std::max( levels[mStartQualityLevel].numParticles, 1 );
+    return std::max( 1, std::min( int( mNumParticles * scale + 0.5 ), 1000000 ) );
+}
+
 
 
 #pragma mark Render Shaders, Supply Uniforms
@@ -456,22 +1028,23 @@ void MusicalSmokeApp::renderPingPong()
         gl::clear();
         
         {
-            // render the displacement map
+            // slide the previous frame along and inject the current audio at the edge
             gl::ScopedGlslProg shader( mPingPongShader );
             gl::ScopedTextureBind tex( f2->getColorTexture(), 0 );
+            gl::ScopedTextureBind spectrum( mSpectrumTexture, 1 );
             mPingPongShader->uniform( "uTex0", 0 );
+            mPingPongShader->uniform( "uTexSpectrum", 1 );
             mPingPongShader->uniform( "dx", dx );
+            mPingPongShader->uniform( "uSize", vec2( f->getSize() ) );
+            mPingPongShader->uniform( "uVolume", mVolume );
+            mPingPongShader->uniform( "uBeat", mBeatInjection * mBeatPulse );
+            mPingPongShader->uniform( "uSpectrumMix", mSpectrumMix );
+            mPingPongShader->uniform( "uSpectrumGain", mSpectrumGain );
+            mPingPongShader->uniform( "uSpectrumFloor", mSpectrumFloor );
+            mPingPongShader->uniform( "uInjectWidth", 50.0f * f->getWidth() / 256.0f );
+            mPingPongShader->uniform( "uInjectCircle", !audioMovementStraight );
             gl::drawSolidRect( f->getBounds() );
         }
-        {
-            gl::ScopedColor c(color);
-            if (audioMovementStraight){
-                float width = 50.0;
-                gl::drawSolidRect( Rectf( f->getWidth() - width, 0, f->getWidth(), f->getHeight() ) );
-            }else{
-                gl::drawSolidCircle( vec2( f->getWidth(), f->getHeight()/2 ), f->getHeight()/2 );
-            }
-        }
         
         gl::popMatrices();
     }
@@ -500,8 +1073,8 @@ void MusicalSmokeApp::renderDisplacementMap()
                 // render the displacement map
                 gl::ScopedGlslProg shader( mDispMapShader );
                 gl::ScopedTextureBind tex( mPingPong[drawFbo]->getColorTexture(), 0 );
-                mDispMapShader->uniform( "uTime", float( getElapsedSeconds() ) );
-                mDispMapShader->uniform( "uAmplitude", mAmplitude );
+                mDispMapShader->uniform( "uTime", float( mClock.getInterpolatedTime() ) );
+                mDispMapShader->uniform( "uAmplitude", mAmplitude * ( 1.0f + mBeatDepth * mBeatPulse ) );
                 mDispMapShader->uniform( "uAudioAmplitude", mAudioAmplitude );
                 mDispMapShader->uniform( "uTex0", 0 );
                 gl::drawSolidRect( mDispMapFbo->getBounds() );
@@ -545,6 +1118,46 @@ void MusicalSmokeApp::renderNormalMap()
 	}
 }
 
+void MusicalSmokeApp::renderSurfaceMaps()
+{
+	if( mSurfaceMapsShader && mSurfaceMapsFbo ) {
+		// bind frame buffer, both color attachments are drawn to
+		gl::ScopedFramebuffer fbo( mSurfaceMapsFbo );
+
+		// setup viewport and matrices
+		gl::ScopedViewport viewport( 0, 0, mSurfaceMapsFbo->getWidth(), mSurfaceMapsFbo->getHeight() );
+
+		gl::pushMatrices();
+		gl::setMatricesWindow( mSurfaceMapsFbo->getSize() );
+
+		// every texel is overwritten, so there is no need to clear
+
+		// render both maps from the ping-pong texture
+		gl::ScopedGlslProg shader( mSurfaceMapsShader );
+		gl::ScopedTextureBind tex( mPingPong[drawFbo]->getColorTexture(), 0 );
+		mSurfaceMapsShader->uniform( "uTime", float( mClock.getInterpolatedTime() ) );
+		mSurfaceMapsShader->uniform( "uAmplitude", mAmplitude * ( 1.0f + mBeatDepth * mBeatPulse ) );
+		mSurfaceMapsShader->uniform( "uAudioAmplitude", mAudioAmplitude );
+		mSurfaceMapsShader->uniform( "uTex0", 0 );
+		mSurfaceMapsShader->uniform( "uTexelSize", vec2( 1.0f ) / vec2( mSurfaceMapsFbo->getSize() ) );
+		mSurfaceMapsShader->uniform( "uNormalAmplitude", 4.0f );
+		gl::drawSolidRect( mSurfaceMapsFbo->getBounds() );
+
+		// clean up after ourselves
+		gl::popMatrices();
+	}
+}
+
+gl::Texture2dRef MusicalSmokeApp::getDisplacementTexture() const
+{
+    return mDispMapFbo ? mDispMapFbo->getColorTexture() : gl::Texture2dRef();
+}
+
+gl::Texture2dRef MusicalSmokeApp::getNormalTexture() const
+{
+    return mNormalMapFbo ? mNormalMapFbo->getColorTexture() : gl::Texture2dRef();
+}
+
 bool MusicalSmokeApp::compileShaders()
 {
 	try {
@@ -556,8 +1169,15 @@ bool MusicalSmokeApp::compileShaders()
 		mDispMapShader = gl::GlslProg::create( loadAsset( "displacement_map.vert" ), loadAsset( "displacement_map.frag" ) );
 		// this shader will create a normal map based on the displacement map
 		mNormalMapShader = gl::GlslProg::create( loadAsset( "normal_map.vert" ), loadAsset( "normal_map.frag" ) );
+		// this shader will render the displacement and normal maps in one pass, to two render targets
+		mSurfaceMapsShader = gl::GlslProg::create( gl::GlslProg::Format()
+			.vertex( loadAsset( "displacement_map.vert" ) )
+			.fragment( loadAsset( "surface_maps.frag" ) )
+			.fragDataLocation( 0, "oDisplacement" )
+			.fragDataLocation( 1, "oNormal" ) );
 		// this shader will use the displacement and normal maps to displace vertices of a mesh
 		mMeshShader = gl::GlslProg::create( loadAsset( "mesh.vert" ), loadAsset( "mesh.frag" ) );
+		mMeshShader->uniformBlock( "Plumes", PlumesBinding );
 	}
 	catch( const std::exception &e ) {
 		console() << e.what() << std::endl;
@@ -572,7 +1192,11 @@ bool MusicalSmokeApp::compileShaders()
 void MusicalSmokeApp::resize()
 {
 	// if window is resized, update camera aspect ratio
-	mCamera.setAspectRatio( getWindowAspectRatio() );
+	// (offline renders keep the aspect ratio of the output)
+	if( mOffline && mOfflineRenderer.getFbo() )
+		mCamera.setAspectRatio( mOfflineRenderer.getFbo()->getAspectRatio() );
+	else
+		mCamera.setAspectRatio( getWindowAspectRatio() );
 }
 
 void MusicalSmokeApp::mouseMove( MouseEvent event )
@@ -642,6 +1266,22 @@ void MusicalSmokeApp::keyDown( KeyEvent event )
         case KeyEvent::KEY_q:
             mEnableShader = !mEnableShader;
             break;
+        case KeyEvent::KEY_LEFT:
+            // skip back, or forward, through the track
+            mSources.seek( mSources.getPosition() - SeekStep );
+            break;
+        case KeyEvent::KEY_RIGHT:
+            mSources.seek( mSources.getPosition() + SeekStep );
+            break;
+        case KeyEvent::KEY_n:
+            // next track
+            mSources.skip();
+            break;
+        case KeyEvent::KEY_i:
+            // toggle between the live input and the playlist
+            if( ! mOffline )
+                selectSource( ! mSources.isLive() );
+            break;
 	}
 }
 
@@ -651,73 +1291,344 @@ void MusicalSmokeApp::keyUp( KeyEvent event )
 
 #pragma mark Create Meshes, Textures
 
+PlumeMesh::Format MusicalSmokeApp::getMeshFormat() const
+{
+	PlumeMesh::Format format;
+	format.resX = mMeshResX;
+	format.resZ = mMeshResZ;
+	format.strips = mMeshStrips;
+	format.tiled = mMeshTiles;
+	return format;
+}
+
 void MusicalSmokeApp::createMesh()
 {
-	// create vertex, normal and texcoord buffers
-	const int  RES_X = 398;
-	const int  RES_Z = 98;
-	const vec3 size = vec3( 200.0f, 1.0f, 50.0f );
+	// blocks until the mesh is built, only used before the first frame
+	mPlumeMesh = PlumeMesh::create( getMeshFormat(), mMeshShader, mWorkers );
+	updateMeshLabel();
+}
 
-	std::vector<vec3> positions( RES_X * RES_Z );
-	std::vector<vec3> normals( RES_X * RES_Z );
-	std::vector<vec2> texcoords( RES_X * RES_Z );
-    
-    std::vector<Color> colors(RES_X * RES_Z);
-    
-	int i = 0;
-	for( int x = 0; x < RES_X; ++x ) {
-		for( int z = 0; z < RES_Z; ++z ) {
-            
-			float u = float( x ) / RES_X;
-			float v = float( z ) / RES_Z;
-			positions[i] = size * vec3( u - 0.5f, 0.0f, v - 0.5f );
-			normals[i] = vec3( 0, 1, 0 );
-			texcoords[i] = vec2( u, v );
-            
-            bool drawLengthLines = mLengthLines && z%2==0;
-            bool drawWidthLines = !mLengthLines && x%2==0;
-            if ( drawLengthLines || drawWidthLines ){
-                colors[i] = Color(1,v,u);
-            }else {
-                colors[i] = Color(0,v,u);
-            }
+void MusicalSmokeApp::requestMesh()
+{
+	// keep within the vertex budget by giving up resolution across the plume
+	if( mMeshResX * mMeshResZ > MaxMeshVertices ) {
+		mMeshResZ = std::max( MaxMeshVertices / mMeshResX, 2 );
+		console() << "Mesh limited to " << MaxMeshVertices << " vertices, Mesh Res Z set to " << mMeshResZ << std::endl;
+	}
+	// the current mesh keeps being drawn until the new one is on the GPU, see update()
+	mMeshRebuilder.request( getMeshFormat() );
+	mMeshLabel = "rebuilding...";
+}
 
-			i++;
+void MusicalSmokeApp::updatePlumes()
+{
+	// plumes stand side by side across the stage, each showing its own stretch of the
+	// field and, when there is more than one, swelling with its own band
+	std::vector<PlumeInstance> plumes( mNumPlumes );
+	std::vector<Emitter> emitters( mNumPlumes );
+	for( int i = 0; i < mNumPlumes; i++ ) {
+		float offset = i - 0.5f * ( mNumPlumes - 1 );
+		plumes[i].transform = glm::translate( mat4(), vec3( 0, 0, offset * mPlumeSpacing ) );
+		emitters[i].position += vec3( 0, 0, offset * mEmitterSpacing );
+		if( mNumPlumes > 1 ) {
+			int band = i * AudioFeatures::NumBands / mNumPlumes;
+			plumes[i].window = vec4( 0.25f * i / ( mNumPlumes - 1 ), 0, 0.75f, 1 );
+			plumes[i].audio = vec4( band, mPlumeBandGain, 0, 0 );
+			emitters[i].band = float( band );
+			emitters[i].bandGain = mPlumeBandGain;
 		}
 	}
+	mPlumesUbo->bufferSubData( 0, plumes.size() * sizeof( PlumeInstance ), plumes.data() );
+	
+	// one ember source per plume, all sharing the particle pool
+	particleSystem.setEmitters( emitters );
+}
 
-	// create index buffer
-	vector<uint16_t> indices;
-	indices.reserve( 6 * ( RES_X - 1 ) * ( RES_Z - 1 ) );
-	for( int x = 0; x < RES_X - 1; ++x ) {
-		for( int z = 0; z < RES_Z - 1; ++z ) {
-            uint16_t i = x * RES_Z + z;
-            
-            indices.push_back( i );
-            indices.push_back( i + 1 );
-            indices.push_back( i + RES_Z );
-            indices.push_back( i + RES_Z );
-            indices.push_back( i + 1 );
-            indices.push_back( i + RES_Z + 1 );
+void MusicalSmokeApp::updateMeshLabel()
+{
+	const PlumeMesh::Format &format = mPlumeMesh->getFormat();
+	mMeshLabel = toString( format.resX ) + "x" + toString( format.resZ ) + ", "
+		+ toString( mPlumeMesh->getNumTiles() ) + " tile(s), "
+		+ toString( mPlumeMesh->getIndexBytes() / 1024 ) + " KB indices, "
+		+ toString( int( mPlumeMesh->getBuildTime() + 0.5 ) ) + " ms";
+}
+
+void MusicalSmokeApp::benchmarkMesh()
+{
+	const ivec2 resolutions[] = { ivec2( 398, 98 ), ivec2( 1024, 256 ), ivec2( 2048, 512 ), ivec2( 4096, 1024 ) };
+	const char *modes[] = { "triangles", "strips", "tiles" };
+	const int runs = 5;
+
+	console() << "Mesh build time on " << mWorkers.getNumThreads() + 1 << " threads, best of " << runs << " (ms):" << std::endl;
+	for( const ivec2 &res : resolutions ) {
+		for( int mode = 0; mode < 3; mode++ ) {
+			PlumeMesh::Format format;
+			format.resX = res.x;
+			format.resZ = res.y;
+			format.strips = mode == 1;
+			format.tiled = mode == 2;
+
+			double best = 0;
+			for( int run = 0; run < runs; run++ ) {
+				double ms = PlumeMesh::create( format, mMeshShader, mWorkers )->getBuildTime();
+				best = run == 0 ? ms : std::min( best, ms );
+			}
+			console() << res.x << "x" << res.y << " " << modes[mode] << ": " << best << std::endl;
 		}
 	}
+}
 
-	// construct vertex buffer object
-	gl::VboMesh::Layout layout;
-    layout.attrib( geom::POSITION, 3 );
-    layout.attrib( geom::NORMAL, 3 );
-    layout.attrib( geom::COLOR, 3 );
-	layout.attrib( geom::TEX_COORD_0, 2 );
+void MusicalSmokeApp::benchmarkParticles()
+{
+	// the sweep the README asks for when sizing an install
+	const int counts[] = { 100, 1000, 10000, 100000, 1000000 };
+	// the GPU backend in both buffer layouts; the CPU backend is always interleaved
+	struct Run {
+		const char                  *name;
+		ParticleSystem::Backend     backend;
+		ParticleSystem::Layout      layout;
+	};
+	const Run runs[] = {
+		{ "gpu separate", ParticleSystem::BACKEND_GPU, ParticleSystem::LAYOUT_SEPARATE },
+		{ "gpu interleaved", ParticleSystem::BACKEND_GPU, ParticleSystem::LAYOUT_INTERLEAVED },
+		{ "cpu", ParticleSystem::BACKEND_CPU, ParticleSystem::LAYOUT_INTERLEAVED }
+	};
+	const int warmup = 10, steps = 100;
+	const float step = 1.0f / 60.0f;
+
+	// a markdown table, with the GPU and driver it was measured on, to paste into the README as it is
+	console() << "Particle step time, mean of " << steps << " steps (ms), on " << (const char*)glGetString( GL_RENDERER )
+		<< " (" << (const char*)glGetString( GL_VENDOR ) << ", OpenGL " << (const char*)glGetString( GL_VERSION ) << ")."
+		<< " CPU kernels: " << particles::getInstructionSet() << " on " << mWorkers.getNumThreads() + 1 << " threads." << std::endl << std::endl;
+	console() << "| Particles |";
+	for( const Run &run : runs )
+		console() << " " << run.name << " |";
+	console() << std::endl << "|-----------|";
+	for( size_t i = 0; i < sizeof( runs ) / sizeof( runs[0] ); i++ )
+		console() << "------|";
+	console() << std::endl;
+	for( int count : counts ) {
+		console() << "| " << count << " |";
+		for( const Run &run : runs ) {
+			ParticleSystem benchmarked;
+			benchmarked.setup( count, run.backend, &mWorkers );
+			benchmarked.setLayout( run.layout );
+			float time = 0;
+			for( int i = 0; i < warmup; i++ )
+				benchmarked.update( time += step, step );
+
+			// wait for the GPU on both ends, so that the GPU path is timed rather than queued
+			glFinish();
+			double started = getElapsedSeconds();
+			for( int i = 0; i < steps; i++ )
+				benchmarked.update( time += step, step );
+			glFinish();
+			double ms = 1000.0 * ( getElapsedSeconds() - started ) / steps;
+			console() << " " << ms << " |";
+		}
+		console() << std::endl;
+	}
+}
+
+void MusicalSmokeApp::benchmarkBeats()
+{
+	// click tracks: a loud burst of noise on every beat, a short quiet one between beats and a noise floor,
+	// and on some an off-beat burst like the beat's, straight or swung, up to as loud as the beat
+	struct Track {
+		float	tempo;
+		//! Off-beat amplitude over the beat's, and where in the beat it falls.
+		float	offBeat, swing;
+	};
+	const Track tracks[] = {
+		{ 70.0f, 0.0f, 0.5f }, { 96.0f, 0.0f, 0.5f }, { 120.0f, 0.0f, 0.5f }, { 128.0f, 0.0f, 0.5f }, { 140.0f, 0.0f, 0.5f }, { 174.0f, 0.0f, 0.5f },
+		{ 96.0f, 0.6f, 0.5f }, { 120.0f, 0.6f, 0.5f }, { 128.0f, 1.0f, 0.5f },
+		{ 110.0f, 0.6f, 0.6f }, { 120.0f, 1.0f, 0.6f }, { 140.0f, 0.6f, 2.0f / 3.0f }
+	};
+	const size_t sampleRate = 44100, blockSize = 512;
+	const double seconds = 30.0;
+	const size_t numSamples = size_t( seconds * sampleRate );
+	std::mt19937 random( 1 );
+	std::uniform_real_distribution<float> noise( -1.0f, 1.0f );
+	// A track passes when the tempo is within 1%, which fails octave errors, and the phase error on the
+	// beats is within 30 ms on average and 50 ms, or 15% of a beat when that is less, at worst. Pictures
+	// more than about 45 ms ahead of the sound look early, and the analysis window alone is 23 ms.
+	// The confidence on those beats must average at least a half, as it scales the beat pulse.
+	const double tempoTolerance = 0.01, meanTolerance = 0.030, worstTolerance = 0.050, worstBeats = 0.15, minConfidence = 0.5;
+	int failed = 0;
+
+	console() << "Analysis of " << seconds << " s click tracks in blocks of " << blockSize << " frames at " << sampleRate
+		<< " Hz. Phase error, positive when late, and confidence are measured on the beats of the second half." << std::endl;
+	for( const Track &track : tracks ) {
+		std::vector<float> samples( numSamples );
+		const float tempo = track.tempo;
+		const double beat = 60.0 / tempo;
+		for( size_t i = 0; i < numSamples; i++ ) {
+			double t = i / double( sampleRate );
+			double sinceBeat = fmod( t, beat ), sinceHat = fmod( t + 0.5 * beat, beat ), sinceOffBeat = fmod( t + ( 1.0 - track.swing ) * beat, beat );
+			float click = sinceBeat < 0.02 ? 0.8f * float( exp( -sinceBeat * 200.0 ) ) * noise( random ) : 0.0f;
+			float hat = sinceHat < 0.005 ? 0.1f * noise( random ) : 0.0f;
+			float offBeat = sinceOffBeat < 0.02 ? track.offBeat * 0.8f * float( exp( -sinceOffBeat * 200.0 ) ) * noise( random ) : 0.0f;
+			samples[i] = click + hat + offBeat + 0.01f * noise( random );
+		}
 
-	mVboMesh = gl::VboMesh::create( positions.size(), GL_TRIANGLES, { layout }, indices.size() );
-	mVboMesh->bufferAttrib( geom::POSITION, positions.size() * sizeof( vec3 ), positions.data() );
-    mVboMesh->bufferAttrib( geom::NORMAL, normals.size() * sizeof( vec3 ), normals.data() );
-    mVboMesh->bufferAttrib( geom::COLOR, colors.size() * sizeof( Color ), colors.data() );
-	mVboMesh->bufferAttrib( geom::TEX_COORD_0, texcoords.size() * sizeof( vec2 ), texcoords.data() );
-	mVboMesh->bufferIndices( indices.size() * sizeof( uint16_t ), indices.data() );
+		AudioFeatureExtractor extractor;
+		extractor.setup( sampleRate );
+		double error = 0, worst = 0, confidence = 0;
+		size_t numBeats = 0;
+		double started = getElapsedSeconds();
+		for( size_t i = 0; i + blockSize <= numSamples; i += blockSize ) {
+			extractor.process( samples.data() + i, blockSize );
+
+			// the phase of the block in which a beat fell, as seen at the end of the block
+			size_t beatIndex = size_t( ( i + blockSize ) / ( beat * sampleRate ) );
+			double beatTime = beatIndex * beat, blockEnd = double( i + blockSize ) / sampleRate;
+			if( beatTime * sampleRate >= i && blockEnd > seconds / 2 ) {
+				const AudioFeatures &features = extractor.getFeatures();
+				double expected = ( blockEnd - beatTime ) / beat;
+				double late = features.beatPhase - expected;
+				late -= floor( late + 0.5 );
+				error += late * beat;
+				worst = std::max( worst, fabs( late * beat ) );
+				confidence += features.beatConfidence;
+				numBeats++;
+			}
+		}
+		double ms = 1000.0 * ( getElapsedSeconds() - started );
+		const AudioFeatures &features = extractor.getFeatures();
+		double mean = error / std::max<size_t>( numBeats, 1 );
+		confidence /= std::max<size_t>( numBeats, 1 );
+		bool tempoOk = fabs( features.tempo - tempo ) <= tempoTolerance * tempo;
+		bool phaseOk = numBeats > 0 && fabs( mean ) <= meanTolerance && worst <= std::min( worstTolerance, worstBeats * beat );
+		bool confidenceOk = numBeats > 0 && confidence >= minConfidence;
+		console() << tempo << " bpm";
+		if( track.offBeat > 0 )
+			console() << " with off-beats at " << track.offBeat << " of the beat, " << track.swing << " beats in";
+		console() << ": found " << features.tempo << " bpm, confidence " << confidence
+			<< ", phase error " << 1000.0 * mean << " ms mean, " << 1000.0 * worst << " ms worst, "
+			<< ms / seconds << " ms per second of audio: " << ( tempoOk && phaseOk && confidenceOk ? "pass" : "FAIL" )
+			<< ( tempoOk ? "" : " (tempo)" ) << ( phaseOk ? "" : " (phase)" ) << ( confidenceOk ? "" : " (confidence)" ) << std::endl;
+		if( ! tempoOk || ! phaseOk || ! confidenceOk )
+			failed++;
+	}
+	if( failed )
+		console() << "FAILED: " << failed << " of " << sizeof( tracks ) / sizeof( tracks[0] ) << " click tracks out of tolerance." << std::endl;
+	else
+		console() << "All click tracks within tolerance." << std::endl;
+}
 
-	// create a batch for better performance
-	mBatch = gl::Batch::create( mVboMesh, mMeshShader );
+void MusicalSmokeApp::benchmarkSpectral()
+{
+	const size_t sizes[] = { 512, 1024, 2048, 4096, 8192 };
+	const spectral::InstructionSet sets[] = { spectral::INSTRUCTIONS_SCALAR, spectral::INSTRUCTIONS_SSE2, spectral::INSTRUCTIONS_AVX2, spectral::INSTRUCTIONS_NEON };
+	const char *kernels[] = { "rms", "applyWindow", "magnitudes", "bandMeans", "smooth" };
+	const size_t numBands = 32;
+	// about the same amount of work at every size
+	const size_t samplesPerRun = size_t( 1 ) << 24;
+	std::mt19937 random( 1 );
+	std::uniform_real_distribution<float> noise( -1.0f, 1.0f );
+	bool agree = true;
+
+	console() << "Spectral kernel time per call (us), against scalar. Dispatch picks " << spectral::getInstructionSet() << "." << std::endl;
+	for( size_t size : sizes ) {
+		const size_t bins = size / 2;
+		std::vector<float> samples( size ), window( size ), inverse( size ), real( bins ), imag( bins ), input( bins );
+		for( size_t i = 0; i < size; i++ ) {
+			samples[i] = noise( random );
+			// kept away from zero, so that windowing back and forth never underflows
+			window[i] = 0.5f + 0.25f * ( 1.0f + noise( random ) );
+			inverse[i] = 1.0f / window[i];
+		}
+		for( size_t i = 0; i < bins; i++ ) {
+			real[i] = noise( random );
+			imag[i] = noise( random );
+			input[i] = 0.5f * ( 1.0f + noise( random ) );
+		}
+		std::vector<size_t> edges( numBands + 1 );
+		for( size_t b = 0; b <= numBands; b++ )
+			edges[b] = std::min( size_t( pow( double( bins ), double( b ) / numBands ) ), bins );
+
+		// every instruction set's output, compared with the scalar one
+		struct Output {
+			float               rms, increase;
+			std::vector<float>  windowed, mag, bands, state;
+		};
+		Output reference;
+		const size_t calls = std::max<size_t>( samplesPerRun / size, 1 );
+		for( spectral::InstructionSet set : sets ) {
+			if( ! spectral::useInstructionSet( set ) )
+				continue;
+			Output out;
+			out.rms = spectral::rms( samples.data(), size );
+			out.windowed = samples;
+			spectral::applyWindow( out.windowed.data(), window.data(), size );
+			out.mag.resize( bins );
+			spectral::magnitudes( real.data(), imag.data(), out.mag.data(), bins, 0.5f );
+			out.bands.resize( numBands );
+			spectral::bandMeans( out.mag.data(), edges.data(), out.bands.data(), numBands );
+			out.state = real;
+			out.increase = spectral::smooth( out.state.data(), input.data(), 0.9f, bins );
+
+			double us[5];
+			volatile float sink = 0;
+			std::vector<float> data = samples, mag( bins ), bands( numBands ), state = input;
+			double started = getElapsedSeconds();
+			for( size_t c = 0; c < calls; c++ )
+				sink += spectral::rms( samples.data(), size );
+			us[0] = getElapsedSeconds() - started;
+			started = getElapsedSeconds();
+			for( size_t c = 0; c < calls; c += 2 ) {
+				spectral::applyWindow( data.data(), window.data(), size );
+				spectral::applyWindow( data.data(), inverse.data(), size );
+			}
+			us[1] = getElapsedSeconds() - started;
+			started = getElapsedSeconds();
+			for( size_t c = 0; c < calls; c++ )
+				spectral::magnitudes( real.data(), imag.data(), mag.data(), bins, 0.5f );
+			us[2] = getElapsedSeconds() - started;
+			started = getElapsedSeconds();
+			for( size_t c = 0; c < calls; c++ )
+				spectral::bandMeans( mag.data(), edges.data(), bands.data(), numBands );
+			us[3] = getElapsedSeconds() - started;
+			started = getElapsedSeconds();
+			for( size_t c = 0; c < calls; c++ )
+				sink += spectral::smooth( state.data(), input.data(), 0.9f, bins );
+			us[4] = getElapsedSeconds() - started;
+
+			// Vector sums add in a different order, so reductions get a relative tolerance.
+			// Element-wise results may differ in the last bits where FMA is used.
+			auto close = []( float a, float b, float tolerance ) {
+				return std::abs( a - b ) <= tolerance * std::max( 1.0f, std::max( std::abs( a ), std::abs( b ) ) );
+			};
+			auto allClose = [&]( const std::vector<float> &a, const std::vector<float> &b, float tolerance ) {
+				for( size_t i = 0; i < a.size(); i++ ) {
+					if( ! close( a[i], b[i], tolerance ) )
+						return false;
+				}
+				return true;
+			};
+			if( set == spectral::INSTRUCTIONS_SCALAR )
+				reference = out;
+			bool matches[5] = {
+				close( out.rms, reference.rms, 1e-4f ),
+				allClose( out.windowed, reference.windowed, 1e-6f ),
+				allClose( out.mag, reference.mag, 1e-6f ),
+				allClose( out.bands, reference.bands, 1e-4f ),
+				allClose( out.state, reference.state, 1e-6f ) && close( out.increase, reference.increase, 1e-4f )
+			};
+
+			console() << size << " " << spectral::getInstructionSet() << ":";
+			for( int k = 0; k < 5; k++ ) {
+				console() << " " << kernels[k] << " " << 1e6 * us[k] / calls;
+				if( ! matches[k] ) {
+					console() << " (MISMATCH)";
+					agree = false;
+				}
+			}
+			console() << std::endl;
+		}
+	}
+	spectral::useBestInstructionSet();
+	console() << ( agree ? "All instruction sets agree with scalar." : "FAILED: instruction sets disagree with scalar." ) << std::endl;
 }
 
 void MusicalSmokeApp::createTextures()
@@ -728,6 +1639,36 @@ void MusicalSmokeApp::createTextures()
 	catch( const std::exception &e ) {
 		console() << "Could not load image: " << e.what() << std::endl;
 	}
+    
+    // one row of band levels, sampled with linear filtering so neighbouring mesh rows blend between bands
+    auto spectrumFormat = gl::Texture2d::Format().internalFormat( GL_R32F ).minFilter( GL_LINEAR ).magFilter( GL_LINEAR ).wrap( GL_CLAMP_TO_EDGE );
+    spectrumFormat.setDataType( GL_FLOAT );
+    mSpectrumTexture = gl::Texture2d::create( AudioFeatures::NumBands, 1, spectrumFormat );
+    
+    for( int i = 0; i < 2; i++ )
+        mSpectrumPbo[i] = gl::Pbo::create( GL_PIXEL_UNPACK_BUFFER, sizeof( AudioFeatures::bands ), nullptr, GL_STREAM_DRAW );
+}
+
+void MusicalSmokeApp::uploadSpectrum()
+{
+    // Alternate between two pixel buffers and orphan the one we write, so the
+    // CPU never waits for a pending texture transfer. (Persistent mapping would
+    // avoid the map call entirely but needs GL 4.4, which macOS does not offer.)
+    const GLsizeiptr size = sizeof( AudioFeatures::bands );
+    gl::PboRef pbo = mSpectrumPbo[mSpectrumPboIndex];
+    mSpectrumPboIndex = 1 - mSpectrumPboIndex;
+    
+    gl::ScopedBuffer scopedPbo( pbo );
+    pbo->bufferData( size, nullptr, GL_STREAM_DRAW );
+    void *dst = pbo->mapBufferRange( 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT );
+    if( ! dst )
+        return;
+    memcpy( dst, mFeatures.bands, size );
+    pbo->unmap();
+    
+    // with a pixel unpack buffer bound, the data pointer is an offset into it
+    gl::ScopedTextureBind tex( mSpectrumTexture );
+    glTexSubImage2D( GL_TEXTURE_2D, 0, 0, 0, AudioFeatures::NumBands, 1, GL_RED, GL_FLOAT, nullptr );
 }
 
 CINDER_APP( MusicalSmokeApp, RendererGl( RendererGl::Options().msaa( 16 ) ), &MusicalSmokeApp::prepare )
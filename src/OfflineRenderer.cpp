@@ -0,0 +1,144 @@
+//
+//  OfflineRenderer.cpp
+//  MusicalSmoke
+//
+
+#include <cstdio>
+
+#include "cinder/app/App.h"
+#include "cinder/ImageIo.h"
+
+#include "OfflineRenderer.h"
+
+using namespace ci;
+using namespace ci::app;
+using namespace std;
+
+bool OfflineRenderer::parseArgs( const vector<string> &args, Options *options )
+{
+    bool offline = false;
+    for( size_t i = 0; i + 1 < args.size(); ++i ) {
+        const string &arg = args[i];
+        const string &value = args[i + 1];
+        if( arg == "--offline" ) {
+            options->audioPath = value;
+            offline = true;
+        }
+        else if( arg == "--out" ) {
+            options->outputPath = value;
+        }
+        else if( arg == "--fps" ) {
+            options->fps = std::max( 1.0, atof( value.c_str() ) );
+        }
+        else if( arg == "--size" ) {
+            int w, h;
+            if( sscanf( value.c_str(), "%dx%d", &w, &h ) == 2 )
+                options->size = ivec2( w, h );
+        }
+        else if( arg == "--sample-rate" ) {
+            int rate = atoi( value.c_str() );
+            if( rate > 0 )
+                options->sampleRate = size_t( rate );
+        }
+    }
+
+    if( offline && options->outputPath.empty() )
+        options->outputPath = "frames";
+
+    return offline;
+}
+
+void OfflineRenderer::setup( const Options &options, const AudioFeatureExtractor::Format &format )
+{
+    mOptions = options;
+    mFrame = 0;
+
+    // decoded at the rate of the output, as the player does, so the features match the live ones
+    mSourceFile = audio::load( loadFile( mOptions.audioPath ), mOptions.sampleRate );
+    mSampleRate = mSourceFile->getSampleRate();
+    mNumFrames = mSourceFile->getNumFrames();
+    mChunk = make_shared<audio::Buffer>( mSourceFile->getMaxFramesPerRead(), mSourceFile->getNumChannels() );
+    mChunkFrames = mChunkPosition = 0;
+    mAnalyzedFrames = 0;
+    mExtractor.setup( mSampleRate, format );
+
+    // render target, read back after every frame
+    gl::Fbo::Format fmt;
+    fmt.samples( 8 );
+    mFbo = gl::Fbo::create( mOptions.size.x, mOptions.size.y, fmt );
+
+    mWriteRaw = mOptions.outputPath.extension() == ".rgb";
+    if( mWriteRaw ) {
+        mRawStream.open( mOptions.outputPath.string().c_str(), ios::binary | ios::trunc );
+        mRow.resize( mOptions.size.x * 3 );
+    }
+    else {
+        fs::create_directories( mOptions.outputPath );
+    }
+
+    console() << "Offline render: " << mOptions.audioPath << " -> " << mOptions.outputPath
+              << " (" << mOptions.size.x << "x" << mOptions.size.y << " @ " << mOptions.fps << " fps)" << endl;
+}
+
+void OfflineRenderer::advance()
+{
+    ++mFrame;
+    
+    // analyze everything up to the new frame time, decoding as far as that needs
+    size_t end = std::min<size_t>( size_t( getTime() * mSampleRate ), mNumFrames );
+    while( mAnalyzedFrames < end ) {
+        if( mChunkPosition == mChunkFrames ) {
+            mChunkFrames = mSourceFile->read( mChunk.get() );
+            mChunkPosition = 0;
+            if( mChunkFrames == 0 ) {
+                // shorter than the header said
+                mNumFrames = mAnalyzedFrames;
+                break;
+            }
+        }
+        size_t count = std::min( mChunkFrames - mChunkPosition, end - mAnalyzedFrames );
+        mExtractor.process( mChunk->getChannel( 0 ) + mChunkPosition, count );
+        mChunkPosition += count;
+        mAnalyzedFrames += count;
+    }
+}
+
+bool OfflineRenderer::isFinished() const
+{
+    return ! mSourceFile || getTime() * mSampleRate >= mNumFrames;
+}
+
+void OfflineRenderer::writeFrame()
+{
+    Surface8u surface = mFbo->readPixels8u( mFbo->getBounds() );
+
+    if( mWriteRaw ) {
+        // rgb24, top row first: ffmpeg -f rawvideo -pix_fmt rgb24 -s WxH -r FPS -i frames.rgb
+        // Rows are copied straight out of the surface's memory, dropping alpha on the way.
+        const uint8_t pixelInc = surface.getPixelInc();
+        const uint8_t r = surface.getRedOffset(), g = surface.getGreenOffset(), b = surface.getBlueOffset();
+        const size_t rowBytes = surface.getWidth() * 3;
+        for( int y = 0; y < surface.getHeight(); ++y ) {
+            const uint8_t *in = surface.getData( ivec2( 0, y ) );
+            if( pixelInc == 3 && r == 0 && g == 1 && b == 2 ) {
+                mRawStream.write( (const char*)in, rowBytes );
+                continue;
+            }
+            uint8_t *out = mRow.data();
+            for( int x = 0; x < surface.getWidth(); ++x, in += pixelInc ) {
+                *out++ = in[r];
+                *out++ = in[g];
+                *out++ = in[b];
+            }
+            mRawStream.write( (const char*)mRow.data(), rowBytes );
+        }
+    }
+    else {
+        char name[32];
+        snprintf( name, sizeof( name ), "frame_%06llu.png", (unsigned long long)mFrame );
+        writeImage( mOptions.outputPath / name, surface );
+    }
+
+    if( mFrame % 600 == 0 )
+        console() << "Offline render: " << getTime() << " s" << endl;
+}
@@ -0,0 +1,79 @@
+//
+//  OfflineRenderer.h
+//  MusicalSmoke
+//
+//  Renders a track to disk on a fixed simulated clock, as fast as the
+//  machine allows, instead of playing it back in real time.
+//
+
+#ifndef OfflineRenderer_h
+#define OfflineRenderer_h
+
+#include "cinder/audio/Buffer.h"
+#include "cinder/audio/Source.h"
+#include "cinder/Filesystem.h"
+#include "cinder/gl/Fbo.h"
+
+#include "AudioFeatures.h"
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+class OfflineRenderer{
+
+public:
+    struct Options {
+        //! Audio file to render.
+        cinder::fs::path    audioPath;
+        //! Directory for a numbered PNG sequence, or a file ending in .rgb for raw rgb24 frames.
+        cinder::fs::path    outputPath;
+        //! Simulated frame rate of the output.
+        double              fps = 60.0;
+        //! Output resolution in pixels.
+        cinder::ivec2       size = cinder::ivec2( 1920, 1080 );
+        //! Rate the track is decoded and analysed at: that of the output device it would play on, so
+        //! that the analysis frames fall where the live ones do.
+        size_t              sampleRate = 44100;
+    };
+
+    //! Parses "--offline <audio> --out <path> [--fps <n>] [--size <w>x<h>] [--sample-rate <hz>]". Returns false if --offline is absent.
+    static bool parseArgs( const std::vector<std::string> &args, Options *options );
+
+    //! \a format is the analysis format of the live graph.
+    void setup( const Options &options, const AudioFeatureExtractor::Format &format );
+
+    //! Moves the simulated clock forward by one frame and analyses the audio up to it, before the frame is made.
+    void advance();
+    //! Reads back the current frame from the render target and writes it to disk.
+    void writeFrame();
+
+    bool     isFinished() const;
+    double   getTime() const { return mFrame / mOptions.fps; }
+    double   getFrameDuration() const { return 1.0 / mOptions.fps; }
+    uint64_t getFrame() const { return mFrame; }
+
+    //! Analysis of the audio up to the current simulated time, with the live graph's format and sample rate.
+    const AudioFeatures& getFeatures() const { return mExtractor.getFeatures(); }
+
+    const cinder::gl::FboRef& getFbo() const { return mFbo; }
+
+private:
+    Options                     mOptions;
+    // the track is decoded a chunk at a time, as the clock reaches it
+    cinder::audio::SourceFileRef mSourceFile;
+    cinder::audio::BufferRef    mChunk;
+    size_t                      mChunkFrames = 0, mChunkPosition = 0;
+    size_t                      mNumFrames = 0;
+    size_t                      mSampleRate = 44100;
+    size_t                      mAnalyzedFrames = 0;
+    AudioFeatureExtractor       mExtractor;
+    uint64_t                    mFrame = 0;
+
+    cinder::gl::FboRef          mFbo;
+    bool                        mWriteRaw = false;
+    std::ofstream               mRawStream;
+    std::vector<uint8_t>        mRow;
+};
+
+#endif /* OfflineRenderer_h */
@@ -0,0 +1,433 @@
+//
+//  ParticleKernels.cpp
+//  MusicalSmoke
+//
+
+#include <cmath>
+
+#include "ParticleKernels.h"
+
+#if defined( __x86_64__ ) || defined( _M_X64 ) || defined( __i386__ ) || defined( _M_IX86 )
+	#define PARTICLES_SSE 1
+	#include <emmintrin.h>
+	#if defined( __GNUC__ ) || defined( __clang__ )
+		// AVX2 versions are compiled with a per-function target and picked at runtime
+		#define PARTICLES_AVX2 1
+		#include <immintrin.h>
+	#endif
+#elif defined( __ARM_NEON ) || defined( __ARM_NEON__ )
+	#define PARTICLES_NEON 1
+	#include <arm_neon.h>
+#endif
+
+namespace particles {
+
+namespace {
+
+// Integer hash (lowbias32). Unlike the PCG hash of the GPU path it needs no
+// variable shifts, which SSE2 does not have.
+const uint32_t HashMul1 = 0x7feb352du;
+const uint32_t HashMul2 = 0x846ca68bu;
+
+// 24 bits of a hash to [0, 1), or to [-1, 1] for the noise lattice
+const float RandomScale = 1.0f / 16777216.0f;
+const float LatticeScale = 2.0f / 16777215.0f;
+
+#pragma mark Scalar
+
+inline uint32_t hashScalar( uint32_t x )
+{
+	x ^= x >> 16;
+	x *= HashMul1;
+	x ^= x >> 15;
+	x *= HashMul2;
+	x ^= x >> 16;
+	return x;
+}
+
+inline float latticeScalar( int32_t i )
+{
+	return float( hashScalar( uint32_t( i ) ) >> 8 ) * LatticeScale - 1.0f;
+}
+
+float noiseScalar( float t )
+{
+	float cell = std::floor( t );
+	int32_t i = int32_t( cell );
+	float f = t - cell;
+	float u = f * f * ( 3.0f - 2.0f * f );
+	float a = latticeScalar( i );
+	return a + ( latticeScalar( i + 1 ) - a ) * u;
+}
+
+void stepScalar( const Soa &p, size_t begin, size_t end, const Step &s )
+{
+	for( size_t i = begin; i < end; i++ ) {
+		float start = p.startTime[i];
+		if( s.time < start )
+			continue;
+
+		float age = s.time - start;
+		if( age <= s.lifetime ) {
+			// alive, integrate
+			float n = noiseScalar( s.time + start ) * s.h;
+			p.px[i] += p.vx[i] * s.h;
+			p.py[i] += p.vy[i] * s.h;
+			p.pz[i] += p.vz[i] * s.h;
+			p.vx[i] += 2.0f * n;
+			p.vy[i] += n;
+		}
+		else if( float( hashScalar( uint32_t( i ) ^ s.seed ) >> 8 ) * RandomScale < s.spawnProbability ) {
+			// past its lifetime, recycle
+			float scale = p.rw[i] * s.speed;
+			p.px[i] = s.position[0];
+			p.py[i] = s.position[1];
+			p.pz[i] = s.position[2];
+			p.vx[i] = ( s.direction[0] + s.spread * p.rx[i] ) * scale;
+			p.vy[i] = ( s.direction[1] + s.spread * p.ry[i] ) * scale;
+			p.vz[i] = ( s.direction[2] + s.spread * p.rz[i] ) * scale;
+			p.startTime[i] = s.time;
+		}
+	}
+}
+
+#if PARTICLES_SSE
+
+#pragma mark SSE2
+
+// SSE2 has no 32 bit multiply that keeps the low halves (that came with SSE4.1)
+inline __m128i mulloSse( __m128i a, __m128i b )
+{
+	__m128i even = _mm_mul_epu32( a, b );
+	__m128i odd = _mm_mul_epu32( _mm_srli_epi64( a, 32 ), _mm_srli_epi64( b, 32 ) );
+	return _mm_unpacklo_epi32( _mm_shuffle_epi32( even, _MM_SHUFFLE( 0, 0, 2, 0 ) ), _mm_shuffle_epi32( odd, _MM_SHUFFLE( 0, 0, 2, 0 ) ) );
+}
+
+inline __m128i hashSse( __m128i x )
+{
+	x = _mm_xor_si128( x, _mm_srli_epi32( x, 16 ) );
+	x = mulloSse( x, _mm_set1_epi32( int( HashMul1 ) ) );
+	x = _mm_xor_si128( x, _mm_srli_epi32( x, 15 ) );
+	x = mulloSse( x, _mm_set1_epi32( int( HashMul2 ) ) );
+	return _mm_xor_si128( x, _mm_srli_epi32( x, 16 ) );
+}
+
+inline __m128 latticeSse( __m128i i )
+{
+	return _mm_sub_ps( _mm_mul_ps( _mm_cvtepi32_ps( _mm_srli_epi32( hashSse( i ), 8 ) ), _mm_set1_ps( LatticeScale ) ), _mm_set1_ps( 1.0f ) );
+}
+
+inline __m128 noiseSse( __m128 t )
+{
+	// truncation rounds negative values up, step those back down
+	__m128i i = _mm_cvttps_epi32( t );
+	__m128 cell = _mm_cvtepi32_ps( i );
+	__m128 above = _mm_cmpgt_ps( cell, t );
+	i = _mm_add_epi32( i, _mm_castps_si128( above ) );
+	cell = _mm_sub_ps( cell, _mm_and_ps( above, _mm_set1_ps( 1.0f ) ) );
+
+	__m128 f = _mm_sub_ps( t, cell );
+	__m128 u = _mm_mul_ps( _mm_mul_ps( f, f ), _mm_sub_ps( _mm_set1_ps( 3.0f ), _mm_add_ps( f, f ) ) );
+	__m128 a = latticeSse( i );
+	__m128 b = latticeSse( _mm_add_epi32( i, _mm_set1_epi32( 1 ) ) );
+	return _mm_add_ps( a, _mm_mul_ps( _mm_sub_ps( b, a ), u ) );
+}
+
+inline __m128 selectSse( __m128 mask, __m128 a, __m128 b )
+{
+	return _mm_or_ps( _mm_and_ps( mask, a ), _mm_andnot_ps( mask, b ) );
+}
+
+void stepSse( const Soa &p, size_t begin, size_t end, const Step &s )
+{
+	const __m128 time = _mm_set1_ps( s.time );
+	const __m128 h = _mm_set1_ps( s.h );
+	const __m128 lifetime = _mm_set1_ps( s.lifetime );
+	const __m128 probability = _mm_set1_ps( s.spawnProbability );
+	const __m128 spread = _mm_set1_ps( s.spread );
+	const __m128 speed = _mm_set1_ps( s.speed );
+	const __m128i seed = _mm_set1_epi32( int( s.seed ) );
+	const __m128i lanes = _mm_setr_epi32( 0, 1, 2, 3 );
+
+	size_t i = begin;
+	for( ; i + 4 <= end; i += 4 ) {
+		__m128 start = _mm_loadu_ps( p.startTime + i );
+		__m128 born = _mm_cmple_ps( start, time );
+		__m128 age = _mm_sub_ps( time, start );
+		__m128 alive = _mm_and_ps( born, _mm_cmple_ps( age, lifetime ) );
+		__m128i index = _mm_add_epi32( _mm_set1_epi32( int( i ) ), lanes );
+		__m128 random = _mm_mul_ps( _mm_cvtepi32_ps( _mm_srli_epi32( hashSse( _mm_xor_si128( index, seed ) ), 8 ) ), _mm_set1_ps( RandomScale ) );
+		__m128 respawn = _mm_andnot_ps( alive, _mm_and_ps( born, _mm_cmplt_ps( random, probability ) ) );
+		if( _mm_movemask_ps( _mm_or_ps( alive, respawn ) ) == 0 )
+			continue;
+
+		__m128 px = _mm_loadu_ps( p.px + i ), py = _mm_loadu_ps( p.py + i ), pz = _mm_loadu_ps( p.pz + i );
+		__m128 vx = _mm_loadu_ps( p.vx + i ), vy = _mm_loadu_ps( p.vy + i ), vz = _mm_loadu_ps( p.vz + i );
+
+		// alive, integrate
+		__m128 n = _mm_mul_ps( noiseSse( _mm_add_ps( time, start ) ), h );
+		__m128 ax = _mm_add_ps( px, _mm_mul_ps( vx, h ) );
+		__m128 ay = _mm_add_ps( py, _mm_mul_ps( vy, h ) );
+		__m128 az = _mm_add_ps( pz, _mm_mul_ps( vz, h ) );
+		__m128 avx = _mm_add_ps( vx, _mm_add_ps( n, n ) );
+		__m128 avy = _mm_add_ps( vy, n );
+
+		// past its lifetime, recycle
+		__m128 scale = _mm_mul_ps( _mm_loadu_ps( p.rw + i ), speed );
+		__m128 rvx = _mm_mul_ps( _mm_add_ps( _mm_set1_ps( s.direction[0] ), _mm_mul_ps( spread, _mm_loadu_ps( p.rx + i ) ) ), scale );
+		__m128 rvy = _mm_mul_ps( _mm_add_ps( _mm_set1_ps( s.direction[1] ), _mm_mul_ps( spread, _mm_loadu_ps( p.ry + i ) ) ), scale );
+		__m128 rvz = _mm_mul_ps( _mm_add_ps( _mm_set1_ps( s.direction[2] ), _mm_mul_ps( spread, _mm_loadu_ps( p.rz + i ) ) ), scale );
+
+		_mm_storeu_ps( p.px + i, selectSse( alive, ax, selectSse( respawn, _mm_set1_ps( s.position[0] ), px ) ) );
+		_mm_storeu_ps( p.py + i, selectSse( alive, ay, selectSse( respawn, _mm_set1_ps( s.position[1] ), py ) ) );
+		_mm_storeu_ps( p.pz + i, selectSse( alive, az, selectSse( respawn, _mm_set1_ps( s.position[2] ), pz ) ) );
+		_mm_storeu_ps( p.vx + i, selectSse( alive, avx, selectSse( respawn, rvx, vx ) ) );
+		_mm_storeu_ps( p.vy + i, selectSse( alive, avy, selectSse( respawn, rvy, vy ) ) );
+		_mm_storeu_ps( p.vz + i, selectSse( respawn, rvz, vz ) );
+		_mm_storeu_ps( p.startTime + i, selectSse( respawn, time, start ) );
+	}
+	stepScalar( p, i, end, s );
+}
+
+#endif // PARTICLES_SSE
+
+#if PARTICLES_AVX2
+
+#pragma mark AVX2
+
+#define PARTICLES_TARGET_AVX2 __attribute__(( target( "avx2,fma" ) ))
+
+PARTICLES_TARGET_AVX2 inline __m256i hashAvx2( __m256i x )
+{
+	x = _mm256_xor_si256( x, _mm256_srli_epi32( x, 16 ) );
+	x = _mm256_mullo_epi32( x, _mm256_set1_epi32( int( HashMul1 ) ) );
+	x = _mm256_xor_si256( x, _mm256_srli_epi32( x, 15 ) );
+	x = _mm256_mullo_epi32( x, _mm256_set1_epi32( int( HashMul2 ) ) );
+	return _mm256_xor_si256( x, _mm256_srli_epi32( x, 16 ) );
+}
+
+PARTICLES_TARGET_AVX2 inline __m256 latticeAvx2( __m256i i )
+{
+	return _mm256_fmsub_ps( _mm256_cvtepi32_ps( _mm256_srli_epi32( hashAvx2( i ), 8 ) ), _mm256_set1_ps( LatticeScale ), _mm256_set1_ps( 1.0f ) );
+}
+
+PARTICLES_TARGET_AVX2 inline __m256 noiseAvx2( __m256 t )
+{
+	__m256 cell = _mm256_floor_ps( t );
+	__m256i i = _mm256_cvtps_epi32( cell );
+	__m256 f = _mm256_sub_ps( t, cell );
+	__m256 u = _mm256_mul_ps( _mm256_mul_ps( f, f ), _mm256_sub_ps( _mm256_set1_ps( 3.0f ), _mm256_add_ps( f, f ) ) );
+	__m256 a = latticeAvx2( i );
+	__m256 b = latticeAvx2( _mm256_add_epi32( i, _mm256_set1_epi32( 1 ) ) );
+	return _mm256_fmadd_ps( _mm256_sub_ps( b, a ), u, a );
+}
+
+PARTICLES_TARGET_AVX2 void stepAvx2( const Soa &p, size_t begin, size_t end, const Step &s )
+{
+	const __m256 time = _mm256_set1_ps( s.time );
+	const __m256 h = _mm256_set1_ps( s.h );
+	const __m256 lifetime = _mm256_set1_ps( s.lifetime );
+	const __m256 probability = _mm256_set1_ps( s.spawnProbability );
+	const __m256 spread = _mm256_set1_ps( s.spread );
+	const __m256 speed = _mm256_set1_ps( s.speed );
+	const __m256i seed = _mm256_set1_epi32( int( s.seed ) );
+	const __m256i lanes = _mm256_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7 );
+
+	size_t i = begin;
+	for( ; i + 8 <= end; i += 8 ) {
+		__m256 start = _mm256_loadu_ps( p.startTime + i );
+		__m256 born = _mm256_cmp_ps( start, time, _CMP_LE_OQ );
+		__m256 age = _mm256_sub_ps( time, start );
+		__m256 alive = _mm256_and_ps( born, _mm256_cmp_ps( age, lifetime, _CMP_LE_OQ ) );
+		__m256i index = _mm256_add_epi32( _mm256_set1_epi32( int( i ) ), lanes );
+		__m256 random = _mm256_mul_ps( _mm256_cvtepi32_ps( _mm256_srli_epi32( hashAvx2( _mm256_xor_si256( index, seed ) ), 8 ) ), _mm256_set1_ps( RandomScale ) );
+		__m256 respawn = _mm256_andnot_ps( alive, _mm256_and_ps( born, _mm256_cmp_ps( random, probability, _CMP_LT_OQ ) ) );
+		if( _mm256_movemask_ps( _mm256_or_ps( alive, respawn ) ) == 0 )
+			continue;
+
+		__m256 px = _mm256_loadu_ps( p.px + i ), py = _mm256_loadu_ps( p.py + i ), pz = _mm256_loadu_ps( p.pz + i );
+		__m256 vx = _mm256_loadu_ps( p.vx + i ), vy = _mm256_loadu_ps( p.vy + i ), vz = _mm256_loadu_ps( p.vz + i );
+
+		// alive, integrate
+		__m256 n = _mm256_mul_ps( noiseAvx2( _mm256_add_ps( time, start ) ), h );
+		__m256 ax = _mm256_fmadd_ps( vx, h, px );
+		__m256 ay = _mm256_fmadd_ps( vy, h, py );
+		__m256 az = _mm256_fmadd_ps( vz, h, pz );
+		__m256 avx = _mm256_add_ps( vx, _mm256_add_ps( n, n ) );
+		__m256 avy = _mm256_add_ps( vy, n );
+
+		// past its lifetime, recycle
+		__m256 scale = _mm256_mul_ps( _mm256_loadu_ps( p.rw + i ), speed );
+		__m256 rvx = _mm256_mul_ps( _mm256_fmadd_ps( spread, _mm256_loadu_ps( p.rx + i ), _mm256_set1_ps( s.direction[0] ) ), scale );
+		__m256 rvy = _mm256_mul_ps( _mm256_fmadd_ps( spread, _mm256_loadu_ps( p.ry + i ), _mm256_set1_ps( s.direction[1] ) ), scale );
+		__m256 rvz = _mm256_mul_ps( _mm256_fmadd_ps( spread, _mm256_loadu_ps( p.rz + i ), _mm256_set1_ps( s.direction[2] ) ), scale );
+
+		// blendv takes the second operand where the mask is set
+		_mm256_storeu_ps( p.px + i, _mm256_blendv_ps( _mm256_blendv_ps( px, _mm256_set1_ps( s.position[0] ), respawn ), ax, alive ) );
+		_mm256_storeu_ps( p.py + i, _mm256_blendv_ps( _mm256_blendv_ps( py, _mm256_set1_ps( s.position[1] ), respawn ), ay, alive ) );
+		_mm256_storeu_ps( p.pz + i, _mm256_blendv_ps( _mm256_blendv_ps( pz, _mm256_set1_ps( s.position[2] ), respawn ), az, alive ) );
+		_mm256_storeu_ps( p.vx + i, _mm256_blendv_ps( _mm256_blendv_ps( vx, rvx, respawn ), avx, alive ) );
+		_mm256_storeu_ps( p.vy + i, _mm256_blendv_ps( _mm256_blendv_ps( vy, rvy, respawn ), avy, alive ) );
+		_mm256_storeu_ps( p.vz + i, _mm256_blendv_ps( vz, rvz, respawn ) );
+		_mm256_storeu_ps( p.startTime + i, _mm256_blendv_ps( start, time, respawn ) );
+	}
+	stepScalar( p, i, end, s );
+}
+
+#endif // PARTICLES_AVX2
+
+#if PARTICLES_NEON
+
+#pragma mark NEON
+
+inline uint32x4_t hashNeon( uint32x4_t x )
+{
+	x = veorq_u32( x, vshrq_n_u32( x, 16 ) );
+	x = vmulq_n_u32( x, HashMul1 );
+	x = veorq_u32( x, vshrq_n_u32( x, 15 ) );
+	x = vmulq_n_u32( x, HashMul2 );
+	return veorq_u32( x, vshrq_n_u32( x, 16 ) );
+}
+
+inline float32x4_t latticeNeon( int32x4_t i )
+{
+	float32x4_t h = vcvtq_f32_u32( vshrq_n_u32( hashNeon( vreinterpretq_u32_s32( i ) ), 8 ) );
+	return vsubq_f32( vmulq_n_f32( h, LatticeScale ), vdupq_n_f32( 1.0f ) );
+}
+
+inline float32x4_t noiseNeon( float32x4_t t )
+{
+	// truncation rounds negative values up, step those back down
+	int32x4_t i = vcvtq_s32_f32( t );
+	float32x4_t cell = vcvtq_f32_s32( i );
+	uint32x4_t above = vcgtq_f32( cell, t );
+	i = vaddq_s32( i, vreinterpretq_s32_u32( above ) );
+	cell = vsubq_f32( cell, vreinterpretq_f32_u32( vandq_u32( above, vreinterpretq_u32_f32( vdupq_n_f32( 1.0f ) ) ) ) );
+
+	float32x4_t f = vsubq_f32( t, cell );
+	float32x4_t u = vmulq_f32( vmulq_f32( f, f ), vsubq_f32( vdupq_n_f32( 3.0f ), vaddq_f32( f, f ) ) );
+	float32x4_t a = latticeNeon( i );
+	float32x4_t b = latticeNeon( vaddq_s32( i, vdupq_n_s32( 1 ) ) );
+	return vmlaq_f32( a, vsubq_f32( b, a ), u );
+}
+
+inline bool anyNeon( uint32x4_t mask )
+{
+	uint32x2_t halves = vorr_u32( vget_low_u32( mask ), vget_high_u32( mask ) );
+	return vget_lane_u32( vpmax_u32( halves, halves ), 0 ) != 0;
+}
+
+void stepNeon( const Soa &p, size_t begin, size_t end, const Step &s )
+{
+	const float32x4_t time = vdupq_n_f32( s.time );
+	const float32x4_t lifetime = vdupq_n_f32( s.lifetime );
+	const float32x4_t probability = vdupq_n_f32( s.spawnProbability );
+	const uint32x4_t seed = vdupq_n_u32( s.seed );
+	const uint32_t laneOffsets[4] = { 0, 1, 2, 3 };
+	const uint32x4_t lanes = vld1q_u32( laneOffsets );
+
+	size_t i = begin;
+	for( ; i + 4 <= end; i += 4 ) {
+		float32x4_t start = vld1q_f32( p.startTime + i );
+		uint32x4_t born = vcleq_f32( start, time );
+		float32x4_t age = vsubq_f32( time, start );
+		uint32x4_t alive = vandq_u32( born, vcleq_f32( age, lifetime ) );
+		uint32x4_t index = vaddq_u32( vdupq_n_u32( uint32_t( i ) ), lanes );
+		float32x4_t random = vmulq_n_f32( vcvtq_f32_u32( vshrq_n_u32( hashNeon( veorq_u32( index, seed ) ), 8 ) ), RandomScale );
+		uint32x4_t respawn = vbicq_u32( vandq_u32( born, vcltq_f32( random, probability ) ), alive );
+		if( ! anyNeon( vorrq_u32( alive, respawn ) ) )
+			continue;
+
+		float32x4_t px = vld1q_f32( p.px + i ), py = vld1q_f32( p.py + i ), pz = vld1q_f32( p.pz + i );
+		float32x4_t vx = vld1q_f32( p.vx + i ), vy = vld1q_f32( p.vy + i ), vz = vld1q_f32( p.vz + i );
+
+		// alive, integrate
+		float32x4_t n = vmulq_n_f32( noiseNeon( vaddq_f32( time, start ) ), s.h );
+		float32x4_t ax = vmlaq_n_f32( px, vx, s.h );
+		float32x4_t ay = vmlaq_n_f32( py, vy, s.h );
+		float32x4_t az = vmlaq_n_f32( pz, vz, s.h );
+		float32x4_t avx = vaddq_f32( vx, vaddq_f32( n, n ) );
+		float32x4_t avy = vaddq_f32( vy, n );
+
+		// past its lifetime, recycle
+		float32x4_t scale = vmulq_n_f32( vld1q_f32( p.rw + i ), s.speed );
+		float32x4_t rvx = vmulq_f32( vmlaq_n_f32( vdupq_n_f32( s.direction[0] ), vld1q_f32( p.rx + i ), s.spread ), scale );
+		float32x4_t rvy = vmulq_f32( vmlaq_n_f32( vdupq_n_f32( s.direction[1] ), vld1q_f32( p.ry + i ), s.spread ), scale );
+		float32x4_t rvz = vmulq_f32( vmlaq_n_f32( vdupq_n_f32( s.direction[2] ), vld1q_f32( p.rz + i ), s.spread ), scale );
+
+		vst1q_f32( p.px + i, vbslq_f32( alive, ax, vbslq_f32( respawn, vdupq_n_f32( s.position[0] ), px ) ) );
+		vst1q_f32( p.py + i, vbslq_f32( alive, ay, vbslq_f32( respawn, vdupq_n_f32( s.position[1] ), py ) ) );
+		vst1q_f32( p.pz + i, vbslq_f32( alive, az, vbslq_f32( respawn, vdupq_n_f32( s.position[2] ), pz ) ) );
+		vst1q_f32( p.vx + i, vbslq_f32( alive, avx, vbslq_f32( respawn, rvx, vx ) ) );
+		vst1q_f32( p.vy + i, vbslq_f32( alive, avy, vbslq_f32( respawn, rvy, vy ) ) );
+		vst1q_f32( p.vz + i, vbslq_f32( respawn, rvz, vz ) );
+		vst1q_f32( p.startTime + i, vbslq_f32( respawn, time, start ) );
+	}
+	stepScalar( p, i, end, s );
+}
+
+#endif // PARTICLES_NEON
+
+#pragma mark Dispatch
+
+struct Kernels {
+	void (*step)( const Soa&, size_t, size_t, const Step& );
+	const char *name;
+};
+
+Kernels selectKernels()
+{
+#if PARTICLES_AVX2
+	__builtin_cpu_init();
+	if( __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "fma" ) ) {
+		Kernels avx2 = { stepAvx2, "AVX2" };
+		return avx2;
+	}
+#endif
+#if PARTICLES_SSE
+	Kernels sse = { stepSse, "SSE2" };
+	return sse;
+#elif PARTICLES_NEON
+	Kernels neon = { stepNeon, "NEON" };
+	return neon;
+#else
+	Kernels scalar = { stepScalar, "scalar" };
+	return scalar;
+#endif
+}
+
+const Kernels sKernels = selectKernels();
+
+} // anonymous namespace
+
+void step( const Soa &particles, size_t begin, size_t end, const Step &step )
+{
+	sKernels.step( particles, begin, end, step );
+}
+
+void pack( const Soa &p, size_t begin, size_t end, float emitter, float *records )
+{
+	for( size_t i = begin; i < end; i++ ) {
+		float *record = records + i * 8;
+		record[0] = p.px[i];
+		record[1] = p.py[i];
+		record[2] = p.pz[i];
+		record[3] = p.startTime[i];
+		record[4] = p.vx[i];
+		record[5] = p.vy[i];
+		record[6] = p.vz[i];
+		record[7] = emitter;
+	}
+}
+
+float noise( float t )
+{
+	return noiseScalar( t );
+}
+
+const char* getInstructionSet()
+{
+	return sKernels.name;
+}
+
+} // namespace particles
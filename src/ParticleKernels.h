@@ -0,0 +1,55 @@
+//
+//  ParticleKernels.h
+//  MusicalSmoke
+//
+//  The particle step of updateParticles.vert on the CPU, for machines where
+//  the GPU path is slow (software GL) or missing. Vectorized like
+//  SpectralKernels: AVX2 picked at runtime, SSE2 or NEON otherwise, and a
+//  scalar fallback.
+//
+
+#ifndef ParticleKernels_h
+#define ParticleKernels_h
+
+#include <cstddef>
+#include <cstdint>
+
+namespace particles {
+
+//! Particle state, one array per attribute.
+struct Soa {
+	float *px, *py, *pz;
+	float *vx, *vy, *vz;
+	float *startTime;
+	//! Random unit direction and speed fraction, see VertexInitialVelocity in updateParticles.vert.
+	const float *rx, *ry, *rz, *rw;
+};
+
+//! One emitter's part of a simulation step.
+struct Step {
+	float time, h;
+	float position[3];
+	float direction[3];
+	float spread, speed, lifetime;
+	//! Chance that a dead particle respawns in this step; 1 respawns them as soon as they die.
+	float spawnProbability;
+	//! Mixed into the respawn lottery of every particle; changes every step.
+	uint32_t seed;
+};
+
+//! Advances particles [begin, end), all of the emitter described by \a step, by one step.
+void step( const Soa &particles, size_t begin, size_t end, const Step &step );
+
+//! Writes particles [begin, end) as 32 byte records of position, start time, velocity and \a emitter,
+//! the interleaved layout of ParticleSystem. \a records points at the record of particle 0.
+void pack( const Soa &particles, size_t begin, size_t end, float emitter, float *records );
+
+//! Smooth value noise in [-1, 1], the same as valueNoise() in updateParticles.vert.
+float noise( float t );
+
+//! Name of the instruction set the kernels run on, for logging.
+const char* getInstructionSet();
+
+} // namespace particles
+
+#endif /* ParticleKernels_h */
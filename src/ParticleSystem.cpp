@@ -4,36 +4,80 @@
 //
 
 #include <stdio.h>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
 
 #include "cinder/app/App.h"
 #include "cinder/app/RendererGl.h"
 #include "cinder/gl/gl.h"
 
+#include "ParticleKernels.h"
 #include "ParticleSystem.h"
+#include "WorkerPool.h"
 
 using namespace ci;
 using namespace ci::app;
 using namespace std;
 
-const int nParticles			= 100;
 const int PositionIndex			= 0;
 const int VelocityIndex			= 1;
 const int StartTimeIndex		= 2;
 const int InitialVelocityIndex	= 3;
+const int EmitterIndex			= 4;
+
+// uniform buffer binding of the emitters, see updateParticles.vert
+const GLuint EmittersBinding	= 1;
+
+// Interleaved particle record, captured by transform feedback in one pass.
+// The emitter index fills the last float, which keeps the record at a
+// multiple of 16 bytes, aligned to the vertex fetch granularity.
+struct Particle {
+    vec3  position;
+    float startTime;
+    vec3  velocity;
+    float emitter;
+};
+static_assert( sizeof( Particle ) == 32, "Particle must be 32 bytes" );
+static_assert( sizeof( Emitter ) == 48, "Emitter must match the std140 layout in updateParticles.vert" );
 
-const float ParticleLifetime = 30.0f;
 const float MinParticleSize = 5.0f;
 const float MaxParticleSize = 30.0f;
 
+// Start time of a particle that waits to be spawned by the audio
+const float DormantStartTime = -1e6f;
+
+// Width of the sort textures; a row holds this many particles
+const int MaxSortWidth = 1024;
+
+// Particles per task of the CPU backend
+const size_t CpuGrain = 4096;
+
 float mix( float x, float y, float a )
 {
     return x * ( 1 - a ) + y * a;
 }
 
-void ParticleSystem::setup()
+ParticleSystem::~ParticleSystem()
+{
+    if( mLiveQueries[0] )
+        glDeleteQueries( 3, mLiveQueries );
+}
+
+void ParticleSystem::setup( int numParticles, Backend backend, WorkerPool *workers )
 {
     
-    Position0 = vec3( 10, -1, 0 );
+    mNumParticles = std::max( numParticles, 1 );
+    mBackend = backend;
+    mWorkers = workers;
+    if( mBackend == BACKEND_CPU ) {
+        mLayout = LAYOUT_INTERLEAVED;
+        console() << "Particles simulated on the CPU (" << particles::getInstructionSet() << ")" << std::endl;
+    }
+    if( mEmitters.empty() )
+        mEmitters.resize( 1 );
+    mEmittersUbo = gl::Ubo::create( sizeof( Emitter ) * Emitter::MaxEmitters, nullptr, GL_DYNAMIC_DRAW );
+    mEmittersUbo->bufferSubData( 0, mEmitters.size() * sizeof( Emitter ), mEmitters.data() );
     
     mDrawBuff = 1;
     
@@ -60,10 +104,21 @@ void ParticleSystem::loadShaders()
         // Transform Feedback data. For instance, Position, Velocity,
         // and StartTime are variables in the updateParticles.vert that we
         // write our calculations to.
-        std::vector<std::string> transformFeedbackVaryings( 3 );
-        transformFeedbackVaryings[PositionIndex] = "Position";
-        transformFeedbackVaryings[VelocityIndex] = "Velocity";
-        transformFeedbackVaryings[StartTimeIndex] = "StartTime";
+        std::vector<std::string> transformFeedbackVaryings;
+        GLenum feedbackFormat;
+        if( mLayout == LAYOUT_INTERLEAVED ) {
+            // The order of the varyings must match the Particle struct,
+            // because they are written back to back into one buffer.
+            transformFeedbackVaryings = { "Position", "StartTime", "Velocity", "Emitter" };
+            feedbackFormat = GL_INTERLEAVED_ATTRIBS;
+        }
+        else {
+            transformFeedbackVaryings.resize( 3 );
+            transformFeedbackVaryings[PositionIndex] = "Position";
+            transformFeedbackVaryings[VelocityIndex] = "Velocity";
+            transformFeedbackVaryings[StartTimeIndex] = "StartTime";
+            feedbackFormat = GL_SEPARATE_ATTRIBS;
+        }
         
         ci::gl::GlslProg::Format mUpdateParticleGlslFormat;
         // Notice that we don't offer a fragment shader. We don't need
@@ -71,15 +126,15 @@ void ParticleSystem::loadShaders()
         // the position, velocity, etc. data to the screen.
         mUpdateParticleGlslFormat.vertex( loadAsset( "updateParticles.vert" ) )
         // This option will be either GL_SEPARATE_ATTRIBS or GL_INTERLEAVED_ATTRIBS,
-        // depending on the structure of our data, below. We're using multiple
-        // buffers. Therefore, we're using GL_SEPERATE_ATTRIBS
-        .feedbackFormat( GL_SEPARATE_ATTRIBS )
+        // depending on the structure of our data, see loadBuffers().
+        .feedbackFormat( feedbackFormat )
         // Pass the feedbackVaryings to glsl
         .feedbackVaryings( transformFeedbackVaryings )
         .attribLocation( "VertexPosition",			PositionIndex )
         .attribLocation( "VertexVelocity",			VelocityIndex )
         .attribLocation( "VertexStartTime",			StartTimeIndex )
-        .attribLocation( "VertexInitialVelocity",	InitialVelocityIndex );
+        .attribLocation( "VertexInitialVelocity",	InitialVelocityIndex )
+        .attribLocation( "VertexEmitter",			EmitterIndex );
         
         mPUpdateGlsl = ci::gl::GlslProg::create( mUpdateParticleGlslFormat );
     }
@@ -87,10 +142,7 @@ void ParticleSystem::loadShaders()
         console() << "PARTICLE UPDATE GLSL ERROR: " << ex.what() << std::endl;
     }
     
-    mPUpdateGlsl->uniform( "H", 1.0f / 60.0f );
-    mPUpdateGlsl->uniform( "Accel", vec3( 0.0f ) );
-    mPUpdateGlsl->uniform( "ParticleLifetime", ParticleLifetime );
-    mPUpdateGlsl->uniform( "Position0", Position0 );
+    mPUpdateGlsl->uniformBlock( "Emitters", EmittersBinding );
     
     try {
         ci::gl::GlslProg::Format mRenderParticleGlslFormat;
@@ -98,7 +150,9 @@ void ParticleSystem::loadShaders()
         mRenderParticleGlslFormat.vertex( loadAsset( "renderParticles.vert" ) )
         .fragment( loadAsset( "renderParticles.frag" ) )
         .attribLocation("VertexPosition",			PositionIndex )
-        .attribLocation( "VertexStartTime",			StartTimeIndex );
+        .attribLocation( "VertexVelocity",			VelocityIndex )
+        .attribLocation( "VertexStartTime",			StartTimeIndex )
+        .attribLocation( "VertexEmitter",			EmitterIndex );
         
         mPRenderGlsl = ci::gl::GlslProg::create( mRenderParticleGlslFormat );
     }
@@ -109,47 +163,394 @@ void ParticleSystem::loadShaders()
     mPRenderGlsl->uniform( "ParticleTex", 0 );
     mPRenderGlsl->uniform( "MinParticleSize", MinParticleSize );
     mPRenderGlsl->uniform( "MaxParticleSize", MaxParticleSize );
-    mPRenderGlsl->uniform( "ParticleLifetime", ParticleLifetime );
+    mPRenderGlsl->uniformBlock( "Emitters", EmittersBinding );
+    
+    try {
+        // Keeps the live particles only. The output is always a 32 byte Particle record,
+        // whichever layout the state is in.
+        ci::gl::GlslProg::Format mCompactParticleGlslFormat;
+        mCompactParticleGlslFormat.vertex( loadAsset( "compactParticles.vert" ) )
+        .geometry( loadAsset( "compactParticles.geom" ) )
+        .feedbackFormat( GL_INTERLEAVED_ATTRIBS )
+        .feedbackVaryings( { "Position", "StartTime", "Velocity", "Emitter" } )
+        .attribLocation( "VertexPosition",			PositionIndex )
+        .attribLocation( "VertexVelocity",			VelocityIndex )
+        .attribLocation( "VertexStartTime",			StartTimeIndex )
+        .attribLocation( "VertexEmitter",			EmitterIndex );
+        
+        mPCompactGlsl = ci::gl::GlslProg::create( mCompactParticleGlslFormat );
+        mPCompactGlsl->uniformBlock( "Emitters", EmittersBinding );
+    }
+    catch( const ci::gl::GlslProgCompileExc &ex ) {
+        console() << "PARTICLE COMPACTION GLSL ERROR: " << ex.what() << std::endl;
+        mCompact = false;
+    }
+    
+    try {
+        mPKeysGlsl = ci::gl::GlslProg::create( loadAsset( "particleSort.vert" ), loadAsset( "particleKeys.frag" ) );
+        mPKeysGlsl->uniform( "uParticles", 0 );
+        mPKeysGlsl->uniformBlock( "Emitters", EmittersBinding );
+        
+        mPSortGlsl = ci::gl::GlslProg::create( loadAsset( "particleSort.vert" ), loadAsset( "particleSort.frag" ) );
+        mPSortGlsl->uniform( "uKeys", 0 );
+        
+        mPBillboardGlsl = ci::gl::GlslProg::create( loadAsset( "renderBillboards.vert" ), loadAsset( "renderBillboards.frag" ) );
+        mPBillboardGlsl->uniform( "uParticles", 0 );
+        mPBillboardGlsl->uniform( "uOrder", 1 );
+        mPBillboardGlsl->uniform( "ParticleTex", 2 );
+        mPBillboardGlsl->uniform( "MinParticleSize", MinParticleSize );
+        mPBillboardGlsl->uniform( "MaxParticleSize", MaxParticleSize );
+        mPBillboardGlsl->uniformBlock( "Emitters", EmittersBinding );
+    }
+    catch( const ci::gl::GlslProgCompileExc &ex ) {
+        console() << "PARTICLE BILLBOARD GLSL ERROR: " << ex.what() << std::endl;
+        mPKeysGlsl.reset();
+        mPSortGlsl.reset();
+        mPBillboardGlsl.reset();
+    }
+}
+
+void ParticleSystem::setLayout( Layout layout )
+{
+    if( layout == mLayout || mBackend == BACKEND_CPU )
+        return;
+    
+    // Transform feedback varyings are fixed at link time, so the update
+    // shader has to be rebuilt along with the buffers.
+    mLayout = layout;
+    loadShaders();
+    loadBuffers();
+}
+
+void ParticleSystem::setNumParticles( int numParticles )
+{
+    numParticles = std::max( numParticles, 1 );
+    if( numParticles == mNumParticles )
+        return;
+    
+    mNumParticles = numParticles;
+    loadBuffers();
+}
+
+void ParticleSystem::setEmitters( const std::vector<Emitter> &emitters )
+{
+    std::vector<int> counts = getEmitterCounts();
+    
+    mEmitters = emitters;
+    if( mEmitters.size() > size_t( Emitter::MaxEmitters ) )
+        mEmitters.resize( size_t( Emitter::MaxEmitters ) );
+    if( mEmitters.empty() )
+        mEmitters.resize( 1 );
+    
+    // everything but the share of particles is read straight from the uniform buffer
+    if( mEmittersUbo )
+        mEmittersUbo->bufferSubData( 0, mEmitters.size() * sizeof( Emitter ), mEmitters.data() );
+    if( mEmittersUbo && counts != getEmitterCounts() )
+        loadBuffers();
+}
+
+void ParticleSystem::setSpawning( Spawning spawning )
+{
+    if( spawning == mSpawning )
+        return;
+    
+    mSpawning = spawning;
+    loadBuffers();
+}
+
+void ParticleSystem::updateSpawnProbabilities( float time, float step )
+{
+    for( size_t e = 0; e < mEmitters.size(); e++ ) {
+        const Emitter &emitter = mEmitters[e];
+        std::deque<Births> &births = mBirths[e];
+        
+        // particles born more than a lifetime ago have died
+        while( ! births.empty() && births.front().time < time - emitter.lifetime ) {
+            mLiveCounts[e] -= births.front().count;
+            births.pop_front();
+        }
+        mLiveCounts[e] = std::max( mLiveCounts[e], 0.0f );
+        float dead = mEmitterCounts[e] - mLiveCounts[e];
+        
+        // the rate that would keep the emitter's whole share alive, scaled by the audio
+        float drive = mOnset;
+        if( emitter.band >= 0 && emitter.band < mBands.size() )
+            drive = mBands[int( emitter.band )] * emitter.bandGain;
+        float rate = std::min( 1.0f / std::max( emitter.spawnInterval, 0.001f ), mEmitterCounts[e] / emitter.lifetime );
+        float wanted = ( spawnIdle + spawnGain * std::max( drive, 0.0f ) ) * rate * step;
+        
+        float p = dead > 0.5f ? std::min( wanted / dead, 1.0f ) : 0.0f;
+        mSpawnProbabilities[e] = p;
+        
+        float born = p * dead;
+        if( born > 0 ) {
+            births.push_back( { time, born } );
+            mLiveCounts[e] += born;
+        }
+    }
+}
+
+void ParticleSystem::setBands( const float *levels, int count )
+{
+    mBands.assign( levels, levels + count );
+}
+
+std::vector<int> ParticleSystem::getEmitterCounts() const
+{
+    // each emitter needs lifetime / spawnInterval particles to keep its rate up
+    std::vector<double> weights( mEmitters.size() );
+    double total = 0;
+    for( size_t e = 0; e < mEmitters.size(); e++ ) {
+        weights[e] = mEmitters[e].lifetime / std::max( mEmitters[e].spawnInterval, 0.001f );
+        total += weights[e];
+    }
+    
+    std::vector<int> counts( mEmitters.size() );
+    double share = 0;
+    int assigned = 0;
+    for( size_t e = 0; e < mEmitters.size(); e++ ) {
+        share += weights[e] / total;
+        int end = int( share * mNumParticles + 0.5 );
+        counts[e] = end - assigned;
+        assigned = end;
+    }
+    if( ! counts.empty() )
+        counts.back() += mNumParticles - assigned;
+    return counts;
+}
+
+bool ParticleSystem::readParticles( std::vector<vec3> *positions, std::vector<vec3> *velocities, std::vector<float> *startTimes )
+{
+    if( mBackend == BACKEND_CPU ) {
+        if( mCpu.startTime.empty() )
+            return false;
+        size_t count = mCpu.startTime.size();
+        positions->resize( count );
+        velocities->resize( count );
+        for( size_t i = 0; i < count; i++ ) {
+            (*positions)[i] = vec3( mCpu.px[i], mCpu.py[i], mCpu.pz[i] );
+            (*velocities)[i] = vec3( mCpu.vx[i], mCpu.vy[i], mCpu.vz[i] );
+        }
+        *startTimes = mCpu.startTime;
+        return true;
+    }
+    
+    // The last step was captured into the buffers opposite mDrawBuff. This waits for the GPU,
+    // which is fine for a reallocation but not for every frame.
+    int current = 1 - mDrawBuff;
+    if( mPParticles[current] ) {
+        size_t count = mPParticles[current]->getSize() / sizeof(Particle);
+        const Particle *particles = static_cast<const Particle*>( mPParticles[current]->mapBufferRange( 0, count * sizeof(Particle), GL_MAP_READ_BIT ) );
+        if( ! particles )
+            return false;
+        positions->resize( count );
+        velocities->resize( count );
+        startTimes->resize( count );
+        for( size_t i = 0; i < count; i++ ) {
+            (*positions)[i] = particles[i].position;
+            (*velocities)[i] = particles[i].velocity;
+            (*startTimes)[i] = particles[i].startTime;
+        }
+        mPParticles[current]->unmap();
+        return true;
+    }
+    if( mPPositions[current] ) {
+        size_t count = mPStartTimes[current]->getSize() / sizeof(float);
+        positions->resize( count );
+        velocities->resize( count );
+        startTimes->resize( count );
+        const std::pair<gl::VboRef, void*> buffers[] = {
+            { mPPositions[current], positions->data() },
+            { mPVelocities[current], velocities->data() },
+            { mPStartTimes[current], startTimes->data() }
+        };
+        for( const auto &buffer : buffers ) {
+            const void *data = buffer.first->mapBufferRange( 0, buffer.first->getSize(), GL_MAP_READ_BIT );
+            if( ! data )
+                return false;
+            memcpy( buffer.second, data, buffer.first->getSize() );
+            buffer.first->unmap();
+        }
+        return true;
+    }
+    return false;
 }
 
 void ParticleSystem::loadBuffers()
 {
-    // Initialize positions
-    std::vector<vec3> positions( nParticles, Position0 );
+    // What the pool looked like before, so that particles can carry on across a reallocation
+    std::vector<vec3> oldPositions, oldVelocities;
+    std::vector<float> oldStartTimes;
+    bool carry = readParticles( &oldPositions, &oldVelocities, &oldStartTimes );
+    std::vector<size_t> oldRunStarts = mRunStarts;
+    mDrawBuff = 1;
     
-    // Create Position Vbo with the initial position data
-    mPPositions[0] = ci::gl::Vbo::create( GL_ARRAY_BUFFER, positions.size() * sizeof(vec3), positions.data(), GL_STATIC_DRAW );
-    // Create another Position Buffer that is null, for ping-ponging
-    mPPositions[1] = ci::gl::Vbo::create( GL_ARRAY_BUFFER, positions.size() * sizeof(vec3), nullptr, GL_STATIC_DRAW );
+    // A random direction in the unit sphere and a random speed for each particle.
+    // The emitter turns them into a velocity whenever the particle is (re)spawned.
+    std::vector<vec4> randoms( mNumParticles );
+    for( auto randomIt = randoms.begin(); randomIt != randoms.end(); ++randomIt ) {
+        *randomIt = vec4( ci::randVec3(), mix( 0.0f, 1.0f, mRand.nextFloat() ) );
+    }
     
-    // Reuse the positions vector that we've already made
-    std::vector<vec3> normals = std::move( positions );
+    // Create an initial velocity buffer, so that you can reset a particle's velocity after it's dead.
+    // It is never written by transform feedback, so both layouts keep it in its own buffer.
+    mPInitVelocity = ci::gl::Vbo::create( GL_ARRAY_BUFFER,	randoms.size() * sizeof(vec4), randoms.data(), GL_STATIC_DRAW );
     
-    for( auto normalIt = normals.begin(); normalIt != normals.end(); ++normalIt ) {
-        // Creating a random velocity for each particle in a unit sphere
-        *normalIt = (ci::randVec3()+vec3(-5,0.5,0)) * mix( 0.0f, 1.0f, mRand.nextFloat() );
+    // Particles are handed out to the emitters in consecutive runs. Each emitter keeps
+    // as many of its old particles as its new run holds, and those carry on where they
+    // were, even when the runs before it grew or shrank. New ones start at the
+    // emitter, their births staggered from now by the emitter's spawn interval;
+    // emitters with more particles than one lifetime needs spread them over a single
+    // lifetime instead, so that every particle has been born by the time the first
+    // one is recycled.
+    std::vector<vec3> positions( mNumParticles );
+    std::vector<vec3> velocities( mNumParticles );
+    std::vector<GLfloat> timeData( mNumParticles );
+    std::vector<GLfloat> emitterData( mNumParticles );
+    std::vector<int> counts = getEmitterCounts();
+    std::vector<std::vector<float>> keptBirths( counts.size() );
+    int i = 0;
+    for( size_t e = 0; e < counts.size(); e++ ) {
+        const Emitter &emitter = mEmitters[e];
+        float rate = std::min( emitter.spawnInterval, emitter.lifetime / std::max( counts[e], 1 ) );
+        float time = mTime;
+        size_t kept = 0;
+        if( carry && e + 1 < oldRunStarts.size() && oldRunStarts[e + 1] <= oldStartTimes.size() )
+            kept = oldRunStarts[e + 1] - oldRunStarts[e];
+        for( int n = 0; n < counts[e]; n++, i++ ) {
+            emitterData[i] = float( e );
+            // Staggered spawning would bring every dead particle back in the next step,
+            // and after audio spawning most of them are, so those are born anew instead.
+            bool carried = size_t( n ) < kept;
+            size_t old = carried ? oldRunStarts[e] + n : 0;
+            bool dead = carried && oldStartTimes[old] < mTime - emitter.lifetime;
+            if( carried && ! ( dead && mSpawning == SPAWN_STAGGERED ) ) {
+                positions[i] = oldPositions[old];
+                velocities[i] = oldVelocities[old];
+                timeData[i] = oldStartTimes[old];
+                if( ! dead )
+                    keptBirths[e].push_back( timeData[i] );
+                continue;
+            }
+            positions[i] = emitter.position;
+            velocities[i] = ( emitter.direction + emitter.spread * vec3( randoms[i] ) ) * randoms[i].w * emitter.speed;
+            // driven by the audio, new particles start out dead
+            timeData[i] = mSpawning == SPAWN_AUDIO ? DormantStartTime : time;
+            time += rate;
+        }
     }
     
-    // Create the Velocity Buffer using the newly buffered velocities
-    mPVelocities[0] = ci::gl::Vbo::create( GL_ARRAY_BUFFER, normals.size() * sizeof(vec3), normals.data(), GL_STATIC_DRAW );
-    // Create another Velocity Buffer that is null, for ping-ponging
-    mPVelocities[1] = ci::gl::Vbo::create( GL_ARRAY_BUFFER, normals.size() * sizeof(vec3), nullptr, GL_STATIC_DRAW );
-    // Create an initial velocity buffer, so that you can reset a particle's velocity after it's dead
-    mPInitVelocity = ci::gl::Vbo::create( GL_ARRAY_BUFFER,	normals.size() * sizeof(vec3), normals.data(), GL_STATIC_DRAW );
+    mEmitterCounts = counts;
+    mRunStarts.assign( 1, 0 );
+    for( int count : counts )
+        mRunStarts.push_back( mRunStarts.back() + count );
+    mBirths.assign( counts.size(), std::deque<Births>() );
+    mLiveCounts.assign( counts.size(), 0.0f );
+    // the particles that carried on alive count as births, or audio spawning would take them for dead
+    for( size_t e = 0; e < counts.size(); e++ ) {
+        std::sort( keptBirths[e].begin(), keptBirths[e].end() );
+        for( float time : keptBirths[e] ) {
+            if( mBirths[e].empty() || mBirths[e].back().time != time )
+                mBirths[e].push_back( { time, 0.0f } );
+            mBirths[e].back().count += 1.0f;
+        }
+        mLiveCounts[e] = float( keptBirths[e].size() );
+    }
+    mSpawnProbabilities.assign( counts.size(), 0.0f );
+    
+    if( mLayout == LAYOUT_INTERLEAVED )
+        loadInterleavedBuffers( positions, velocities, timeData, emitterData );
+    else
+        loadSeparateBuffers( positions, velocities, timeData, emitterData );
+    
+    if( mBackend == BACKEND_CPU ) {
+        mCpu.px.resize( mNumParticles );
+        mCpu.py.resize( mNumParticles );
+        mCpu.pz.resize( mNumParticles );
+        mCpu.rx.resize( mNumParticles );
+        mCpu.ry.resize( mNumParticles );
+        mCpu.rz.resize( mNumParticles );
+        mCpu.rw.resize( mNumParticles );
+        for( int i = 0; i < mNumParticles; i++ ) {
+            mCpu.px[i] = positions[i].x;
+            mCpu.py[i] = positions[i].y;
+            mCpu.pz[i] = positions[i].z;
+            mCpu.rx[i] = randoms[i].x;
+            mCpu.ry[i] = randoms[i].y;
+            mCpu.rz[i] = randoms[i].z;
+            mCpu.rw[i] = randoms[i].w;
+        }
+        mCpu.vx.resize( mNumParticles );
+        mCpu.vy.resize( mNumParticles );
+        mCpu.vz.resize( mNumParticles );
+        for( int i = 0; i < mNumParticles; i++ ) {
+            mCpu.vx[i] = velocities[i].x;
+            mCpu.vy[i] = velocities[i].y;
+            mCpu.vz[i] = velocities[i].z;
+        }
+        mCpu.startTime = timeData;
+    }
     
-    // Create time data for the initialization of the particles
-    array<GLfloat, nParticles> timeData;
-    float time = 0.0f;
-    float rate = 0.25f;
-    for( int i = 0; i < nParticles; i++ ) {
-        timeData[i] = time;
-        time += rate;
+    // Room for the whole pool, in case every particle is alive
+    mPLive = ci::gl::Vbo::create( GL_ARRAY_BUFFER, mNumParticles * sizeof(Particle), nullptr, GL_DYNAMIC_COPY );
+    mPLiveVao = ci::gl::Vao::create();
+    {
+        const GLsizei stride = sizeof(Particle);
+        gl::ScopedVao vao( mPLiveVao );
+        gl::ScopedBuffer buffer( mPLive );
+        ci::gl::vertexAttribPointer( PositionIndex, 3, GL_FLOAT, GL_FALSE, stride, (const GLvoid*)offsetof( Particle, position ) );
+        ci::gl::enableVertexAttribArray( PositionIndex );
+        ci::gl::vertexAttribPointer( StartTimeIndex, 1, GL_FLOAT, GL_FALSE, stride, (const GLvoid*)offsetof( Particle, startTime ) );
+        ci::gl::enableVertexAttribArray( StartTimeIndex );
+        ci::gl::vertexAttribPointer( VelocityIndex, 3, GL_FLOAT, GL_FALSE, stride, (const GLvoid*)offsetof( Particle, velocity ) );
+        ci::gl::enableVertexAttribArray( VelocityIndex );
+        ci::gl::vertexAttribPointer( EmitterIndex, 1, GL_FLOAT, GL_FALSE, stride, (const GLvoid*)offsetof( Particle, emitter ) );
+        ci::gl::enableVertexAttribArray( EmitterIndex );
     }
+    mPLiveFeedbackObj = gl::TransformFeedbackObj::create();
+    mPLiveFeedbackObj->bind();
+    gl::bindBufferBase( GL_TRANSFORM_FEEDBACK_BUFFER, 0, mPLive );
+    mPLiveFeedbackObj->unbind();
+    
+    // The bitonic sort works on a power of two of (depth, index) pairs, laid out in rows
+    mSortSize = 1;
+    while( mSortSize < mNumParticles )
+        mSortSize <<= 1;
+    int sortWidth = std::min( mSortSize, MaxSortWidth );
+    gl::Fbo::Format fmt;
+    fmt.enableDepthBuffer( false );
+    fmt.setColorTextureFormat( gl::Texture2d::Format().wrap( GL_CLAMP_TO_EDGE ).minFilter( GL_NEAREST ).magFilter( GL_NEAREST ).internalFormat( GL_RG32F ) );
+    for( int i = 0; i < 2; i++ )
+        mSortFbo[i] = gl::Fbo::create( sortWidth, mSortSize / sortWidth, fmt );
+    // the quad corners come from gl_VertexID, so the billboards need no attributes
+    mBillboardVao = ci::gl::Vao::create();
+}
+
+void ParticleSystem::loadSeparateBuffers( const std::vector<vec3> &positions, const std::vector<vec3> &velocities, const std::vector<float> &timeData, const std::vector<float> &emitterData )
+{
+    // Release the other layout's buffers
+    mPParticles[0].reset();
+    mPParticles[1].reset();
+    
+    // Create Position Vbo with the initial position data. Positions and velocities
+    // are rewritten by transform feedback every frame and never touched by the CPU,
+    // so hint the driver to keep them in GPU memory.
+    mPPositions[0] = ci::gl::Vbo::create( GL_ARRAY_BUFFER, positions.size() * sizeof(vec3), positions.data(), GL_DYNAMIC_COPY );
+    // Create another Position Buffer that is null, for ping-ponging
+    mPPositions[1] = ci::gl::Vbo::create( GL_ARRAY_BUFFER, positions.size() * sizeof(vec3), nullptr, GL_DYNAMIC_COPY );
+    
+    // Create the Velocity Buffer using the newly buffered velocities
+    mPVelocities[0] = ci::gl::Vbo::create( GL_ARRAY_BUFFER, velocities.size() * sizeof(vec3), velocities.data(), GL_DYNAMIC_COPY );
+    // Create another Velocity Buffer that is null, for ping-ponging
+    mPVelocities[1] = ci::gl::Vbo::create( GL_ARRAY_BUFFER, velocities.size() * sizeof(vec3), nullptr, GL_DYNAMIC_COPY );
     
     // Create the StartTime Buffer, so that we can reset the particle after it's dead
     mPStartTimes[0] = ci::gl::Vbo::create( GL_ARRAY_BUFFER, timeData.size() * sizeof( float ), timeData.data(), GL_DYNAMIC_COPY );
     // Create the StartTime ping-pong buffer
-    mPStartTimes[1] = ci::gl::Vbo::create( GL_ARRAY_BUFFER, nParticles * sizeof( float ), nullptr, GL_DYNAMIC_COPY );
+    mPStartTimes[1] = ci::gl::Vbo::create( GL_ARRAY_BUFFER, timeData.size() * sizeof( float ), nullptr, GL_DYNAMIC_COPY );
+    
+    // A particle never changes emitter, so its index is not captured and needs only one buffer
+    mPEmitters = ci::gl::Vbo::create( GL_ARRAY_BUFFER, emitterData.size() * sizeof( float ), emitterData.data(), GL_STATIC_DRAW );
     
     for( int i = 0; i < 2; i++ ) {
         // Initialize the Vao's holding the info for each buffer
@@ -170,9 +571,13 @@ void ParticleSystem::loadBuffers()
         ci::gl::enableVertexAttribArray( StartTimeIndex );
         
         mPInitVelocity->bind();
-        ci::gl::vertexAttribPointer( InitialVelocityIndex, 3, GL_FLOAT, GL_FALSE, 0, 0 );
+        ci::gl::vertexAttribPointer( InitialVelocityIndex, 4, GL_FLOAT, GL_FALSE, 0, 0 );
         ci::gl::enableVertexAttribArray( InitialVelocityIndex );
         
+        mPEmitters->bind();
+        ci::gl::vertexAttribPointer( EmitterIndex, 1, GL_FLOAT, GL_FALSE, 0, 0 );
+        ci::gl::enableVertexAttribArray( EmitterIndex );
+        
         // Create a TransformFeedbackObj, which is similar to Vao
         // It's used to capture the output of a glsl and uses the
         // index of the feedback's varying variable names.
@@ -188,11 +593,74 @@ void ParticleSystem::loadBuffers()
     }
 }
 
-void ParticleSystem::update()
+void ParticleSystem::loadInterleavedBuffers( const std::vector<vec3> &positions, const std::vector<vec3> &velocities, const std::vector<float> &timeData, const std::vector<float> &emitterData )
+{
+    // Release the other layout's buffers
+    for( int i = 0; i < 2; i++ ) {
+        mPPositions[i].reset();
+        mPVelocities[i].reset();
+        mPStartTimes[i].reset();
+    }
+    mPEmitters.reset();
+    mPParticlesTexture[0].reset();
+    mPParticlesTexture[1].reset();
+    
+    std::vector<Particle> particles( mNumParticles );
+    for( int i = 0; i < mNumParticles; i++ ) {
+        particles[i].position = positions[i];
+        particles[i].startTime = timeData[i];
+        particles[i].velocity = velocities[i];
+        particles[i].emitter = emitterData[i];
+    }
+    
+    // One buffer holds every per-particle attribute that transform feedback writes,
+    // so a particle is fetched with a single, aligned 32 byte read. The CPU backend
+    // rewrites the whole buffer every step instead.
+    GLenum usage = mBackend == BACKEND_CPU ? GL_STREAM_DRAW : GL_DYNAMIC_COPY;
+    mPParticles[0] = ci::gl::Vbo::create( GL_ARRAY_BUFFER, particles.size() * sizeof(Particle), particles.data(), usage );
+    mPParticles[1] = ci::gl::Vbo::create( GL_ARRAY_BUFFER, particles.size() * sizeof(Particle), nullptr, usage );
+    
+    const GLsizei stride = sizeof(Particle);
+    for( int i = 0; i < 2; i++ ) {
+        mPVao[i] = ci::gl::Vao::create();
+        
+        mPVao[i]->bind();
+        mPParticles[i]->bind();
+        ci::gl::vertexAttribPointer( PositionIndex, 3, GL_FLOAT, GL_FALSE, stride, (const GLvoid*)offsetof( Particle, position ) );
+        ci::gl::enableVertexAttribArray( PositionIndex );
+        ci::gl::vertexAttribPointer( StartTimeIndex, 1, GL_FLOAT, GL_FALSE, stride, (const GLvoid*)offsetof( Particle, startTime ) );
+        ci::gl::enableVertexAttribArray( StartTimeIndex );
+        ci::gl::vertexAttribPointer( VelocityIndex, 3, GL_FLOAT, GL_FALSE, stride, (const GLvoid*)offsetof( Particle, velocity ) );
+        ci::gl::enableVertexAttribArray( VelocityIndex );
+        ci::gl::vertexAttribPointer( EmitterIndex, 1, GL_FLOAT, GL_FALSE, stride, (const GLvoid*)offsetof( Particle, emitter ) );
+        ci::gl::enableVertexAttribArray( EmitterIndex );
+        
+        mPInitVelocity->bind();
+        ci::gl::vertexAttribPointer( InitialVelocityIndex, 4, GL_FLOAT, GL_FALSE, 0, 0 );
+        ci::gl::enableVertexAttribArray( InitialVelocityIndex );
+        
+        // With GL_INTERLEAVED_ATTRIBS all varyings are captured into binding 0
+        mPFeedbackObj[i] = gl::TransformFeedbackObj::create();
+        mPFeedbackObj[i]->bind();
+        gl::bindBufferBase( GL_TRANSFORM_FEEDBACK_BUFFER, 0, mPParticles[i] );
+        mPFeedbackObj[i]->unbind();
+        
+        // The billboards fetch particles by index: each record reads as two RGBA32F texels,
+        // (position, startTime) and (velocity, emitter)
+        mPParticlesTexture[i] = gl::BufferTexture::create( mPParticles[i], GL_RGBA32F );
+    }
+}
+
+void ParticleSystem::update( float time, float step )
 {
     // This equation just reliably swaps all concerned buffers
     mDrawBuff = 1 - mDrawBuff;
     
+    if( mBackend == BACKEND_CPU ) {
+        updateCpu( time, step );
+        return;
+    }
+    
     gl::ScopedGlslProg	glslScope( mPUpdateGlsl );
     // We use this vao for input to the Glsl, while using the opposite
     // for the TransformFeedbackObj.
@@ -202,7 +670,19 @@ void ParticleSystem::update()
     // move to the rasterization stage.
     gl::ScopedState		stateScope( GL_RASTERIZER_DISCARD, true );
     
-    mPUpdateGlsl->uniform( "Time", getElapsedFrames() / 60.0f );
+    mPUpdateGlsl->uniform( "Time", time );
+    mPUpdateGlsl->uniform( "H", step );
+    mTime = time;
+    
+    // every emitter is updated in this one pass, each particle reading its own entry
+    mEmittersUbo->bindBufferBase( EmittersBinding );
+    
+    mPUpdateGlsl->uniform( "AudioSpawning", mSpawning == SPAWN_AUDIO );
+    if( mSpawning == SPAWN_AUDIO ) {
+        updateSpawnProbabilities( time, step );
+        mPUpdateGlsl->uniform( "SpawnProbability", mSpawnProbabilities.data(), int( mSpawnProbabilities.size() ) );
+        mPUpdateGlsl->uniform( "Step", mStep++ );
+    }
     
     // Opposite TransformFeedbackObj to catch the calculated values
     // In the opposite buffer
@@ -211,16 +691,230 @@ void ParticleSystem::update()
     // We begin Transform Feedback, using the same primitive that
     // we're "drawing". Using points for the particle system.
     gl::beginTransformFeedback( GL_POINTS );
-    gl::drawArrays( GL_POINTS, 0, nParticles );
+    gl::drawArrays( GL_POINTS, 0, mNumParticles );
     gl::endTransformFeedback();
 }
 
-void ParticleSystem::draw(float Volume)
+void ParticleSystem::updateCpu( float time, float step )
+{
+    mTime = time;
+    if( mSpawning == SPAWN_AUDIO )
+        updateSpawnProbabilities( time, step );
+    
+    std::vector<particles::Step> steps( mEmitters.size() );
+    for( size_t e = 0; e < mEmitters.size(); e++ ) {
+        const Emitter &emitter = mEmitters[e];
+        particles::Step &s = steps[e];
+        s.time = time;
+        s.h = step;
+        s.position[0] = emitter.position.x;
+        s.position[1] = emitter.position.y;
+        s.position[2] = emitter.position.z;
+        s.direction[0] = emitter.direction.x;
+        s.direction[1] = emitter.direction.y;
+        s.direction[2] = emitter.direction.z;
+        s.spread = emitter.spread;
+        s.speed = emitter.speed;
+        s.lifetime = emitter.lifetime;
+        s.spawnProbability = mSpawning == SPAWN_AUDIO ? mSpawnProbabilities[e] : 1.0f;
+        s.seed = uint32_t( mStep ) * 2654435769u;
+    }
+    mStep++;
+    
+    particles::Soa soa = {
+        mCpu.px.data(), mCpu.py.data(), mCpu.pz.data(),
+        mCpu.vx.data(), mCpu.vy.data(), mCpu.vz.data(),
+        mCpu.startTime.data(),
+        mCpu.rx.data(), mCpu.ry.data(), mCpu.rz.data(), mCpu.rw.data()
+    };
+    
+    // Buffer storage (GL 4.4) is not available for a persistent mapping, so the buffer that
+    // is not being drawn is mapped with its old contents invalidated. The driver hands out
+    // fresh memory instead of waiting for the GPU, and every task writes its own records.
+    gl::VboRef buffer = mPParticles[1-mDrawBuff];
+    float *records = static_cast<float*>( buffer->mapBufferRange( 0, mNumParticles * sizeof(Particle), GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT ) );
+    if( ! records ) {
+        console() << "Could not map the particle buffer" << std::endl;
+        return;
+    }
+    
+    auto stepRange = [&]( size_t begin, size_t end ) {
+        // the kernels take one emitter at a time, and a range may span several
+        size_t e = std::upper_bound( mRunStarts.begin(), mRunStarts.end(), begin ) - mRunStarts.begin() - 1;
+        while( begin < end ) {
+            size_t runEnd = std::min( end, mRunStarts[e + 1] );
+            particles::step( soa, begin, runEnd, steps[e] );
+            particles::pack( soa, begin, runEnd, float( e ), records );
+            begin = runEnd;
+            e++;
+        }
+    };
+    if( mWorkers )
+        mWorkers->parallelFor( mNumParticles, CpuGrain, stepRange );
+    else
+        stepRange( 0, mNumParticles );
+    
+    buffer->unmap();
+}
+
+void ParticleSystem::compact( float time )
+{
+    gl::ScopedGlslProg	glslScope( mPCompactGlsl );
+    gl::ScopedVao		vaoScope( mPVao[1-mDrawBuff] );
+    gl::ScopedState		stateScope( GL_RASTERIZER_DISCARD, true );
+    
+    mPCompactGlsl->uniform( "Time", time );
+    mEmittersUbo->bindBufferBase( EmittersBinding );
+    
+    // The live count is only for display, so it is read a few frames late rather than stalling
+    if( ! mLiveQueries[0] )
+        glGenQueries( 3, mLiveQueries );
+    mLiveQuery = ( mLiveQuery + 1 ) % 3;
+    GLuint query = mLiveQueries[mLiveQuery];
+    // a query that has never been begun has no result to ask for
+    GLint available = 0;
+    if( mLiveQueryIssued[mLiveQuery] )
+        glGetQueryObjectiv( query, GL_QUERY_RESULT_AVAILABLE, &available );
+    if( available ) {
+        GLuint written = 0;
+        glGetQueryObjectuiv( query, GL_QUERY_RESULT, &written );
+        mLiveCount = int( written );
+    }
+    
+    mPLiveFeedbackObj->bind();
+    glBeginQuery( GL_TRANSFORM_FEEDBACK_PRIMITIVES_WRITTEN, query );
+    gl::beginTransformFeedback( GL_POINTS );
+    gl::drawArrays( GL_POINTS, 0, mNumParticles );
+    gl::endTransformFeedback();
+    glEndQuery( GL_TRANSFORM_FEEDBACK_PRIMITIVES_WRITTEN );
+    mLiveQueryIssued[mLiveQuery] = true;
+    mPLiveFeedbackObj->unbind();
+}
+
+void ParticleSystem::sortParticles( float time )
+{
+    const ivec2 size = mSortFbo[0]->getSize();
+    gl::ScopedViewport	viewportScope( ivec2( 0 ), size );
+    gl::ScopedBlend		blendScope( false );
+    gl::pushMatrices();
+    gl::setMatricesWindow( size );
+    
+    // one (depth, index) pair per particle
+    {
+        gl::ScopedFramebuffer	fboScope( mSortFbo[0] );
+        gl::ScopedGlslProg		glslScope( mPKeysGlsl );
+        gl::ScopedTextureBind	particlesScope( GL_TEXTURE_BUFFER, mPParticlesTexture[1-mDrawBuff]->getId(), 0 );
+        mEmittersUbo->bindBufferBase( EmittersBinding );
+        mPKeysGlsl->uniform( "uNumParticles", mNumParticles );
+        mPKeysGlsl->uniform( "uWidth", size.x );
+        mPKeysGlsl->uniform( "uView", mCam.getViewMatrix() );
+        mPKeysGlsl->uniform( "Time", time );
+        mPKeysGlsl->uniform( "Extrapolation", std::max( time - mTime, 0.0f ) );
+        gl::drawSolidRect( mSortFbo[0]->getBounds() );
+    }
+    mSorted = 0;
+    
+    // log2(n) merge stages, the k-th of which takes k compare-exchange passes:
+    // 153 passes of a quarter million texel fetches for 100000 particles
+    gl::ScopedGlslProg glslScope( mPSortGlsl );
+    mPSortGlsl->uniform( "uWidth", size.x );
+    for( int block = 2; block <= mSortSize; block <<= 1 ) {
+        for( int distance = block >> 1; distance > 0; distance >>= 1 ) {
+            gl::ScopedFramebuffer	fboScope( mSortFbo[1-mSorted] );
+            gl::ScopedTextureBind	keysScope( mSortFbo[mSorted]->getColorTexture(), 0 );
+            mPSortGlsl->uniform( "uBlock", block );
+            mPSortGlsl->uniform( "uDistance", distance );
+            gl::drawSolidRect( mSortFbo[0]->getBounds() );
+            mSorted = 1 - mSorted;
+        }
+    }
+    
+    gl::popMatrices();
+}
+
+void ParticleSystem::renderBillboards( float volume, float time, const ivec2 &viewportSize )
+{
+    gl::ScopedVao			vaoScope( mBillboardVao );
+    gl::ScopedGlslProg		glslScope( mPBillboardGlsl );
+    gl::ScopedTextureBind	particlesScope( GL_TEXTURE_BUFFER, mPParticlesTexture[1-mDrawBuff]->getId(), 0 );
+    gl::ScopedTextureBind	orderScope( mSortFbo[mSorted]->getColorTexture(), 1 );
+    gl::ScopedTextureBind	texScope( mParticlesTexture, 2 );
+    // premultiplied and back to front, which composites correctly over anything
+    gl::ScopedBlend			blendScope( GL_ONE, GL_ONE_MINUS_SRC_ALPHA );
+    
+    gl::pushMatrices();
+    gl::setMatrices( mCam );
+    
+    mPBillboardGlsl->uniform( "uOrderWidth", mSortFbo[mSorted]->getWidth() );
+    mPBillboardGlsl->uniform( "uViewportSize", vec2( viewportSize ) );
+    mPBillboardGlsl->uniform( "Time", time );
+    mPBillboardGlsl->uniform( "Extrapolation", std::max( time - mTime, 0.0f ) );
+    mPBillboardGlsl->uniform( "Volume", volume );
+    if( ! mBands.empty() )
+        mPBillboardGlsl->uniform( "Bands", mBands.data(), std::min( int( mBands.size() ), 32 ) );
+    mEmittersUbo->bindBufferBase( EmittersBinding );
+    mPBillboardGlsl->uniform( "r1", r1 );
+    mPBillboardGlsl->uniform( "r2", r2 );
+    mPBillboardGlsl->uniform( "g1", g1 );
+    mPBillboardGlsl->uniform( "g2", g2 );
+    mPBillboardGlsl->uniform( "b1", b1 );
+    mPBillboardGlsl->uniform( "b2", b2 );
+    
+    gl::setDefaultShaderVars();
+    gl::drawArraysInstanced( GL_TRIANGLE_STRIP, 0, 4, mNumParticles );
+    
+    gl::popMatrices();
+}
+
+void ParticleSystem::drawBillboards( float volume, float time )
+{
+    sortParticles( time );
+    
+    // sizes are in pixels of the frame, also when drawn at half resolution
+    const ivec2 viewportSize = gl::getViewport().second;
+    if( ! mHalfResolution ) {
+        renderBillboards( volume, time, viewportSize );
+        return;
+    }
+    
+    ivec2 size = glm::max( viewportSize / 2, ivec2( 1 ) );
+    if( ! mHalfResFbo || mHalfResFbo->getSize() != size ) {
+        gl::Fbo::Format fmt;
+        fmt.enableDepthBuffer( false );
+        fmt.setColorTextureFormat( gl::Texture2d::Format().wrap( GL_CLAMP_TO_EDGE ).minFilter( GL_LINEAR ).magFilter( GL_LINEAR ).internalFormat( GL_RGBA8 ) );
+        mHalfResFbo = gl::Fbo::create( size.x, size.y, fmt );
+    }
+    {
+        gl::ScopedFramebuffer	fboScope( mHalfResFbo );
+        gl::ScopedViewport		viewportScope( ivec2( 0 ), size );
+        gl::clear( ColorA( 0, 0, 0, 0 ) );
+        renderBillboards( volume, time, viewportSize );
+    }
+    
+    // upsampled and composited, still premultiplied
+    gl::ScopedBlend		blendScope( GL_ONE, GL_ONE_MINUS_SRC_ALPHA );
+    gl::ScopedColor		colorScope( ColorA::white() );
+    gl::pushMatrices();
+    gl::setMatricesWindow( viewportSize );
+    gl::draw( mHalfResFbo->getColorTexture(), Rectf( vec2( 0 ), vec2( viewportSize ) ) );
+    gl::popMatrices();
+}
+
+void ParticleSystem::draw( float Volume, float time )
 {
     static float rotateRadians = 0.0f;
     rotateRadians += 0.01f;
     
-    gl::ScopedVao			vaoScope( mPVao[1-mDrawBuff] );
+    // the billboards read the particle records directly, which only the interleaved layout has
+    if( mRendering == RENDER_BILLBOARDS && mLayout == LAYOUT_INTERLEAVED && mPBillboardGlsl ) {
+        drawBillboards( Volume, time );
+        return;
+    }
+    
+    if( mCompact )
+        compact( time );
+    
+    gl::ScopedVao			vaoScope( mCompact ? mPLiveVao : mPVao[1-mDrawBuff] );
     gl::ScopedGlslProg		glslScope( mPRenderGlsl );
     gl::ScopedTextureBind	texScope( mParticlesTexture );
     gl::ScopedState			stateScope( GL_PROGRAM_POINT_SIZE, true );
@@ -229,9 +923,15 @@ void ParticleSystem::draw(float Volume)
     gl::pushMatrices();
     gl::setMatrices( mCam );
     
-    mPRenderGlsl->uniform( "Time", getElapsedFrames() / 60.0f );
+    mPRenderGlsl->uniform( "Time", time );
+    // The buffers hold the state at the last simulation step. Extrapolate
+    // along the velocity so that motion stays smooth between steps.
+    mPRenderGlsl->uniform( "Extrapolation", std::max( time - mTime, 0.0f ) );
     
     mPRenderGlsl->uniform( "Volume", Volume );
+    if( ! mBands.empty() )
+        mPRenderGlsl->uniform( "Bands", mBands.data(), std::min( int( mBands.size() ), 32 ) );
+    mEmittersUbo->bindBufferBase( EmittersBinding );
     mPRenderGlsl->uniform( "r1", r1 );
     mPRenderGlsl->uniform( "r2", r2 );
     mPRenderGlsl->uniform( "g1", g1 );
@@ -240,7 +940,13 @@ void ParticleSystem::draw(float Volume)
     mPRenderGlsl->uniform( "b2", b2 );
     
     gl::setDefaultShaderVars();
-    gl::drawArrays( GL_POINTS, 0, nParticles );
+    if( mCompact ) {
+        // the vertex count is whatever the compaction pass wrote, it never comes back to the CPU
+        glDrawTransformFeedback( GL_POINTS, mPLiveFeedbackObj->getId() );
+    }
+    else {
+        gl::drawArrays( GL_POINTS, 0, mNumParticles );
+    }
     
     gl::popMatrices();
 }
\ No newline at end of file
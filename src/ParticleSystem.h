@@ -7,34 +7,207 @@
 #define ParticleSystem_h
 
 #include "cinder/Rand.h"
+#include "cinder/gl/BufferTexture.h"
+#include "cinder/gl/Ubo.h"
+
+#include <deque>
+
+class WorkerPool;
+
+//! A source of embers, laid out like the std140 Emitter struct in updateParticles.vert.
+struct Emitter {
+    cinder::vec3    position = cinder::vec3( 10, -1, 0 );
+    //! Seconds a particle lives before it is respawned.
+    float           lifetime = 30.0f;
+    //! Particles leave along direction + spread * (random unit vector), scaled by a random fraction of speed.
+    cinder::vec3    direction = cinder::vec3( -5, 0.5, 0 );
+    float           spread = 1.0f;
+    //! Seconds between two births, when the emitter has enough particles for it.
+    float           spawnInterval = 0.25f;
+    //! Spectrum band that swells the embers, or -1 to follow the overall volume.
+    float           band = -1;
+    float           bandGain = 1.0f;
+    float           speed = 1.0f;
+
+    //! Matches MAX_EMITTERS in the particle shaders.
+    static const int MaxEmitters = 256;
+};
 
 class ParticleSystem{
     
 public:
-    void setup();
-    void update();
-    void draw(float volume);
+    //! How per-particle attributes are laid out in GPU memory.
+    enum Layout {
+        //! One buffer per attribute, captured with GL_SEPARATE_ATTRIBS.
+        LAYOUT_SEPARATE,
+        //! One 32 byte record per particle, captured with GL_INTERLEAVED_ATTRIBS.
+        LAYOUT_INTERLEAVED
+    };
+    
+    //! How particles are drawn.
+    enum Rendering {
+        //! Unsorted point sprites; their size is capped by the driver.
+        RENDER_POINTS,
+        //! Instanced quads, sorted back to front on the GPU. Needs LAYOUT_INTERLEAVED, otherwise points are drawn.
+        RENDER_BILLBOARDS
+    };
+    
+    //! Where the simulation runs. Chosen once, in setup().
+    enum Backend {
+        //! Transform feedback through updateParticles.vert.
+        BACKEND_GPU,
+        //! Vectorized kernels on the worker threads, see ParticleKernels.h. Uploads every step,
+        //! so it only pays off where the GPU path is slow, such as with software GL.
+        BACKEND_CPU
+    };
+    
+    //! What brings dead particles back.
+    enum Spawning {
+        //! Each particle respawns as soon as its lifetime is over; births are staggered at startup.
+        SPAWN_STAGGERED,
+        //! Dead particles wait, and the audio decides how many respawn each step.
+        SPAWN_AUDIO
+    };
+    
+    ~ParticleSystem();
+    
+    //! The CPU backend splits its work over \a workers, or runs on the calling thread without them.
+    void setup( int numParticles = 100, Backend backend = BACKEND_GPU, WorkerPool *workers = nullptr );
+    Backend getBackend() const { return mBackend; }
+    //! Advances the simulation by one fixed \a step to \a time, both in seconds.
+    void update( float time, float step );
+    //! Draws the particles at \a time, which may fall between two simulation steps.
+    void draw( float volume, float time );
     
     void loadBuffers();
     void loadShaders();
     void loadTexture();
     
+    //! Resizes the particle pool, reallocating all GPU buffers. Each emitter's particles carry on as far as
+    //! its new share holds them; new ones are born over the next lifetime.
+    void setNumParticles( int numParticles );
+    int  getNumParticles() const { return mNumParticles; }
+    
+    //! Switches the buffer layout, reallocating all GPU buffers and relinking the update shader.
+    //! The CPU backend always uses LAYOUT_INTERLEAVED.
+    void   setLayout( Layout layout );
+    Layout getLayout() const { return mLayout; }
+    
+    //! Replaces the emitters, at most Emitter::MaxEmitters. Particles are shared out in proportion to
+    //! lifetime / spawnInterval. When that share changes, only the particles an emitter gains or loses are
+    //! reassigned; the others carry on.
+    void setEmitters( const std::vector<Emitter> &emitters );
+    const std::vector<Emitter>& getEmitters() const { return mEmitters; }
+    
+    //! Band levels for emitters bound to a band, see AudioFeatures::bands.
+    void setBands( const float *levels, int count );
+    //! Onset strength that drives the emitters not bound to a band, see AudioFeatures::onset.
+    void setOnset( float onset ) { mOnset = onset; }
+    
+    //! Draws only the live particles, compacted into a separate buffer each frame by a geometry shader pass.
+    void setCompaction( bool compact ) { mCompact = compact && mPCompactGlsl; }
+    bool getCompaction() const { return mCompact; }
+    //! Live particles in the last compacted frame whose count has reached the CPU, or -1 if not known yet.
+    int  getLiveCount() const { return mLiveCount; }
+    
+    void      setRendering( Rendering rendering ) { mRendering = rendering; }
+    Rendering getRendering() const { return mRendering; }
+    //! Draws the billboards into a buffer of half the viewport's size, composited over the frame.
+    //! Caps the fill cost of large embers at a quarter.
+    void setHalfResolution( bool halfResolution ) { mHalfResolution = halfResolution; }
+    bool getHalfResolution() const { return mHalfResolution; }
+    
+    //! Switches between staggered and audio driven spawning. Live particles carry on; when switching to
+    //! staggered spawning, the dead ones are born over the next lifetime.
+    void     setSpawning( Spawning spawning );
+    Spawning getSpawning() const { return mSpawning; }
+    
+    //! Audio driven spawn rate, as a fraction of the rate that keeps an emitter's share of the pool alive:
+    //! spawnIdle + spawnGain * (band level, or onset).
+    float spawnIdle = 0.1f, spawnGain = 4.0f;
+    
     float r1 = 0.2, r2 = 0.3, g1 = 0.1, g2 = 0.2, b1 = 0.05, b2 = 0.1, a1 = 0.0, a2 = 1.0;
 
 private:
+    //! Copies out the pool as of the last step, for loadBuffers() to carry over. Returns false before there is one.
+    bool readParticles( std::vector<cinder::vec3> *positions, std::vector<cinder::vec3> *velocities, std::vector<float> *startTimes );
+    void loadSeparateBuffers( const std::vector<cinder::vec3> &positions, const std::vector<cinder::vec3> &velocities, const std::vector<float> &timeData, const std::vector<float> &emitterData );
+    void loadInterleavedBuffers( const std::vector<cinder::vec3> &positions, const std::vector<cinder::vec3> &velocities, const std::vector<float> &timeData, const std::vector<float> &emitterData );
+    //! Number of particles each emitter gets.
+    std::vector<int> getEmitterCounts() const;
+    //! Steps the particles on the CPU and uploads them into mPParticles[1-mDrawBuff].
+    void updateCpu( float time, float step );
+    //! Writes the particles alive at \a time into mPLive.
+    void compact( float time );
+    //! Orders the particles far to near at \a time, into mSortFbo[mSorted].
+    void sortParticles( float time );
+    void drawBillboards( float volume, float time );
+    void renderBillboards( float volume, float time, const cinder::ivec2 &viewportSize );
+    //! Works out the chance that a dead particle of each emitter respawns in this step.
+    void updateSpawnProbabilities( float time, float step );
+    
     cinder::gl::VaoRef						mPVao[2];
     cinder::gl::TransformFeedbackObjRef		mPFeedbackObj[2];
-    cinder::gl::VboRef						mPPositions[2], mPVelocities[2], mPStartTimes[2], mPInitPosition, mPInitVelocity;
+    cinder::gl::VboRef						mPPositions[2], mPVelocities[2], mPStartTimes[2], mPInitPosition, mPInitVelocity, mPEmitters;
+    cinder::gl::VboRef						mPParticles[2];
+    
+    // live particles of the current frame, see compact()
+    cinder::gl::VboRef						mPLive;
+    cinder::gl::VaoRef						mPLiveVao;
+    cinder::gl::TransformFeedbackObjRef		mPLiveFeedbackObj;
+    bool                                    mCompact = true;
+    GLuint                                  mLiveQueries[3] = { 0, 0, 0 };
+    bool                                    mLiveQueryIssued[3] = { false, false, false };
+    int                                     mLiveQuery = 0;
+    int                                     mLiveCount = -1;
+    
+    // depth sorted billboards, see sortParticles()
+    Rendering                               mRendering = RENDER_POINTS;
+    bool                                    mHalfResolution = false;
+    cinder::gl::BufferTextureRef			mPParticlesTexture[2];
+    cinder::gl::FboRef						mSortFbo[2];
+    int                                     mSortSize = 0;
+    int                                     mSorted = 0;
+    cinder::gl::VaoRef						mBillboardVao;
+    cinder::gl::FboRef						mHalfResFbo;
     
-    cinder::gl::GlslProgRef					mPUpdateGlsl, mPRenderGlsl;
+    cinder::gl::GlslProgRef					mPUpdateGlsl, mPRenderGlsl, mPCompactGlsl;
+    cinder::gl::GlslProgRef					mPKeysGlsl, mPSortGlsl, mPBillboardGlsl;
     cinder::gl::TextureRef					mParticlesTexture;
     
     cinder::Rand							mRand;
     cinder::CameraPersp						mCam;
     cinder::TriMeshRef						mTrimesh;
     uint32_t                                mDrawBuff;
+    int                                     mNumParticles = 0;
+    float                                   mTime = 0;
+    Layout                                  mLayout = LAYOUT_INTERLEAVED;
+    
+    std::vector<Emitter>                    mEmitters;
+    cinder::gl::UboRef                      mEmittersUbo;
+    std::vector<float>                      mBands;
+    float                                   mOnset = 0;
+    
+    // Audio driven spawning. There is no readback of the pool: the number of live particles
+    // per emitter is tracked from the expected births of the last lifetime.
+    struct Births {
+        float time, count;
+    };
+    Spawning                                mSpawning = SPAWN_STAGGERED;
+    std::vector<int>                        mEmitterCounts;
+    std::vector<std::deque<Births>>         mBirths;
+    std::vector<float>                      mLiveCounts;
+    std::vector<float>                      mSpawnProbabilities;
+    int                                     mStep = 0;
     
-    cinder::vec3 Position0;
+    // CPU backend: the particle state, one array per attribute, and the first particle of each emitter
+    Backend                                 mBackend = BACKEND_GPU;
+    WorkerPool                              *mWorkers = nullptr;
+    struct CpuParticles {
+        std::vector<float>  px, py, pz, vx, vy, vz, startTime, rx, ry, rz, rw;
+    };
+    CpuParticles                            mCpu;
+    std::vector<size_t>                     mRunStarts;
 
 };
 
@@ -0,0 +1,385 @@
+//
+//  PlumeMesh.cpp
+//  MusicalSmoke
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <limits>
+
+#include "cinder/gl/scoped.h"
+
+#include "PlumeMesh.h"
+
+using namespace ci;
+using namespace std;
+
+namespace {
+
+// the largest index of a 16 bit buffer is kept free as the restart index
+const int Max16BitVertices = 0xFFFF;
+
+// tiles stay this deep when the grid is, so that they are wide enough to be worth a draw call
+const int MaxTileDepth = 256;
+
+// columns handed to a worker at a time
+const size_t ColumnsPerChunk = 16;
+
+//! One interleaved vertex, as laid out in the vertex buffer.
+struct Vertex {
+    vec3 position;
+    vec3 normal;
+    vec2 texCoord;
+};
+
+//! Indices of columns \a x0 to \a x1 of a \a width by \a depth grid stored column by column.
+template<typename T>
+void writeIndices( T *indices, int depth, bool strips, int x0, int x1 )
+{
+    if( strips ) {
+        // one strip per column of quads, zig-zagging between the columns on either side
+        const T restart = numeric_limits<T>::max();
+        T *out = indices + x0 * ( 2 * depth + 1 );
+        for( int x = x0; x < x1; ++x ) {
+            for( int z = 0; z < depth; ++z ) {
+                T i = T( x * depth + z );
+                *out++ = i;
+                *out++ = T( i + depth );
+            }
+            *out++ = restart;
+        }
+        return;
+    }
+
+    T *out = indices + x0 * 6 * ( depth - 1 );
+    for( int x = x0; x < x1; ++x ) {
+        for( int z = 0; z < depth - 1; ++z ) {
+            T i = T( x * depth + z );
+
+            *out++ = i;
+            *out++ = T( i + 1 );
+            *out++ = T( i + depth );
+            *out++ = T( i + depth );
+            *out++ = T( i + 1 );
+            *out++ = T( i + depth + 1 );
+        }
+    }
+}
+
+static_assert( sizeof( PlumeInstance ) == 96, "PlumeInstance must match the std140 layout of Plume in mesh.vert" );
+
+} // anonymous namespace
+
+//! Vertex and index data of every tile, in the layout of the GL buffers.
+struct PlumeMesh::Staging {
+    Format                          format;
+    std::vector<TileRange>          tiles;
+    std::vector<std::vector<char>>  vertices, indices;
+    double                          buildMs = 0;
+};
+
+bool PlumeMesh::Format::operator==( const Format &other ) const
+{
+    return resX == other.resX && resZ == other.resZ && size == other.size && strips == other.strips
+        && tiled == other.tiled;
+}
+
+size_t PlumeMesh::TileRange::getVertexBytes() const
+{
+    return numVertices * sizeof( Vertex );
+}
+
+size_t PlumeMesh::TileRange::getIndexBytes() const
+{
+    return numIndices * ( use16Bit ? sizeof( uint16_t ) : sizeof( uint32_t ) );
+}
+
+vector<PlumeMesh::TileRange> PlumeMesh::layoutTiles( const Format &format )
+{
+    int tileDepth = format.resZ;
+    int tileWidth = format.resX;
+    if( format.tiled ) {
+        tileDepth = std::min( format.resZ, MaxTileDepth );
+        tileWidth = std::max( 2, Max16BitVertices / tileDepth );
+    }
+
+    // neighbouring tiles share their edge vertices, so the seams close
+    vector<TileRange> tiles;
+    for( int x0 = 0; x0 < format.resX - 1; x0 += tileWidth - 1 ) {
+        for( int z0 = 0; z0 < format.resZ - 1; z0 += tileDepth - 1 ) {
+            TileRange range;
+            range.x0 = x0;
+            range.z0 = z0;
+            range.width = std::min( tileWidth, format.resX - x0 );
+            range.depth = std::min( tileDepth, format.resZ - z0 );
+            range.numVertices = range.width * range.depth;
+            range.numIndices = format.strips ? ( range.width - 1 ) * ( 2 * range.depth + 1 )
+                                             : 6 * ( range.width - 1 ) * ( range.depth - 1 );
+            range.use16Bit = range.numVertices <= Max16BitVertices;
+            tiles.push_back( range );
+        }
+    }
+    return tiles;
+}
+
+void PlumeMesh::fillColumns( const Format &format, const TileRange &range, void *vertices, void *indices, size_t begin, size_t end )
+{
+	const int x0 = range.x0, z0 = range.z0, depth = range.depth;
+	for( int x = int( begin ); x < int( end ); ++x ) {
+		Vertex *out = (Vertex*)vertices + x * depth;
+		float u = float( x0 + x ) / format.resX;
+		for( int z = z0; z < z0 + depth; ++z ) {
+			float v = float( z ) / format.resZ;
+			out->position = format.size * vec3( u - 0.5f, 0.0f, v - 0.5f );
+			out->normal = vec3( 0, 1, 0 );
+			out->texCoord = vec2( u, v );
+			out++;
+		}
+	}
+
+	// the last column has no quads of its own
+	int quadsEnd = std::min( int( end ), range.width - 1 );
+	if( range.use16Bit )
+		writeIndices( (uint16_t*)indices, depth, format.strips, int( begin ), quadsEnd );
+	else
+		writeIndices( (uint32_t*)indices, depth, format.strips, int( begin ), quadsEnd );
+}
+
+void PlumeMesh::addTile( const TileRange &range, const gl::VboRef &vertexVbo, const gl::VboRef &indexVbo, const gl::GlslProgRef &shader )
+{
+	geom::BufferLayout layout;
+	layout.append( geom::POSITION, 3, sizeof( Vertex ), offsetof( Vertex, position ) );
+	layout.append( geom::NORMAL, 3, sizeof( Vertex ), offsetof( Vertex, normal ) );
+	layout.append( geom::TEX_COORD_0, 2, sizeof( Vertex ), offsetof( Vertex, texCoord ) );
+
+	GLenum primitive = mFormat.strips ? GL_TRIANGLE_STRIP : GL_TRIANGLES;
+
+	Tile tile;
+	tile.range = range;
+	tile.vertexVbo = vertexVbo;
+	tile.indexVbo = indexVbo;
+	tile.mesh = gl::VboMesh::create( range.numVertices, primitive, { { layout, vertexVbo } }, range.numIndices,
+									range.use16Bit ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT, indexVbo );
+	tile.batch = gl::Batch::create( tile.mesh, shader );
+	tile.restartIndex = range.use16Bit ? 0xFFFF : 0xFFFFFFFF;
+	mTiles.push_back( tile );
+}
+
+PlumeMeshRef PlumeMesh::create( const Format &format, const gl::GlslProgRef &shader, WorkerPool &workers )
+{
+    auto started = chrono::steady_clock::now();
+
+    PlumeMeshRef mesh( new PlumeMesh( format ) );
+    mesh->mFormat.resX = std::max( format.resX, 2 );
+    mesh->mFormat.resZ = std::max( format.resZ, 2 );
+
+    for( const TileRange &range : layoutTiles( mesh->mFormat ) ) {
+        // one interleaved vertex buffer and an index buffer, both written in place through a mapping
+        auto vertexVbo = gl::Vbo::create( GL_ARRAY_BUFFER, range.getVertexBytes(), nullptr, GL_STATIC_DRAW );
+        auto indexVbo = gl::Vbo::create( GL_ELEMENT_ARRAY_BUFFER, range.getIndexBytes(), nullptr, GL_STATIC_DRAW );
+        const GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT;
+        void *vertices = vertexVbo->mapBufferRange( 0, vertexVbo->getSize(), access );
+        void *indices = indexVbo->mapBufferRange( 0, indexVbo->getSize(), access );
+
+        // columns are independent, so they are filled in parallel; the workers only touch the mapped memory
+        if( vertices && indices ) {
+            const Format &f = mesh->mFormat;
+            workers.parallelFor( range.width, ColumnsPerChunk, [&]( size_t begin, size_t end ) {
+                fillColumns( f, range, vertices, indices, begin, end );
+            });
+        }
+
+        vertexVbo->unmap();
+        indexVbo->unmap();
+        mesh->addTile( range, vertexVbo, indexVbo, shader );
+    }
+
+    mesh->mBuildMs = chrono::duration<double, milli>( chrono::steady_clock::now() - started ).count();
+    return mesh;
+}
+
+PlumeMesh::StagingRef PlumeMesh::stage( const Format &format, WorkerPool &workers )
+{
+    auto started = chrono::steady_clock::now();
+
+    StagingRef staging = make_shared<Staging>();
+    staging->format = format;
+    staging->format.resX = std::max( format.resX, 2 );
+    staging->format.resZ = std::max( format.resZ, 2 );
+    staging->tiles = layoutTiles( staging->format );
+
+    for( const TileRange &range : staging->tiles ) {
+        staging->vertices.emplace_back( range.getVertexBytes() );
+        staging->indices.emplace_back( range.getIndexBytes() );
+        void *vertices = staging->vertices.back().data();
+        void *indices = staging->indices.back().data();
+
+        const Format &f = staging->format;
+        workers.parallelFor( range.width, ColumnsPerChunk, [&]( size_t begin, size_t end ) {
+            fillColumns( f, range, vertices, indices, begin, end );
+        });
+    }
+
+    staging->buildMs = chrono::duration<double, milli>( chrono::steady_clock::now() - started ).count();
+    return staging;
+}
+
+PlumeMeshRef PlumeMesh::create( const StagingRef &staging, const gl::GlslProgRef &shader )
+{
+    PlumeMeshRef mesh( new PlumeMesh( staging->format ) );
+    for( const TileRange &range : staging->tiles ) {
+        auto vertexVbo = gl::Vbo::create( GL_ARRAY_BUFFER, range.getVertexBytes(), nullptr, GL_STATIC_DRAW );
+        auto indexVbo = gl::Vbo::create( GL_ELEMENT_ARRAY_BUFFER, range.getIndexBytes(), nullptr, GL_STATIC_DRAW );
+        mesh->addTile( range, vertexVbo, indexVbo, shader );
+    }
+    mesh->mBuildMs = staging->buildMs;
+    mesh->mStaging = staging;
+    return mesh;
+}
+
+bool PlumeMesh::upload( size_t maxBytes )
+{
+    // the vertices of each tile are copied first, then its indices
+    while( mStaging && maxBytes > 0 ) {
+        Tile &tile = mTiles[mUploadTile];
+        const vector<char> &vertices = mStaging->vertices[mUploadTile];
+        const vector<char> &indices = mStaging->indices[mUploadTile];
+
+        bool inVertices = mUploadOffset < vertices.size();
+        const vector<char> &data = inVertices ? vertices : indices;
+        size_t offset = inVertices ? mUploadOffset : mUploadOffset - vertices.size();
+        size_t bytes = std::min( maxBytes, data.size() - offset );
+
+        if( bytes > 0 ) {
+            const gl::VboRef &vbo = inVertices ? tile.vertexVbo : tile.indexVbo;
+            vbo->bufferSubData( offset, bytes, data.data() + offset );
+        }
+        mUploadOffset += bytes;
+        maxBytes -= bytes;
+
+        if( mUploadOffset >= vertices.size() + indices.size() ) {
+            mUploadTile++;
+            mUploadOffset = 0;
+            if( mUploadTile == mTiles.size() )
+                mStaging.reset();
+        }
+    }
+    return isUploaded();
+}
+
+void PlumeMesh::draw( int numInstances )
+{
+    if( ! isUploaded() )
+        return;
+
+    gl::ScopedState restart( GL_PRIMITIVE_RESTART, mFormat.strips );
+    for( auto &tile : mTiles ) {
+        if( mFormat.strips )
+            glPrimitiveRestartIndex( tile.restartIndex );
+        tile.batch->drawInstanced( numInstances );
+    }
+}
+
+void PlumeMesh::drawOriginal()
+{
+    if( ! isUploaded() )
+        return;
+
+    gl::ScopedState restart( GL_PRIMITIVE_RESTART, mFormat.strips );
+    for( auto &tile : mTiles ) {
+        if( mFormat.strips )
+            glPrimitiveRestartIndex( tile.restartIndex );
+        gl::draw( tile.mesh );
+    }
+}
+
+size_t PlumeMesh::getNumVertices() const
+{
+    size_t n = 0;
+    for( auto &tile : mTiles )
+        n += tile.mesh->getNumVertices();
+    return n;
+}
+
+size_t PlumeMesh::getNumIndices() const
+{
+    size_t n = 0;
+    for( auto &tile : mTiles )
+        n += tile.mesh->getNumIndices();
+    return n;
+}
+
+size_t PlumeMesh::getIndexBytes() const
+{
+    size_t n = 0;
+    for( auto &tile : mTiles )
+        n += tile.mesh->getNumIndices() * ( tile.mesh->getIndexDataType() == GL_UNSIGNED_SHORT ? 2 : 4 );
+    return n;
+}
+
+#pragma mark PlumeMeshRebuilder
+
+PlumeMeshRebuilder::PlumeMeshRebuilder( WorkerPool &workers )
+    : mWorkers( workers ), mState( make_shared<State>() )
+{
+}
+
+void PlumeMeshRebuilder::request( const PlumeMesh::Format &format )
+{
+    mRequested = format;
+    mHasRequest = true;
+    startBuild();
+}
+
+void PlumeMeshRebuilder::startBuild()
+{
+    {
+        lock_guard<mutex> lock( mState->mutex );
+        // the running build will be followed by another one for the latest request
+        if( mState->building )
+            return;
+        mState->building = true;
+    }
+    mHasRequest = false;
+
+    shared_ptr<State> state = mState;
+    PlumeMesh::Format format = mRequested;
+    WorkerPool &workers = mWorkers;
+    mWorkers.submit( [state, format, &workers] {
+        PlumeMesh::StagingRef staged = PlumeMesh::stage( format, workers );
+        lock_guard<mutex> lock( state->mutex );
+        state->staged = staged;
+        state->building = false;
+    });
+}
+
+PlumeMeshRef PlumeMeshRebuilder::update( const gl::GlslProgRef &shader, size_t maxBytes )
+{
+    if( ! mUploading ) {
+        PlumeMesh::StagingRef staged;
+        {
+            lock_guard<mutex> lock( mState->mutex );
+            staged.swap( mState->staged );
+        }
+        // a build that has been overtaken by a newer request is dropped
+        bool overtaken = mHasRequest;
+        if( mHasRequest )
+            startBuild();
+        if( staged && ! overtaken )
+            mUploading = PlumeMesh::create( staged, shader );
+    }
+
+    if( mUploading && mUploading->upload( maxBytes ) ) {
+        PlumeMeshRef ready;
+        ready.swap( mUploading );
+        return ready;
+    }
+    return PlumeMeshRef();
+}
+
+bool PlumeMeshRebuilder::isBusy() const
+{
+    lock_guard<mutex> lock( mState->mutex );
+    return mHasRequest || mState->building || mState->staged || mUploading;
+}
@@ -0,0 +1,154 @@
+//
+//  PlumeMesh.h
+//  MusicalSmoke
+//
+//  The flat grid that the displacement and normal maps are applied to.
+//  Indices are 16 bit when the vertices allow it and 32 bit otherwise, and
+//  the grid can be drawn as triangle strips joined by primitive restart, or
+//  split into tiles that each keep to 16 bit indices.
+//
+
+#ifndef PlumeMesh_h
+#define PlumeMesh_h
+
+#include "cinder/gl/Batch.h"
+#include "cinder/gl/VboMesh.h"
+
+#include "WorkerPool.h"
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+typedef std::shared_ptr<class PlumeMesh> PlumeMeshRef;
+
+//! Per-instance data of one plume, laid out like the std140 Plume struct in mesh.vert.
+struct PlumeInstance {
+    cinder::mat4    transform;
+    //! Offset (xy) and scale (zw) of the part of the field the plume shows.
+    cinder::vec4    window = cinder::vec4( 0, 0, 1, 1 );
+    //! Band that swells the plume (x, -1 for none) and how much (y).
+    cinder::vec4    audio = cinder::vec4( -1, 0, 0, 0 );
+
+    //! Matches MAX_PLUMES in mesh.vert.
+    static const int MaxInstances = 64;
+};
+
+class PlumeMesh{
+
+public:
+    struct Format {
+        //! Vertices along (x) and across (z) the plume.
+        int             resX = 398, resZ = 98;
+        cinder::vec3    size = cinder::vec3( 200.0f, 1.0f, 50.0f );
+        //! Triangle strips, one per column, joined with primitive restart. About a third of the indices of a triangle list.
+        bool            strips = false;
+        //! Splits the grid into tiles of at most 65535 vertices, so every tile gets 16 bit indices.
+        bool            tiled = false;
+
+        bool operator==( const Format &other ) const;
+        bool operator!=( const Format &other ) const { return ! ( *this == other ); }
+    };
+
+    //! CPU copy of the vertex and index data of a mesh, see stage().
+    struct Staging;
+    typedef std::shared_ptr<Staging> StagingRef;
+
+    //! Builds the mesh, filling the buffers on \a workers and the calling thread, which must own the GL context.
+    static PlumeMeshRef create( const Format &format, const cinder::gl::GlslProgRef &shader, WorkerPool &workers );
+
+    //! Builds the vertex and index data in memory. Needs no GL context, so it can run on any thread.
+    static StagingRef stage( const Format &format, WorkerPool &workers );
+    //! Allocates the buffers for \a staging, which are filled by upload().
+    static PlumeMeshRef create( const StagingRef &staging, const cinder::gl::GlslProgRef &shader );
+    //! Copies up to \a maxBytes of staged data to the GPU. Returns true once everything is uploaded.
+    bool upload( size_t maxBytes );
+    bool isUploaded() const { return ! mStaging; }
+
+    //! Draws \a numInstances plumes with the shader passed to create(), one instanced draw per tile.
+    void draw( int numInstances = 1 );
+    //! Draws all tiles with the current shader, without displacement.
+    void drawOriginal();
+
+    const Format& getFormat() const { return mFormat; }
+    size_t getNumTiles() const { return mTiles.size(); }
+    size_t getNumVertices() const;
+    size_t getNumIndices() const;
+    //! Bytes of index data over all tiles.
+    size_t getIndexBytes() const;
+    //! Time spent filling the buffers, in milliseconds.
+    double getBuildTime() const { return mBuildMs; }
+
+private:
+    //! Where a tile sits in the grid: \a width by \a depth vertices from column \a x0 and row \a z0.
+    struct TileRange {
+        int     x0, z0, width, depth;
+        size_t  numVertices, numIndices;
+        bool    use16Bit;
+
+        size_t getVertexBytes() const;
+        size_t getIndexBytes() const;
+    };
+
+    struct Tile {
+        TileRange               range;
+        cinder::gl::VboRef      vertexVbo, indexVbo;
+        cinder::gl::VboMeshRef  mesh;
+        cinder::gl::BatchRef    batch;
+        GLuint                  restartIndex;
+    };
+
+    PlumeMesh( const Format &format ) : mFormat( format ) {}
+
+    //! Splits the grid of \a format into tiles.
+    static std::vector<TileRange> layoutTiles( const Format &format );
+    //! Fills columns \a begin to \a end of a tile. Touches nothing but the two arrays.
+    static void fillColumns( const Format &format, const TileRange &range, void *vertices, void *indices, size_t begin, size_t end );
+
+    //! Wraps the buffers of a tile in a mesh and a batch.
+    void addTile( const TileRange &range, const cinder::gl::VboRef &vertexVbo, const cinder::gl::VboRef &indexVbo,
+                  const cinder::gl::GlslProgRef &shader );
+
+    Format              mFormat;
+    std::vector<Tile>   mTiles;
+    double              mBuildMs = 0;
+
+    // upload progress of a staged mesh
+    StagingRef          mStaging;
+    size_t              mUploadTile = 0;
+    size_t              mUploadOffset = 0;
+};
+
+//! Rebuilds the plume mesh on a worker thread when its format changes, so the
+//! render thread only ever uploads a bounded slice of data per frame.
+class PlumeMeshRebuilder{
+
+public:
+    explicit PlumeMeshRebuilder( WorkerPool &workers );
+
+    //! Asks for a mesh in \a format. Requests made while a build is running are coalesced into one rebuild.
+    void request( const PlumeMesh::Format &format );
+
+    //! Uploads at most \a maxBytes of a finished build. Returns the new mesh once it is ready to draw, or null.
+    PlumeMeshRef update( const cinder::gl::GlslProgRef &shader, size_t maxBytes = 8 << 20 );
+
+    bool isBusy() const;
+
+private:
+    void startBuild();
+
+    //! Shared with the worker, which may still run after the rebuilder is gone.
+    struct State {
+        std::mutex                  mutex;
+        PlumeMesh::StagingRef       staged;
+        bool                        building = false;
+    };
+
+    WorkerPool                  &mWorkers;
+    std::shared_ptr<State>      mState;
+    PlumeMesh::Format           mRequested;
+    bool                        mHasRequest = false;
+    PlumeMeshRef                mUploading;
+};
+
+#endif /* PlumeMesh_h */
@@ -0,0 +1,94 @@
+//
+//  QualityGovernor.cpp
+//  MusicalSmoke
+//
+
+#include <algorithm>
+
+#include "QualityGovernor.h"
+
+using namespace std;
+
+QualityGovernor::QualityGovernor()
+{
+    // "Medium" is what the app used to run at unconditionally
+    setLevels( {
+        { "Low",    128, 200, 50,  100 },
+        { "Medium", 256, 398, 98,  100 },
+        { "High",   512, 510, 126, 10000 },
+        { "Ultra",  1024, 1024, 256, 100000 },
+    }, 1 );
+}
+
+void QualityGovernor::setLevels( const vector<Level> &levels, int level )
+{
+    mLevels = levels;
+    setLevel( level );
+}
+
+void QualityGovernor::setLevel( int level )
+{
+    mLevel = std::max( 0, std::min( level, int( mLevels.size() ) - 1 ) );
+    mSamples.clear();
+    mFastWindows = 0;
+    mFailedUpgrades = 0;
+    mSteppedUp = false;
+    mCooldown = mCooldownFrames;
+}
+
+bool QualityGovernor::update( double frameMs )
+{
+    if( mCooldown > 0 ) {
+        mCooldown--;
+        return false;
+    }
+
+    mSamples.push_back( frameMs );
+    if( mSamples.size() < mWindowSize )
+        return false;
+
+    size_t p90 = mSamples.size() * 9 / 10;
+    std::nth_element( mSamples.begin(), mSamples.begin() + p90, mSamples.end() );
+    double load = mSamples[p90] / mTargetMs;
+    mSamples.clear();
+    mWindowsSinceChange++;
+
+    if( load > mDownThreshold ) {
+        mFastWindows = 0;
+        if( mLevel == 0 )
+            return false;
+
+        // a step up that could not be held; wait longer before the next try
+        if( mSteppedUp && mWindowsSinceChange <= mUpWindows )
+            mFailedUpgrades = std::min( mFailedUpgrades + 1, 4 );
+        changeLevel( mLevel - 1 );
+        mSteppedUp = false;
+        return true;
+    }
+
+    if( load < mUpThreshold ) {
+        mFastWindows++;
+        if( mLevel + 1 < int( mLevels.size() ) && mFastWindows >= ( mUpWindows << mFailedUpgrades ) ) {
+            changeLevel( mLevel + 1 );
+            mSteppedUp = true;
+            return true;
+        }
+    }
+    else {
+        mFastWindows = 0;
+    }
+
+    // a step up that has held for long enough clears the back off
+    if( mSteppedUp && mWindowsSinceChange > 8 * mUpWindows )
+        mFailedUpgrades = 0;
+
+    return false;
+}
+
+void QualityGovernor::changeLevel( int level )
+{
+    mLevel = level;
+    mFastWindows = 0;
+    mWindowsSinceChange = 0;
+    mCooldown = mCooldownFrames;
+}
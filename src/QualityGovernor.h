@@ -0,0 +1,70 @@
+//
+//  QualityGovernor.h
+//  MusicalSmoke
+//
+//  Steps the render quality up or down to hold a frame time target. Frame
+//  times are judged a window at a time; dropping a level takes one slow
+//  window, climbing takes several fast ones in a row, and every change is
+//  followed by a cooldown, so the level does not flip back and forth.
+//
+
+#ifndef QualityGovernor_h
+#define QualityGovernor_h
+
+#include <string>
+#include <vector>
+
+class QualityGovernor{
+
+public:
+    //! One step of the quality ladder.
+    struct Level {
+        std::string name;
+        int         fboSize;        // width and height of the ping-pong and surface map buffers
+        int         meshResX;       // mesh vertices along the plume
+        int         meshResZ;       // mesh vertices across the plume
+        int         numParticles;
+    };
+
+    //! Starts with the default ladder, at the level that matches the original fixed settings.
+    QualityGovernor();
+
+    void setLevels( const std::vector<Level> &levels, int level );
+    const std::vector<Level>& getLevels() const { return mLevels; }
+
+    //! Jumps to \a level and restarts the measurement.
+    void setLevel( int level );
+    int  getLevelIndex() const { return mLevel; }
+    const Level& getLevel() const { return mLevels[mLevel]; }
+
+    //! Frame time to hold, in milliseconds.
+    void   setTargetFrameTime( double ms ) { mTargetMs = ms; }
+    double getTargetFrameTime() const { return mTargetMs; }
+
+    //! Feeds the time the last frame took, in milliseconds. Returns true when the level changed.
+    bool update( double frameMs );
+
+private:
+    void changeLevel( int level );
+
+    std::vector<Level>  mLevels;
+    int                 mLevel = 0;
+    double              mTargetMs = 1000.0 / 60.0;
+
+    // a window is judged by its 90th percentile, which ignores the odd hitch
+    // but not a steady share of slow frames
+    size_t              mWindowSize = 60;
+    double              mDownThreshold = 1.0;   // fraction of the target above which we step down
+    double              mUpThreshold = 0.7;     // fraction of the target below which we may step up
+    int                 mUpWindows = 4;         // fast windows in a row needed to step up
+    int                 mCooldownFrames = 60;   // frames ignored after a change, while buffers settle
+
+    std::vector<double> mSamples;
+    int                 mFastWindows = 0;
+    int                 mCooldown = 0;
+    int                 mFailedUpgrades = 0;    // recent step ups that had to be undone
+    bool                mSteppedUp = false;     // the last change was a step up
+    int                 mWindowsSinceChange = 0;
+};
+
+#endif /* QualityGovernor_h */
@@ -0,0 +1,45 @@
+//
+//  SimulationClock.cpp
+//  MusicalSmoke
+//
+
+#include <algorithm>
+
+#include "SimulationClock.h"
+
+// Absorbs rounding error when a frame is an exact multiple of the step,
+// e.g. offline renders at 60 fps.
+static const double StepEpsilon = 1e-9;
+
+SimulationClock::SimulationClock( double step, int maxStepsPerFrame )
+: mStep( step ), mMaxStepsPerFrame( maxStepsPerFrame )
+{
+    reset();
+}
+
+void SimulationClock::reset()
+{
+    mTime = 0;
+    mAccumulator = 0;
+    mStepsThisFrame = 0;
+}
+
+void SimulationClock::advance( double elapsed )
+{
+    mAccumulator += std::max( elapsed, 0.0 );
+    mStepsThisFrame = 0;
+
+    // after a long stall, drop the backlog rather than spiral into ever longer frames
+    mAccumulator = std::min( mAccumulator, mMaxStepsPerFrame * mStep );
+}
+
+bool SimulationClock::step()
+{
+    if( mAccumulator + StepEpsilon < mStep || mStepsThisFrame >= mMaxStepsPerFrame )
+        return false;
+
+    mAccumulator = std::max( mAccumulator - mStep, 0.0 );
+    mTime += mStep;
+    mStepsThisFrame++;
+    return true;
+}
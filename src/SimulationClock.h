@@ -0,0 +1,41 @@
+//
+//  SimulationClock.h
+//  MusicalSmoke
+//
+//  Fixed-timestep clock shared by every simulation stage, so that the
+//  visuals evolve at the same speed regardless of the render frame rate.
+//
+
+#ifndef SimulationClock_h
+#define SimulationClock_h
+
+class SimulationClock{
+
+public:
+    SimulationClock( double step = 1.0 / 60.0, int maxStepsPerFrame = 8 );
+
+    //! Accumulates \a elapsed seconds of real (or offline) time. Call once per frame.
+    void advance( double elapsed );
+    //! Consumes one fixed step of accumulated time. Returns false when less than a step is left.
+    bool step();
+    //! Restarts the clock at time zero.
+    void reset();
+
+    //! Simulation time after the last completed step, in seconds.
+    double getTime() const { return mTime; }
+    //! Length of one step, in seconds.
+    double getStep() const { return mStep; }
+    //! Fraction of a step accumulated since the last completed step, in [0, 1).
+    float  getAlpha() const { return float( mAccumulator / mStep ); }
+    //! Simulation time including the pending fraction of a step, for smooth animation.
+    double getInterpolatedTime() const { return mTime + mAccumulator; }
+
+private:
+    double  mStep;
+    int     mMaxStepsPerFrame;
+    int     mStepsThisFrame;
+    double  mTime;
+    double  mAccumulator;
+};
+
+#endif /* SimulationClock_h */
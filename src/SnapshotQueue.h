@@ -0,0 +1,57 @@
+//
+//  SnapshotQueue.h
+//  MusicalSmoke
+//
+//  Lock-free queue of values from one producer thread to one consumer
+//  thread. Neither side ever blocks or waits for the other. When the
+//  consumer falls a whole queue behind, the producer drops new values
+//  instead of overwriting ones that may be being read.
+//
+
+#ifndef SnapshotQueue_h
+#define SnapshotQueue_h
+
+#include <atomic>
+#include <cstddef>
+
+template<typename T, size_t Capacity>
+class SnapshotQueue{
+
+public:
+    SnapshotQueue()
+    : mHead( 0 ), mTail( 0 )
+    {}
+
+    //! Producer: the slot to fill before calling push(), or null while the queue is full.
+    T* getWriteSlot()
+    {
+        size_t head = mHead.load( std::memory_order_relaxed );
+        if( head - mTail.load( std::memory_order_acquire ) == Capacity )
+            return nullptr;
+        return &mSlots[head % Capacity];
+    }
+
+    //! Producer: makes the slot returned by getWriteSlot() visible to the consumer.
+    void push()
+    {
+        mHead.store( mHead.load( std::memory_order_relaxed ) + 1, std::memory_order_release );
+    }
+
+    //! Consumer: moves the oldest value into \a value. Returns false if the queue is empty.
+    bool pop( T *value )
+    {
+        size_t tail = mTail.load( std::memory_order_relaxed );
+        if( tail == mHead.load( std::memory_order_acquire ) )
+            return false;
+
+        *value = mSlots[tail % Capacity];
+        mTail.store( tail + 1, std::memory_order_release );
+        return true;
+    }
+
+private:
+    T                       mSlots[Capacity];
+    std::atomic<size_t>     mHead, mTail;
+};
+
+#endif /* SnapshotQueue_h */
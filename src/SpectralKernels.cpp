@@ -0,0 +1,399 @@
+//
+//  SpectralKernels.cpp
+//  MusicalSmoke
+//
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+#include "SpectralKernels.h"
+
+#if defined( __x86_64__ ) || defined( _M_X64 ) || defined( __i386__ ) || defined( _M_IX86 )
+	#define SPECTRAL_SSE 1
+	#include <emmintrin.h>
+	#if defined( __GNUC__ ) || defined( __clang__ )
+		// AVX2 versions are compiled with a per-function target and picked at runtime
+		#define SPECTRAL_AVX2 1
+		#include <immintrin.h>
+	#endif
+#elif defined( __ARM_NEON ) || defined( __ARM_NEON__ )
+	#define SPECTRAL_NEON 1
+	#include <arm_neon.h>
+#endif
+
+namespace spectral {
+
+namespace {
+
+#pragma mark Scalar
+
+float sumSquaresScalar( const float *x, size_t n )
+{
+	float sum = 0;
+	for( size_t i = 0; i < n; i++ )
+		sum += x[i] * x[i];
+	return sum;
+}
+
+float sumScalar( const float *x, size_t n )
+{
+	float sum = 0;
+	for( size_t i = 0; i < n; i++ )
+		sum += x[i];
+	return sum;
+}
+
+void applyWindowScalar( float *data, const float *window, size_t n )
+{
+	for( size_t i = 0; i < n; i++ )
+		data[i] *= window[i];
+}
+
+void magnitudesScalar( const float *re, const float *im, float *mag, size_t n, float scale )
+{
+	for( size_t i = 0; i < n; i++ )
+		mag[i] = std::sqrt( re[i] * re[i] + im[i] * im[i] ) * scale;
+}
+
+float smoothScalar( float *state, const float *input, float factor, size_t n )
+{
+	float rise = 0;
+	for( size_t i = 0; i < n; i++ ) {
+		float next = state[i] * factor + input[i] * ( 1.0f - factor );
+		rise += std::max( next - state[i], 0.0f );
+		state[i] = next;
+	}
+	return rise;
+}
+
+#if SPECTRAL_SSE
+
+#pragma mark SSE2
+
+inline float horizontalSum( __m128 v )
+{
+	__m128 shuffled = _mm_shuffle_ps( v, v, _MM_SHUFFLE( 2, 3, 0, 1 ) );
+	__m128 sums = _mm_add_ps( v, shuffled );
+	shuffled = _mm_movehl_ps( shuffled, sums );
+	sums = _mm_add_ss( sums, shuffled );
+	return _mm_cvtss_f32( sums );
+}
+
+float sumSquaresSse( const float *x, size_t n )
+{
+	__m128 acc = _mm_setzero_ps();
+	size_t i = 0;
+	for( ; i + 4 <= n; i += 4 ) {
+		__m128 v = _mm_loadu_ps( x + i );
+		acc = _mm_add_ps( acc, _mm_mul_ps( v, v ) );
+	}
+	return horizontalSum( acc ) + sumSquaresScalar( x + i, n - i );
+}
+
+float sumSse( const float *x, size_t n )
+{
+	__m128 acc = _mm_setzero_ps();
+	size_t i = 0;
+	for( ; i + 4 <= n; i += 4 )
+		acc = _mm_add_ps( acc, _mm_loadu_ps( x + i ) );
+	return horizontalSum( acc ) + sumScalar( x + i, n - i );
+}
+
+void applyWindowSse( float *data, const float *window, size_t n )
+{
+	size_t i = 0;
+	for( ; i + 4 <= n; i += 4 )
+		_mm_storeu_ps( data + i, _mm_mul_ps( _mm_loadu_ps( data + i ), _mm_loadu_ps( window + i ) ) );
+	applyWindowScalar( data + i, window + i, n - i );
+}
+
+void magnitudesSse( const float *re, const float *im, float *mag, size_t n, float scale )
+{
+	const __m128 s = _mm_set1_ps( scale );
+	size_t i = 0;
+	for( ; i + 4 <= n; i += 4 ) {
+		__m128 r = _mm_loadu_ps( re + i );
+		__m128 m = _mm_loadu_ps( im + i );
+		__m128 power = _mm_add_ps( _mm_mul_ps( r, r ), _mm_mul_ps( m, m ) );
+		_mm_storeu_ps( mag + i, _mm_mul_ps( _mm_sqrt_ps( power ), s ) );
+	}
+	magnitudesScalar( re + i, im + i, mag + i, n - i, scale );
+}
+
+float smoothSse( float *state, const float *input, float factor, size_t n )
+{
+	const __m128 f = _mm_set1_ps( factor );
+	const __m128 g = _mm_set1_ps( 1.0f - factor );
+	const __m128 zero = _mm_setzero_ps();
+	__m128 rise = zero;
+	size_t i = 0;
+	for( ; i + 4 <= n; i += 4 ) {
+		__m128 prev = _mm_loadu_ps( state + i );
+		__m128 next = _mm_add_ps( _mm_mul_ps( prev, f ), _mm_mul_ps( _mm_loadu_ps( input + i ), g ) );
+		rise = _mm_add_ps( rise, _mm_max_ps( _mm_sub_ps( next, prev ), zero ) );
+		_mm_storeu_ps( state + i, next );
+	}
+	return horizontalSum( rise ) + smoothScalar( state + i, input + i, factor, n - i );
+}
+
+#endif // SPECTRAL_SSE
+
+#if SPECTRAL_AVX2
+
+#pragma mark AVX2
+
+#define SPECTRAL_TARGET_AVX2 __attribute__(( target( "avx2,fma" ) ))
+
+SPECTRAL_TARGET_AVX2 inline float horizontalSum256( __m256 v )
+{
+	__m128 sum = _mm_add_ps( _mm256_castps256_ps128( v ), _mm256_extractf128_ps( v, 1 ) );
+	__m128 shuffled = _mm_movehdup_ps( sum );
+	sum = _mm_add_ps( sum, shuffled );
+	shuffled = _mm_movehl_ps( shuffled, sum );
+	return _mm_cvtss_f32( _mm_add_ss( sum, shuffled ) );
+}
+
+SPECTRAL_TARGET_AVX2 float sumSquaresAvx2( const float *x, size_t n )
+{
+	__m256 acc = _mm256_setzero_ps();
+	size_t i = 0;
+	for( ; i + 8 <= n; i += 8 ) {
+		__m256 v = _mm256_loadu_ps( x + i );
+		acc = _mm256_fmadd_ps( v, v, acc );
+	}
+	return horizontalSum256( acc ) + sumSquaresScalar( x + i, n - i );
+}
+
+SPECTRAL_TARGET_AVX2 float sumAvx2( const float *x, size_t n )
+{
+	__m256 acc = _mm256_setzero_ps();
+	size_t i = 0;
+	for( ; i + 8 <= n; i += 8 )
+		acc = _mm256_add_ps( acc, _mm256_loadu_ps( x + i ) );
+	return horizontalSum256( acc ) + sumScalar( x + i, n - i );
+}
+
+SPECTRAL_TARGET_AVX2 void applyWindowAvx2( float *data, const float *window, size_t n )
+{
+	size_t i = 0;
+	for( ; i + 8 <= n; i += 8 )
+		_mm256_storeu_ps( data + i, _mm256_mul_ps( _mm256_loadu_ps( data + i ), _mm256_loadu_ps( window + i ) ) );
+	applyWindowScalar( data + i, window + i, n - i );
+}
+
+SPECTRAL_TARGET_AVX2 void magnitudesAvx2( const float *re, const float *im, float *mag, size_t n, float scale )
+{
+	const __m256 s = _mm256_set1_ps( scale );
+	size_t i = 0;
+	for( ; i + 8 <= n; i += 8 ) {
+		__m256 r = _mm256_loadu_ps( re + i );
+		__m256 m = _mm256_loadu_ps( im + i );
+		__m256 power = _mm256_fmadd_ps( r, r, _mm256_mul_ps( m, m ) );
+		_mm256_storeu_ps( mag + i, _mm256_mul_ps( _mm256_sqrt_ps( power ), s ) );
+	}
+	magnitudesScalar( re + i, im + i, mag + i, n - i, scale );
+}
+
+SPECTRAL_TARGET_AVX2 float smoothAvx2( float *state, const float *input, float factor, size_t n )
+{
+	const __m256 f = _mm256_set1_ps( factor );
+	const __m256 g = _mm256_set1_ps( 1.0f - factor );
+	const __m256 zero = _mm256_setzero_ps();
+	__m256 rise = zero;
+	size_t i = 0;
+	for( ; i + 8 <= n; i += 8 ) {
+		__m256 prev = _mm256_loadu_ps( state + i );
+		__m256 next = _mm256_fmadd_ps( prev, f, _mm256_mul_ps( _mm256_loadu_ps( input + i ), g ) );
+		rise = _mm256_add_ps( rise, _mm256_max_ps( _mm256_sub_ps( next, prev ), zero ) );
+		_mm256_storeu_ps( state + i, next );
+	}
+	return horizontalSum256( rise ) + smoothScalar( state + i, input + i, factor, n - i );
+}
+
+#endif // SPECTRAL_AVX2
+
+#if SPECTRAL_NEON
+
+#pragma mark NEON
+
+inline float horizontalSumNeon( float32x4_t v )
+{
+	float32x2_t sum = vadd_f32( vget_low_f32( v ), vget_high_f32( v ) );
+	return vget_lane_f32( vpadd_f32( sum, sum ), 0 );
+}
+
+float sumSquaresNeon( const float *x, size_t n )
+{
+	float32x4_t acc = vdupq_n_f32( 0 );
+	size_t i = 0;
+	for( ; i + 4 <= n; i += 4 ) {
+		float32x4_t v = vld1q_f32( x + i );
+		acc = vmlaq_f32( acc, v, v );
+	}
+	return horizontalSumNeon( acc ) + sumSquaresScalar( x + i, n - i );
+}
+
+float sumNeon( const float *x, size_t n )
+{
+	float32x4_t acc = vdupq_n_f32( 0 );
+	size_t i = 0;
+	for( ; i + 4 <= n; i += 4 )
+		acc = vaddq_f32( acc, vld1q_f32( x + i ) );
+	return horizontalSumNeon( acc ) + sumScalar( x + i, n - i );
+}
+
+void applyWindowNeon( float *data, const float *window, size_t n )
+{
+	size_t i = 0;
+	for( ; i + 4 <= n; i += 4 )
+		vst1q_f32( data + i, vmulq_f32( vld1q_f32( data + i ), vld1q_f32( window + i ) ) );
+	applyWindowScalar( data + i, window + i, n - i );
+}
+
+void magnitudesNeon( const float *re, const float *im, float *mag, size_t n, float scale )
+{
+	// NEON has no full precision vector sqrt on 32 bit ARM, so only the power is vectorized
+	size_t i = 0;
+	float power[4];
+	for( ; i + 4 <= n; i += 4 ) {
+		float32x4_t r = vld1q_f32( re + i );
+		float32x4_t m = vld1q_f32( im + i );
+		vst1q_f32( power, vmlaq_f32( vmulq_f32( r, r ), m, m ) );
+		for( int k = 0; k < 4; k++ )
+			mag[i + k] = std::sqrt( power[k] ) * scale;
+	}
+	magnitudesScalar( re + i, im + i, mag + i, n - i, scale );
+}
+
+float smoothNeon( float *state, const float *input, float factor, size_t n )
+{
+	const float32x4_t zero = vdupq_n_f32( 0 );
+	float32x4_t rise = zero;
+	size_t i = 0;
+	for( ; i + 4 <= n; i += 4 ) {
+		float32x4_t prev = vld1q_f32( state + i );
+		float32x4_t next = vmlaq_n_f32( vmulq_n_f32( prev, factor ), vld1q_f32( input + i ), 1.0f - factor );
+		rise = vaddq_f32( rise, vmaxq_f32( vsubq_f32( next, prev ), zero ) );
+		vst1q_f32( state + i, next );
+	}
+	return horizontalSumNeon( rise ) + smoothScalar( state + i, input + i, factor, n - i );
+}
+
+#endif // SPECTRAL_NEON
+
+#pragma mark Dispatch
+
+struct Kernels {
+	float (*sumSquares)( const float*, size_t );
+	float (*sum)( const float*, size_t );
+	void  (*applyWindow)( float*, const float*, size_t );
+	void  (*magnitudes)( const float*, const float*, float*, size_t, float );
+	float (*smooth)( float*, const float*, float, size_t );
+	const char *name;
+};
+
+const Kernels ScalarKernels = { sumSquaresScalar, sumScalar, applyWindowScalar, magnitudesScalar, smoothScalar, "scalar" };
+#if SPECTRAL_SSE
+const Kernels SseKernels = { sumSquaresSse, sumSse, applyWindowSse, magnitudesSse, smoothSse, "SSE2" };
+#endif
+#if SPECTRAL_AVX2
+const Kernels Avx2Kernels = { sumSquaresAvx2, sumAvx2, applyWindowAvx2, magnitudesAvx2, smoothAvx2, "AVX2" };
+#endif
+#if SPECTRAL_NEON
+const Kernels NeonKernels = { sumSquaresNeon, sumNeon, applyWindowNeon, magnitudesNeon, smoothNeon, "NEON" };
+#endif
+
+const Kernels* selectKernels()
+{
+#if SPECTRAL_AVX2
+	__builtin_cpu_init();
+	if( __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "fma" ) )
+		return &Avx2Kernels;
+#endif
+#if SPECTRAL_SSE
+	return &SseKernels;
+#elif SPECTRAL_NEON
+	return &NeonKernels;
+#else
+	return &ScalarKernels;
+#endif
+}
+
+// resolved once, before main(), so the audio thread never pays for the check. Benchmarks swap the
+// whole table at once, so a call on another thread sees one set of kernels and its name, never a mix.
+std::atomic<const Kernels*> sKernels( selectKernels() );
+
+} // anonymous namespace
+
+float rms( const float *samples, size_t length )
+{
+	if( length == 0 )
+		return 0;
+	return std::sqrt( sKernels.load( std::memory_order_acquire )->sumSquares( samples, length ) / length );
+}
+
+void applyWindow( float *data, const float *window, size_t length )
+{
+	sKernels.load( std::memory_order_acquire )->applyWindow( data, window, length );
+}
+
+void magnitudes( const float *real, const float *imag, float *mag, size_t length, float scale )
+{
+	sKernels.load( std::memory_order_acquire )->magnitudes( real, imag, mag, length, scale );
+}
+
+void bandMeans( const float *mag, const size_t *edges, float *bands, size_t numBands )
+{
+	const Kernels *kernels = sKernels.load( std::memory_order_acquire );
+	for( size_t b = 0; b < numBands; b++ ) {
+		size_t begin = edges[b];
+		size_t end = edges[b + 1];
+		bands[b] = end > begin ? kernels->sum( mag + begin, end - begin ) / ( end - begin ) : 0.0f;
+	}
+}
+
+float smooth( float *state, const float *input, float factor, size_t length )
+{
+	return sKernels.load( std::memory_order_acquire )->smooth( state, input, factor, length );
+}
+
+const char* getInstructionSet()
+{
+	return sKernels.load( std::memory_order_acquire )->name;
+}
+
+bool useInstructionSet( InstructionSet set )
+{
+	switch( set ) {
+		case INSTRUCTIONS_SCALAR:
+			sKernels.store( &ScalarKernels, std::memory_order_release );
+			return true;
+#if SPECTRAL_SSE
+		case INSTRUCTIONS_SSE2:
+			sKernels.store( &SseKernels, std::memory_order_release );
+			return true;
+#endif
+#if SPECTRAL_AVX2
+		case INSTRUCTIONS_AVX2:
+			if( ! __builtin_cpu_supports( "avx2" ) || ! __builtin_cpu_supports( "fma" ) )
+				return false;
+			sKernels.store( &Avx2Kernels, std::memory_order_release );
+			return true;
+#endif
+#if SPECTRAL_NEON
+		case INSTRUCTIONS_NEON:
+			sKernels.store( &NeonKernels, std::memory_order_release );
+			return true;
+#endif
+		default:
+			return false;
+	}
+}
+
+void useBestInstructionSet()
+{
+	sKernels.store( selectKernels(), std::memory_order_release );
+}
+
+} // namespace spectral
@@ -0,0 +1,52 @@
+//
+//  SpectralKernels.h
+//  MusicalSmoke
+//
+//  Inner loops of the audio analysis, vectorized with AVX2 or SSE2 on x86
+//  and NEON on ARM, with a scalar fallback. AVX2 is picked at runtime, so
+//  the same binary runs on older player boxes.
+//
+
+#ifndef SpectralKernels_h
+#define SpectralKernels_h
+
+#include <cstddef>
+
+namespace spectral {
+
+//! Root mean square of \a length samples.
+float rms( const float *samples, size_t length );
+
+//! data[i] *= window[i]
+void applyWindow( float *data, const float *window, size_t length );
+
+//! mag[i] = sqrt( real[i]^2 + imag[i]^2 ) * scale
+void magnitudes( const float *real, const float *imag, float *mag, size_t length, float scale );
+
+//! bands[b] = mean of mag[edges[b]] .. mag[edges[b + 1] - 1], for \a numBands bands.
+void bandMeans( const float *mag, const size_t *edges, float *bands, size_t numBands );
+
+//! state[i] = state[i] * factor + input[i] * ( 1 - factor ), returning the sum of the positive increases.
+float smooth( float *state, const float *input, float factor, size_t length );
+
+//! Name of the instruction set the kernels run on, for logging.
+const char* getInstructionSet();
+
+//! Instruction sets the kernels are written for.
+enum InstructionSet {
+	INSTRUCTIONS_SCALAR,
+	INSTRUCTIONS_SSE2,
+	INSTRUCTIONS_AVX2,
+	INSTRUCTIONS_NEON
+};
+
+//! Runs the kernels on \a set from now on, for benchmarks. Returns false, and changes nothing, when the
+//! build or the CPU lacks it. The switch is atomic, but analysis running meanwhile would be timed along
+//! with the benchmark and run on the benchmarked set, so stop the audio context first.
+bool useInstructionSet( InstructionSet set );
+//! Goes back to the fastest instruction set the CPU has, the one picked at startup.
+void useBestInstructionSet();
+
+} // namespace spectral
+
+#endif /* SpectralKernels_h */
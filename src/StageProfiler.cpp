@@ -0,0 +1,219 @@
+//
+//  StageProfiler.cpp
+//  MusicalSmoke
+//
+
+#include <algorithm>
+#include <cstdio>
+
+#include "cinder/app/App.h"
+
+#include "StageProfiler.h"
+
+using namespace ci;
+using namespace ci::app;
+using namespace std;
+
+StageProfiler::~StageProfiler()
+{
+    for( auto &slot : mSlots ) {
+        if( ! slot.queries.empty() )
+            glDeleteQueries( (GLsizei)slot.queries.size(), slot.queries.data() );
+    }
+}
+
+void StageProfiler::setup( const vector<string> &stageNames, size_t historyLength )
+{
+    mStages.resize( stageNames.size() );
+    for( size_t i = 0; i < stageNames.size(); i++ ) {
+        mStages[i].name = stageNames[i];
+        mStages[i].cpu.samples.assign( historyLength, 0.0f );
+        mStages[i].gpu.samples.assign( historyLength, 0.0f );
+    }
+    mFrameHistory.samples.assign( historyLength, 0.0f );
+
+    for( auto &slot : mSlots )
+        slot.cpuMs.assign( mStages.size(), 0.0 );
+
+    mFrameStarted = mLabelsUpdated = Clock::now();
+}
+
+void StageProfiler::beginFrame()
+{
+    Clock::time_point now = Clock::now();
+
+    // close the frame that just ended
+    FrameSlot &previous = mSlots[mSlot];
+    previous.frameMs = chrono::duration<double, milli>( now - mFrameStarted ).count();
+    previous.frame = mFrame;
+    previous.pending = true;
+    mFrameHistory.push( float( previous.frameMs ) );
+    for( size_t i = 0; i < mStages.size(); i++ )
+        mStages[i].cpu.push( float( previous.cpuMs[i] ) );
+
+    // the next slot was issued NumFrameSlots - 1 frames ago, by now its queries are usually done
+    mSlot = ( mSlot + 1 ) % NumFrameSlots;
+    collect( mSlots[mSlot] );
+
+    FrameSlot &current = mSlots[mSlot];
+    current.used = 0;
+    std::fill( current.cpuMs.begin(), current.cpuMs.end(), 0.0 );
+    mFrameStarted = now;
+    mFrame++;
+
+    if( now - mLabelsUpdated > chrono::milliseconds( 500 ) ) {
+        mLabelsUpdated = now;
+        updateLabels();
+    }
+}
+
+void StageProfiler::begin( int stage )
+{
+    FrameSlot &slot = mSlots[mSlot];
+    if( slot.used == slot.queries.size() ) {
+        GLuint query;
+        glGenQueries( 1, &query );
+        slot.queries.push_back( query );
+        slot.stages.push_back( stage );
+    }
+    slot.stages[slot.used] = stage;
+    glBeginQuery( GL_TIME_ELAPSED, slot.queries[slot.used] );
+    slot.used++;
+
+    mActiveStage = stage;
+    mStages[stage].started = Clock::now();
+}
+
+void StageProfiler::end( int stage )
+{
+    if( stage != mActiveStage )
+        return;
+
+    glEndQuery( GL_TIME_ELAPSED );
+    mActiveStage = -1;
+
+    FrameSlot &slot = mSlots[mSlot];
+    slot.cpuMs[stage] += chrono::duration<double, milli>( Clock::now() - mStages[stage].started ).count();
+}
+
+void StageProfiler::collect( FrameSlot &slot )
+{
+    if( ! slot.pending )
+        return;
+    slot.pending = false;
+
+    // skip the whole frame rather than stall if the GPU is still behind
+    if( slot.used > 0 ) {
+        GLint available = 0;
+        glGetQueryObjectiv( slot.queries[slot.used - 1], GL_QUERY_RESULT_AVAILABLE, &available );
+        if( ! available )
+            return;
+    }
+
+    vector<double> gpuMs( mStages.size(), 0.0 );
+    for( size_t i = 0; i < slot.used; i++ ) {
+        GLuint64 elapsed = 0;
+        glGetQueryObjectui64v( slot.queries[i], GL_QUERY_RESULT, &elapsed );
+        gpuMs[slot.stages[i]] += elapsed * 1e-6;
+    }
+    mLastGpuFrameMs = 0;
+    for( size_t i = 0; i < mStages.size(); i++ ) {
+        mStages[i].gpu.push( float( gpuMs[i] ) );
+        mLastGpuFrameMs += gpuMs[i];
+    }
+
+    if( mCsv.is_open() ) {
+        mCsv << slot.frame << "," << slot.frameMs;
+        for( size_t i = 0; i < mStages.size(); i++ )
+            mCsv << "," << slot.cpuMs[i] << "," << gpuMs[i];
+        mCsv << "\n";
+    }
+}
+
+StageProfiler::Stats StageProfiler::getCpuStats( int stage ) const
+{
+    return mStages[stage].cpu.getStats();
+}
+
+StageProfiler::Stats StageProfiler::getGpuStats( int stage ) const
+{
+    return mStages[stage].gpu.getStats();
+}
+
+StageProfiler::Stats StageProfiler::getFrameStats() const
+{
+    return mFrameHistory.getStats();
+}
+
+void StageProfiler::addParams( const params::InterfaceGlRef &params )
+{
+    params->addText( "Timings (ms): cpu / gpu, gpu p95" );
+    params->addParam( "Frame", &mFrameLabel, true );
+    for( auto &stage : mStages )
+        params->addParam( stage.name, &stage.label, true );
+}
+
+void StageProfiler::updateLabels()
+{
+    char text[96];
+    Stats frame = mFrameHistory.getStats();
+    snprintf( text, sizeof( text ), "%.2f (p95 %.2f, p99 %.2f)", frame.mean, frame.p95, frame.p99 );
+    mFrameLabel = text;
+
+    for( auto &stage : mStages ) {
+        Stats cpu = stage.cpu.getStats();
+        Stats gpu = stage.gpu.getStats();
+        snprintf( text, sizeof( text ), "%.2f / %.2f, %.2f", cpu.mean, gpu.mean, gpu.p95 );
+        stage.label = text;
+    }
+}
+
+void StageProfiler::startCsv( const fs::path &path )
+{
+    stopCsv();
+    mCsv.open( path.string().c_str(), ios::trunc );
+    if( ! mCsv.is_open() ) {
+        console() << "Could not write profile to " << path << endl;
+        return;
+    }
+
+    mCsv << "frame,frame_ms";
+    for( auto &stage : mStages )
+        mCsv << "," << stage.name << " cpu_ms," << stage.name << " gpu_ms";
+    mCsv << "\n";
+    console() << "Writing profile to " << path << endl;
+}
+
+void StageProfiler::stopCsv()
+{
+    if( mCsv.is_open() )
+        mCsv.close();
+}
+
+void StageProfiler::History::push( float value )
+{
+    if( samples.empty() )
+        return;
+    samples[next] = value;
+    next = ( next + 1 ) % samples.size();
+    count = std::min( count + 1, samples.size() );
+}
+
+StageProfiler::Stats StageProfiler::History::getStats() const
+{
+    Stats stats;
+    if( count == 0 )
+        return stats;
+
+    vector<float> sorted( samples.begin(), samples.begin() + count );
+    std::sort( sorted.begin(), sorted.end() );
+
+    float sum = 0;
+    for( float s : sorted )
+        sum += s;
+    stats.mean = sum / count;
+    stats.p50 = sorted[( count - 1 ) * 50 / 100];
+    stats.p95 = sorted[( count - 1 ) * 95 / 100];
+    stats.p99 = sorted[( count - 1 ) * 99 / 100];
+    return stats;
+}
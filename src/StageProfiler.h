@@ -0,0 +1,118 @@
+//
+//  StageProfiler.h
+//  MusicalSmoke
+//
+//  CPU and GPU timing of the render stages. GPU time is measured with
+//  GL_TIME_ELAPSED queries that are read back a few frames later, so the
+//  profiler never waits for the GPU.
+//
+
+#ifndef StageProfiler_h
+#define StageProfiler_h
+
+#include "cinder/gl/gl.h"
+#include "cinder/Filesystem.h"
+#include "cinder/params/Params.h"
+
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+
+class StageProfiler{
+
+public:
+    struct Stats {
+        float mean = 0, p50 = 0, p95 = 0, p99 = 0;
+    };
+
+    ~StageProfiler();
+
+    //! Declares the stages. Their index is the id passed to begin() and end().
+    void setup( const std::vector<std::string> &stageNames, size_t historyLength = 240 );
+
+    //! Marks the start of a frame and collects the GPU results that have become available.
+    void beginFrame();
+
+    //! Times a stage. A stage may run several times per frame; its times add up. Stages must not nest.
+    void begin( int stage );
+    void end( int stage );
+
+    //! Rolling statistics over the last historyLength frames, in milliseconds.
+    Stats getCpuStats( int stage ) const;
+    Stats getGpuStats( int stage ) const;
+    Stats getFrameStats() const;
+    //! Summed GPU time of all stages in the most recently collected frame, in milliseconds.
+    double getLastGpuFrameTime() const { return mLastGpuFrameMs; }
+
+    //! Adds a read-only line per stage to \a params, refreshed by beginFrame() twice a second.
+    void addParams( const cinder::params::InterfaceGlRef &params );
+
+    //! Appends one row per frame, with CPU and GPU time of every stage, to \a path.
+    void startCsv( const cinder::fs::path &path );
+    void stopCsv();
+    bool isWritingCsv() const { return mCsv.is_open(); }
+
+    size_t getNumStages() const { return mStages.size(); }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    //! Rolling window of samples.
+    struct History {
+        std::vector<float>  samples;
+        size_t              next = 0, count = 0;
+
+        void  push( float value );
+        Stats getStats() const;
+    };
+
+    struct Stage {
+        std::string         name;
+        History             cpu, gpu;
+        Clock::time_point   started;
+        std::string         label;
+    };
+
+    //! Queries and CPU totals of one frame in flight.
+    struct FrameSlot {
+        std::vector<GLuint>     queries;    // pool, grows to the most queries issued in a frame
+        std::vector<int>        stages;     // stage of each issued query
+        size_t                  used = 0;
+        std::vector<double>     cpuMs;
+        double                  frameMs = 0;
+        uint64_t                frame = 0;
+        bool                    pending = false;
+    };
+
+    void collect( FrameSlot &slot );
+    void updateLabels();
+
+    static const int NumFrameSlots = 3;
+
+    std::vector<Stage>  mStages;
+    History             mFrameHistory;
+    FrameSlot           mSlots[NumFrameSlots];
+    int                 mSlot = 0;
+    uint64_t            mFrame = 0;
+    Clock::time_point   mFrameStarted;
+    Clock::time_point   mLabelsUpdated;
+    int                 mActiveStage = -1;
+    double              mLastGpuFrameMs = 0;
+
+    std::string         mFrameLabel;
+    std::ofstream       mCsv;
+};
+
+//! Times a stage for the lifetime of the object.
+class ScopedStage {
+public:
+    ScopedStage( StageProfiler &profiler, int stage ) : mProfiler( profiler ), mStage( stage ) { mProfiler.begin( mStage ); }
+    ~ScopedStage() { mProfiler.end( mStage ); }
+
+private:
+    StageProfiler   &mProfiler;
+    int             mStage;
+};
+
+#endif /* StageProfiler_h */
@@ -0,0 +1,110 @@
+//
+//  WorkerPool.cpp
+//  MusicalSmoke
+//
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+#include "WorkerPool.h"
+
+using namespace std;
+
+WorkerPool::WorkerPool( size_t numThreads )
+{
+    if( numThreads == 0 )
+        numThreads = std::max( 1u, thread::hardware_concurrency() ) - 1;
+    numThreads = std::max<size_t>( numThreads, 1 );
+
+    for( size_t i = 0; i < numThreads; i++ )
+        mThreads.emplace_back( &WorkerPool::run, this );
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        lock_guard<mutex> lock( mMutex );
+        mStopping = true;
+    }
+    mCondition.notify_all();
+    for( auto &t : mThreads )
+        t.join();
+}
+
+void WorkerPool::submit( const function<void()> &task )
+{
+    {
+        lock_guard<mutex> lock( mMutex );
+        mTasks.push_back( task );
+    }
+    mCondition.notify_one();
+}
+
+void WorkerPool::run()
+{
+    while( true ) {
+        function<void()> task;
+        {
+            unique_lock<mutex> lock( mMutex );
+            mCondition.wait( lock, [this] { return mStopping || ! mTasks.empty(); } );
+            if( mTasks.empty() )
+                return;
+            task = std::move( mTasks.front() );
+            mTasks.pop_front();
+        }
+        task();
+    }
+}
+
+void WorkerPool::parallelFor( size_t count, size_t grain, const function<void( size_t, size_t )> &fn )
+{
+    grain = std::max<size_t>( grain, 1 );
+    const size_t numChunks = ( count + grain - 1 ) / grain;
+    if( numChunks <= 1 ) {
+        if( count > 0 )
+            fn( 0, count );
+        return;
+    }
+
+    // helpers may start after we have returned, so the shared state outlives this call
+    struct Job {
+        function<void( size_t, size_t )>    fn;
+        size_t                              count, grain, numChunks;
+        atomic<size_t>                      next, done;
+        mutex                               doneMutex;
+        condition_variable                  doneCondition;
+
+        //! Takes chunks until there are none left.
+        void work()
+        {
+            size_t chunk;
+            while( ( chunk = next++ ) < numChunks ) {
+                size_t begin = chunk * grain;
+                fn( begin, std::min( begin + grain, count ) );
+                if( ++done == numChunks ) {
+                    lock_guard<mutex> lock( doneMutex );
+                    doneCondition.notify_all();
+                }
+            }
+        }
+    };
+
+    auto job = make_shared<Job>();
+    job->fn = fn;
+    job->count = count;
+    job->grain = grain;
+    job->numChunks = numChunks;
+    job->next = 0;
+    job->done = 0;
+
+    size_t numHelpers = std::min( mThreads.size(), numChunks - 1 );
+    for( size_t i = 0; i < numHelpers; i++ )
+        submit( [job] { job->work(); } );
+
+    // the calling thread works too, so this finishes even when every worker is busy
+    job->work();
+
+    unique_lock<mutex> lock( job->doneMutex );
+    job->doneCondition.wait( lock, [&] { return job->done == job->numChunks; } );
+}
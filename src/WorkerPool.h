@@ -0,0 +1,46 @@
+//
+//  WorkerPool.h
+//  MusicalSmoke
+//
+//  A fixed set of worker threads for CPU work that must stay off the render
+//  thread, or that can be split across cores.
+//
+
+#ifndef WorkerPool_h
+#define WorkerPool_h
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class WorkerPool{
+
+public:
+    //! Starts \a numThreads workers, or one less than the number of cores when 0.
+    explicit WorkerPool( size_t numThreads = 0 );
+    //! Finishes the queued tasks and joins the workers.
+    ~WorkerPool();
+
+    //! Queues \a task to run on a worker.
+    void submit( const std::function<void()> &task );
+
+    //! Calls \a fn( begin, end ) for chunks of at most \a grain items covering [0, \a count), spread over the
+    //! workers and the calling thread, and returns once all chunks are done. Safe to call from a worker.
+    void parallelFor( size_t count, size_t grain, const std::function<void( size_t, size_t )> &fn );
+
+    size_t getNumThreads() const { return mThreads.size(); }
+
+private:
+    void run();
+
+    std::vector<std::thread>            mThreads;
+    std::deque<std::function<void()>>   mTasks;
+    std::mutex                          mMutex;
+    std::condition_variable             mCondition;
+    bool                                mStopping = false;
+};
+
+#endif /* WorkerPool_h */